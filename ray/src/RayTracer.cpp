@@ -6,6 +6,7 @@
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "scene/stats.h"
 
 #include "parser/JsonParser.h"
 #include "parser/Parser.h"
@@ -19,9 +20,9 @@
 #include <glm/gtx/io.hpp>
 #include <string.h> // for memset
 
+#include <chrono>
 #include <fstream>
 #include <iostream>
-#include <random>
 
 using namespace std;
 extern TraceUI *traceUI;
@@ -31,11 +32,11 @@ extern TraceUI *traceUI;
 bool debugMode = true;
 
 // Done?
-// Trace a top-level ray through pixel(i,j), i.e. normalized window coordinates
-// (x,y), through the projection plane, and out into the scene. All we do is
-// enter the main ray-tracing method, getting things started by plugging in an
-// initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
-glm::dvec3 RayTracer::trace(double x, double y)
+// The top-level ray for the sample in stream of pixel (i,j): through the pixel's
+// normalized window coordinates, through the projection plane, and out
+// into the scene. With anti-aliasing on, the first two dimensions of the
+// stream place it within the pixel.
+ray RayTracer::cameraRay(int i, int j, SampleStream &stream)
 {
 	// Clear out the ray cache in the scene for debugging purposes,
 	if (TraceUI::m_debug)
@@ -43,61 +44,106 @@ glm::dvec3 RayTracer::trace(double x, double y)
 		scene->clearIntersectCache();
 	}
 
+	double x = double(i);
+	double y = double(j);
+	if (traceUI->aaSwitch() && samples > 1)
+	{
+		glm::dvec2 u = stream.next2D();
+		x += 2.0 * u[0] - 1.0;
+		y += 2.0 * u[1] - 1.0;
+	}
 	ray r(glm::dvec3(0, 0, 0), glm::dvec3(0, 0, 0), glm::dvec3(1, 1, 1),
 		  ray::VISIBILITY);
-	scene->getCamera().rayThrough(x, y, r);
-	double dummy;
-	glm::dvec3 initialColorMulitplier(1.0, 1.0, 1.0);
-	glm::dvec3 ret =
-		tracePath(r, glm::dvec3(1.0, 1.0, 1.0), 0, initialColorMulitplier);
-//            traceRay(r, glm::dvec3(1.0, 1.0, 1.0), traceUI->getDepth(), dummy, initialColorMulitplier);
-	ret = glm::clamp(ret, 0.0, 1.0);
-	return ret;
+	scene->getCamera().rayThrough(x / double(buffer_width), y / double(buffer_height), r);
+	RenderStats::add(RenderStats::PrimaryRays);
+	return r;
 }
 
-// Done.
+// Adds one path's colour to a pixel. The pixel is done for good at
+// maxSamples, or once the 95% confidence interval of its colour is within
+// aaThresh (checked once minSamples are in).
+void RayTracer::addSample(PixelAccumulator &acc, const glm::dvec3 &sample)
+{
+	acc.sum += sample;
+	int n = ++acc.count;
+	glm::dvec3 delta = sample - acc.mean;
+	acc.mean += delta / double(n);
+	acc.m2 += delta * (sample - acc.mean);
+	bool done = n >= maxSamples;
+	if (!done && n >= minSamples && n > 1)
+	{
+		glm::dvec3 variance = acc.m2 / double(n - 1);
+		double worst = std::max(variance[0], std::max(variance[1], variance[2]));
+		done = 1.96 * std::sqrt(worst / n) <= aaThresh;
+	}
+	if (done)
+	{
+		acc.converged = true;
+		pixelsLeft--;
+	}
+}
+
+// One progressive pass over a pixel: add up to passSamples more paths to
+// its accumulator and return the running average. Sample n of the pixel
+// takes its random numbers from the sampler at (pixel, n).
 glm::dvec3 RayTracer::tracePixel(int i, int j)
 {
-    int N = 100;
 	glm::dvec3 color(0, 0, 0);
 	if (!sceneLoaded())
 		return color;
 
-	unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
-	bool antiAlias = traceUI->aaSwitch();
-	if (!antiAlias || traceUI->getSuperSamples() <= 1)
+	int pixel = i + j * buffer_width;
+	PixelAccumulator &acc = accum[pixel];
+
+	int target = std::min(acc.count + passSamples, maxSamples);
+	while (!acc.converged && acc.count < target)
 	{
-		double x = double(i) / double(buffer_width);
-		double y = double(j) / double(buffer_height);
-        for (int i = 0; i < N; i ++) {
-            color += trace(x, y);
-        }
-		color /= glm::dvec3(N);
+		SampleStream stream(*sampler, pixel, acc.count);
+		ray r = cameraRay(i, j, stream);
+		addSample(acc, glm::clamp(tracePath(r, stream), 0.0, 1.0));
 	}
-	else
+	if (acc.count > 0)
+		color = acc.sum / glm::dvec3(acc.count);
+	return color;
+}
+
+// Brings the 8-bit display buffer up to date with the accumulator. While a
+// frame renders, each tile is read under the lock its workers hold; a tile
+// that is being traced right now is skipped and catches up next time.
+void RayTracer::resolveBuffer()
+{
+	if (checkRender())
 	{
-		// Sample NxN pixels and average the color.
-        int aaLevel = traceUI->getSuperSamples();
-		double aaOffsetStep = 2.0 / double(aaLevel);
-		int samples = 0;
-		for (double xAaOffset = aaOffsetStep - 1; xAaOffset <= 1 - aaOffsetStep; xAaOffset += aaOffsetStep)
+		resolvePixels(0, 0, buffer_width, buffer_height);
+		return;
+	}
+	for (int t = 0; t < tileScheduler.tileCount(); t++)
+	{
+		std::unique_lock<std::mutex> tileGuard(tileLocks[t], std::try_to_lock);
+		if (!tileGuard.owns_lock())
+			continue;
+		const Tile &tile = tileScheduler.tileAt(t);
+		resolvePixels(tile.x0, tile.y0, tile.x1, tile.y1);
+	}
+}
+
+void RayTracer::resolvePixels(int x0, int y0, int x1, int y1)
+{
+	for (int j = y0; j < y1; j++)
+	{
+		for (int i = x0; i < x1; i++)
 		{
-			double x = (double(i) + xAaOffset) / double(buffer_width);
-			for (double yAaOffset = aaOffsetStep - 1; yAaOffset <= 1 - aaOffsetStep; yAaOffset += aaOffsetStep)
-			{
-				double y = (double(j) + yAaOffset) / double(buffer_height);
-                for (int i = 0; i < N; i ++) {
-                    color += trace(x, y);
-                    samples += 1;
-                }
-			}
+			size_t k = i + (size_t)j * buffer_width;
+			const PixelAccumulator &acc = accum[k];
+			glm::dvec3 color(0, 0, 0);
+			if (acc.count > 0)
+				color = acc.sum / glm::dvec3(acc.count);
+			unsigned char *pixel = buffer.data() + k * 3;
+			pixel[0] = (int)(255.0 * color[0]);
+			pixel[1] = (int)(255.0 * color[1]);
+			pixel[2] = (int)(255.0 * color[2]);
 		}
-		color /= glm::dvec3(samples);
 	}
-	pixel[0] = (int)(255.0 * color[0]);
-	pixel[1] = (int)(255.0 * color[1]);
-	pixel[2] = (int)(255.0 * color[2]);
-	return color;
 }
 
 #define VERBOSE 0
@@ -105,7 +151,7 @@ glm::dvec3 RayTracer::tracePixel(int i, int j)
 // Do recursive ray tracing! You'll want to insert a lot of code here (or places
 // called from here) to handle reflection, refraction, etc etc.
 glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
-							   double &t, glm::dvec3 colorMultiplier)
+							   double &t, glm::dvec3 colorMultiplier, Rng &rng)
 {
 	isect i;
 	glm::dvec3 colorC;
@@ -119,7 +165,7 @@ glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
 	else if (scene->intersect(r, i))
 	{
 		const Material &m = i.getMaterial(); // 1. get the material.
-		colorC = m.shade(scene.get(), r, i);
+		colorC = m.shade(scene.get(), r, i, rng);
 		glm::dvec3 normal = i.getN();
 		bool insideMesh = glm::dot(-r.getDirection(), normal) < 0;
 		double d = 0;
@@ -147,7 +193,8 @@ glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
 			glm::dvec3 reflDir = glm::reflect(r.getDirection(), reflectNorm);
 			glm::dvec3 reflPos = r.at(i) + RAY_EPSILON * reflectNorm;
 			ray reflRay = ray(reflPos, reflDir, glm::dvec3(1.0, 1.0, 1.0), ray::REFLECTION);
-			glm::dvec3 reflResult = m.kr(i) * traceRay(reflRay, thresh, depth - 1, t, colorMultiplier * m.kr(i));
+			RenderStats::add(RenderStats::BounceRays);
+			glm::dvec3 reflResult = m.kr(i) * traceRay(reflRay, thresh, depth - 1, t, colorMultiplier * m.kr(i), rng);
 			colorC += reflResult;
 		}
 		if (m.Trans())
@@ -168,7 +215,8 @@ glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
 				refractPos = r.at(i.getT() - RAY_EPSILON);
 			}
 			ray refractRay = ray(refractPos, refractDir, glm::dvec3(1.0, 1.0, 1.0), ray::REFRACTION);
-			glm::dvec3 refractResult = traceRay(refractRay, thresh, depth - 1, t, colorMultiplier);
+			RenderStats::add(RenderStats::RefractionRays);
+			glm::dvec3 refractResult = traceRay(refractRay, thresh, depth - 1, t, colorMultiplier, rng);
 			colorC += refractResult;
 		}
 		if (insideMesh)
@@ -218,93 +266,224 @@ double ndfRay(double alpha, glm::dvec3 H, glm::dvec3 N) {
     return ret;
 }
 
-glm::dvec3 RayTracer::tracePath(ray &r, const glm::dvec3 &thresh, int depth, glm::dvec3 colorMultiplier)
+// Power heuristic weight for a sample drawn with pdf a, where another
+// strategy could have drawn it with pdf b
+static double powerHeuristic(double a, double b) {
+    return a * a / (a * a + b * b);
+}
+
+// Every decision along a path draws from fixed sample dimensions: the
+// sub-pixel position first, then a block per bounce. A given dimension
+// then always means the same thing, which keeps low-discrepancy samplers
+// well spread.
+namespace {
+const uint32_t PixelDimensions = 4;
+const uint32_t BounceDimensions = 8;
+// Offsets into a bounce's block
+const uint32_t LightPointDimension = 0; // up to three
+const uint32_t LightPickDimension = 3;
+const uint32_t BrdfDimension = 4;       // three
+const uint32_t RouletteDimension = 7;
+} // anonymous namespace
+
+// What a ray that leaves the scene picks up: the cube map if one is
+// loaded, black otherwise
+glm::dvec3 RayTracer::background(const ray &r) const
 {
-    isect i;
-    glm::dvec3 colorC;
-    if (scene->intersect(r, i))
-    {
-        const Material &m = i.getMaterial();
-        double russianRoulette = (double) rand() / (double)RAND_MAX;
-        if (russianRoulette < 0.1) {
-            return glm::dvec3(0);
+    CubeMap* theMap = traceUI->getCubeMap();
+    return theMap ? theMap->getColor(r) : glm::dvec3(0.0, 0.0, 0.0);
+}
+
+// One bounce of path at its hit i; both engines trace paths with this.
+// Adds what the hit emits toward the camera to color. Direct light comes
+// from one light sample (next-event estimation): when castShadow comes
+// back true, shadow holds the ray to trace and what to add to the path's
+// colour if nothing blocks it. Emitters the path runs into are weighted
+// against that sample with the power heuristic, so nothing is counted
+// twice.
+//
+// The path then bounces in a direction importance-sampled from the BRDF,
+// at most maxDepth times, and path is updated to the bounce ray. From
+// rrDepth bounces on it survives Russian roulette with a probability
+// given by its throughput, and is reweighted to stay unbiased, so dim
+// paths end early and bright ones carry on. Returns false when the path
+// ends here.
+bool RayTracer::bounce(PathState &path, const isect &i, SampleStream &samples,
+                       glm::dvec3 &color, ShadowQuery &shadow, bool &castShadow)
+{
+    castShadow = false;
+    const ray &r = path.r;
+    const Material &m = i.getMaterial();
+    glm::dvec3 normal = i.getN();
+    glm::dvec3 startPos = r.at(i);
+    glm::dvec3 wo = -r.getDirection();
+    // Shade the side the ray arrived on
+    if (glm::dot(normal, wo) < 0)
+        normal = -normal;
+
+    if (m.Emissive()) {
+        glm::dvec3 emitted = m.ke(i);
+        double pick = path.bsdfPdf > 0 ? scene->emitterPickPdf(i.getObject()) : 0.0;
+        if (pick > 0) {
+            double lightPdf = pick * i.getObject()->surfacePdf(i.getN()) *
+                              i.getT() * i.getT() / glm::dot(normal, wo);
+            emitted *= powerHeuristic(path.bsdfPdf, lightPdf);
         }
-        glm::dvec3 indirectColor = glm::dvec3(0);
-        glm::dvec3 normal = i.getN();
-        glm::dvec3 startPos = r.at(i);
-
-        glm::dvec3 Nt;
-        if (glm::abs(normal.x) > glm::abs(normal.y))
-            Nt = glm::dvec3(normal.z, 0, -normal.x) / glm::sqrt(normal.x * normal.x + normal.z * normal.z);
-        else
-            Nt = glm::dvec3(0, -normal.z, normal.y) / glm::sqrt (normal.y * normal.y + normal.z * normal.z);
-        glm::dvec3 Nb = glm::cross(normal, Nt);
-
-
-        double r1 = (double) rand() / (double)RAND_MAX; // cos(theta)
-
-        double sinTheta = glm::sqrt(1 - r1 * r1);
-        double phi =  (double) rand() / (double)RAND_MAX * 2 * M_PI;
-        float x = sinTheta * glm::cos(phi);
-        float z = sinTheta * glm::sin(phi);
-        glm::dvec3 randomDir = glm::dvec3(x, r1, z);
-
-        glm:: dvec3 convertedRandomDir = glm::dvec3(
-                randomDir.x * Nb.x + randomDir.y * normal.x + randomDir.z * Nt.x,
-                randomDir.x * Nb.y + randomDir.y * normal.y + randomDir.z * Nt.y,
-                randomDir.x * Nb.z + randomDir.y * normal.z + randomDir.z * Nt.z
-        );
-        convertedRandomDir = glm::normalize(convertedRandomDir);
-
-        ray randomRay = ray(startPos + convertedRandomDir * RAY_EPSILON, convertedRandomDir, glm::dvec3(1.0, 1.0, 1.0), ray::VISIBILITY);
-
-        double pdf = 1 / (2 * M_PI);
-        indirectColor += tracePath(randomRay, thresh, depth + 1, colorMultiplier);
-        indirectColor /= pdf;
-
-        ray wIn = ray(startPos, -convertedRandomDir, glm::dvec3(1.0, 1.0, 1.0), ray::VISIBILITY);
-        ray wOut = ray(r.at(i), glm::normalize(-r.getDirection()), glm::dvec3(1.0, 1.0, 1.0), ray::VISIBILITY);
-        colorC = m.shadeBRDF(scene.get(), wIn, wOut, indirectColor, i);
-        double fireReflection = (double) rand() / (double)RAND_MAX;
-        if (m.roughness(i) < fireReflection) {
-            glm::dvec3 reflDir = glm::reflect(r.getDirection(), normal);
-            glm::dvec3 reflPos = r.at(i) + RAY_EPSILON * normal;
-            ray reflRay = ray(reflPos, reflDir, glm::dvec3(1.0, 1.0, 1.0), ray::REFLECTION);
-            glm::dvec3 reflResult = tracePath(reflRay, thresh, depth + 1, colorMultiplier);
-            colorC += reflResult;
-            colorC /= 2;
+        color += path.throughput * emitted;
+    }
+    color += path.throughput * m.ka(i) * scene->ambient();
+
+    uint32_t block = PixelDimensions + path.depth * BounceDimensions;
+
+    // Next-event estimation: one light, picked by power
+    double pickPdf;
+    samples.skipTo(block + LightPickDimension);
+    const Light *light = scene->pickLight(samples, pickPdf);
+    glm::dvec3 firePos = startPos + normal * RAY_EPSILON * 3.0;
+    LightSample ls;
+    samples.skipTo(block + LightPointDimension);
+    if (light && light->sampleLight(firePos, samples, ls)) {
+        glm::dvec3 f = m.eval(i, normal, wo, ls.direction);
+        if (f != glm::dvec3(0)) {
+            glm::dvec3 directColor = ls.radiance * f / pickPdf;
+            // Delta lights can't be hit by a bounce, so they keep it all
+            if (ls.pdf > 0)
+                directColor *= powerHeuristic(pickPdf * ls.pdf, m.pdf(i, normal, wo, ls.direction)) / ls.pdf;
+            shadow.r = ray(firePos, ls.direction, glm::dvec3(1.0, 1.0, 1.0), ray::SHADOW);
+            shadow.distance = ls.distance;
+            shadow.weight = path.throughput * directColor;
+            shadow.slot = path.slot;
+            shadow.deltaLight = ls.pdf > 0 ? nullptr : light;
+            castShadow = true;
         }
-        colorC /= 0.9; // russian roulette
     }
-    else
+
+    if (path.depth >= maxDepth)
+        return false;
+
+    // Continue the path in a direction importance-sampled from the BRDF
+    glm::dvec3 wi;
+    double pdf;
+    samples.skipTo(block + BrdfDimension);
+    if (!m.sample(i, normal, wo, samples, wi, pdf))
+        return false;
+    glm::dvec3 f = m.eval(i, normal, wo, wi);
+    if (f == glm::dvec3(0))
+        return false;
+    path.throughput *= f / pdf;
+
+    if (path.depth >= rrDepth) {
+        glm::dvec3 &throughput = path.throughput;
+        double survive = glm::min(1.0, glm::max(throughput[0], glm::max(throughput[1], throughput[2])));
+        samples.skipTo(block + RouletteDimension);
+        if (samples.next1D() >= survive)
+            return false;
+        throughput /= survive;
+    }
+
+    path.r = ray(startPos + wi * RAY_EPSILON, wi, glm::dvec3(1.0, 1.0, 1.0), ray::VISIBILITY);
+    RenderStats::add(RenderStats::BounceRays);
+    path.bsdfPdf = pdf;
+    path.depth++;
+    return true;
+}
+
+// Follow one path from the camera ray to its end (the megakernel engine)
+// and add up the light that reaches the camera along it.
+glm::dvec3 RayTracer::tracePath(const ray &cameraRay, SampleStream &samples)
+{
+    PathState path(cameraRay);
+    glm::dvec3 colorC(0.0, 0.0, 0.0);
+    ShadowQuery shadow;
+    bool castShadow;
+    while (true)
     {
-//        printf("Missed intersection\n");
-        // No intersection. This ray travels to infinity, so we color
-        // it according to the background color, which in this (simple)
-        // case is just black.
-        //
-        // FIXME: Add CubeMap support here.
-        // TIPS: CubeMap object can be fetched from
-        // traceUI->getCubeMap();
-        //       Check traceUI->cubeMap() to see if cubeMap is loaded
-        //       and enabled.
-
-        // MY CODE HERE:
-        if (traceUI->getCubeMap())
+        isect i;
+        if (!scene->intersect(path.r, i))
         {
-            // There is a cube map.
-            CubeMap* theMap = traceUI->getCubeMap();
-            colorC = theMap->getColor(r);
-        }
-        else
-        {
-            // THere is no cube map, return black.
-            colorC = glm::dvec3(0.0, 0.0, 0.0);
+            colorC += path.throughput * background(path.r);
+            break;
         }
+        bool more = bounce(path, i, samples, colorC, shadow, castShadow);
+        if (castShadow)
+            colorC += shadow.weight * scene->transmittance(shadow.r, shadow.distance);
+        if (!more)
+            break;
     }
     return colorC;
 }
 
+// The wavefront version of one pass over a tile. Every pixel in the tile
+// that is still converging gets its next passSamples camera rays, and the
+// whole batch is traced a stage at a time. The results are added to the
+// pixels in sample order with the same stopping test as tracePixel, so a
+// pixel that stops part way wastes the rest of its batch but ends up with
+// exactly the samples the megakernel would have given it.
+void RayTracer::traceTileWavefront(Wavefront &wavefront, const Tile &tile)
+{
+    // A pixel in the batch: its first slot and how many samples it takes
+    struct Batch {
+        int pixel;
+        int first;
+        int count;
+    };
+    std::vector<Batch> batch;
+    int slots = 0;
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            int pixel = i + j * buffer_width;
+            const PixelAccumulator &acc = accum[pixel];
+            if (acc.converged)
+                continue;
+            int count = std::min(acc.count + passSamples, maxSamples) - acc.count;
+            batch.push_back({pixel, slots, count});
+            slots += count;
+        }
+    }
+    if (batch.empty())
+        return;
+
+    // Generate the camera rays
+    wavefront.reset(slots);
+    wavefront.setPacketSize(packetSize);
+    for (const Batch &b : batch) {
+        int i = b.pixel % buffer_width;
+        int j = b.pixel / buffer_width;
+        for (int s = 0; s < b.count; s++) {
+            uint32_t index = accum[b.pixel].count + s;
+            SampleStream stream(*sampler, b.pixel, index);
+            wavefront.addPath(PathState(cameraRay(i, j, stream), b.pixel, index, b.first + s));
+        }
+    }
+
+    // Extend every path by a bounce per round until none are left
+    ShadowQuery shadow;
+    bool castShadow;
+    do {
+        wavefront.intersect(*scene);
+        wavefront.sortHits();
+        for (int k = 0; k < wavefront.pathCount(); k++) {
+            PathState &path = wavefront.path(k);
+            glm::dvec3 &color = wavefront.radiance(path.slot);
+            if (!wavefront.hit(k)) {
+                color += path.throughput * background(path.r);
+                continue;
+            }
+            SampleStream samples(*sampler, path.pixel, path.index);
+            if (bounce(path, wavefront.hitInfo(k), samples, color, shadow, castShadow))
+                wavefront.continuePath(path);
+            if (castShadow)
+                wavefront.addShadow(shadow);
+        }
+        wavefront.traceShadows(*scene);
+    } while (wavefront.advance());
+
+    for (const Batch &b : batch) {
+        PixelAccumulator &acc = accum[b.pixel];
+        for (int s = 0; s < b.count && !acc.converged; s++)
+            addSample(acc, glm::clamp(wavefront.radiance(b.first + s), 0.0, 1.0));
+    }
+}
 
 // Ignore for now.
 RayTracer::RayTracer()
@@ -314,10 +493,41 @@ RayTracer::RayTracer()
 }
 
 // Ignore for now.
-RayTracer::~RayTracer() {}
+RayTracer::~RayTracer()
+{
+	// Workers still hold the scene, the buffer and the schedulers, so stop
+	// them and join the pool before any of those members go away.
+	progressCallback = nullptr;
+	stopTrace = true;
+	waitRender();
+	pool.reset();
+}
+
+// The pool lives as long as the tracer and is only rebuilt when the thread
+// count setting changes between renders.
+ThreadPool &RayTracer::workers()
+{
+	int wanted = std::max(traceUI->getThreads(), 1);
+	if (!pool || pool->size() != wanted)
+	{
+		pool.reset();
+		pool.reset(new ThreadPool(wanted));
+	}
+	return *pool;
+}
+
+void RayTracer::stopRender()
+{
+	if (!checkRender())
+	{
+		stopTrace = true;
+		waitRender();
+	}
+}
 
 void RayTracer::getBuffer(unsigned char *&buf, int &w, int &h)
 {
+	resolveBuffer();
 	buf = buffer.data();
 	w = buffer_width;
 	h = buffer_height;
@@ -332,6 +542,10 @@ double RayTracer::aspectRatio()
 // Done.
 bool RayTracer::loadScene(const char *fn)
 {
+	// Workers of a render still in flight read the old scene, so they have
+	// to finish before it is replaced.
+	stopRender();
+
 	ifstream ifs(fn);
 	if (!ifs)
 	{
@@ -411,9 +625,37 @@ bool RayTracer::loadScene(const char *fn)
 	if (!sceneLoaded())
 		return false;
 
+	// Textures and acceleration structures are built here rather than in
+	// the parsers, so both scene formats get them and they use the pool.
+	try
+	{
+		scene->loadTextures(workers());
+	}
+	catch (TextureMapException e)
+	{
+		string msg("Texture mapping exception: ");
+		msg.append(e.message());
+		traceUI->alert(msg);
+		scene.reset();
+		return false;
+	}
+	scene->buildTree(workers());
+
 	return true;
 }
 
+Scene &RayTracer::getSceneToEdit()
+{
+	stopRender();
+	return *scene;
+}
+
+bool RayTracer::updateScene()
+{
+	stopRender();
+	return scene->updateTree(workers());
+}
+
 void RayTracer::traceSetup(int w, int h)
 {
 	size_t newBufferSize = w * h * 3;
@@ -436,16 +678,53 @@ void RayTracer::traceSetup(int w, int h)
 	thresh = traceUI->getThreshold();
 	samples = traceUI->getSuperSamples();
 	aaThresh = traceUI->getAaThreshold();
+	maxSamples = std::max(traceUI->getMaxSamples(), 1);
+	minSamples = std::min(std::max(traceUI->getMinSamples(), 1), maxSamples);
+	passSamples = std::max(traceUI->getPassSamples(), 1);
+	timeBudget = traceUI->getTimeBudget();
+	maxDepth = std::max(traceUI->getDepth(), 0);
+	rrDepth = std::max(traceUI->getRussianRouletteDepth(), 0);
+	wavefrontEngine = traceUI->getEngine() == "wavefront";
+	packetSize = std::min(std::max(traceUI->getPacketSize(), 1), Scene::MaxPacketSize);
+
+	// Samples are indexed by pixel and sample number, so the image doesn't
+	// depend on thread scheduling or on how the samples are split into passes
+	accum.assign(w * h, PixelAccumulator());
+	sampler = Sampler::create(traceUI->getSampler(), traceUI->getSeed(), samples);
+	pixelsLeft = w * h;
 
 	// YOUR CODE HERE
 	// FIXME: Additional initializations
 }
 
-void RayTracer::processChunk(int start, int end, int h) {
-    for (int i = start; i < end; i++) {
-        for (int j = 0; j < h; j++) {
-            tracePixel(i, j);
+// Body of each render thread: keep pulling tiles until the frame is done.
+// stopTrace is checked before every tile, so a cancel takes effect within
+// one tile's worth of work.
+void RayTracer::renderTiles(int worker) {
+    // Slot 0 of the statistics belongs to threads outside the pool
+    ray_thread_id = worker + 1;
+    Tile tile;
+    while (!stopTrace && pixelsLeft > 0 && !outOfTime() && tileScheduler.next(worker, tile)) {
+        auto tileStart = std::chrono::steady_clock::now();
+        // Two passes over one tile can be in flight when a thief runs ahead
+        std::lock_guard<std::mutex> tileGuard(tileLocks[tile.index]);
+        if (wavefrontEngine) {
+            traceTileWavefront(wavefronts[worker], tile);
+        } else {
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    tracePixel(i, j);
+                }
+            }
         }
+        std::chrono::duration<double> tileTime = std::chrono::steady_clock::now() - tileStart;
+        tileScheduler.tileDone(worker, tileTime.count());
+    }
+    // The last worker out closes the frame
+    std::lock_guard<std::mutex> guard(renderLock);
+    if (--activeWorkers == 0) {
+        tileScheduler.finish();
+        renderDone.notify_all();
     }
 }
 
@@ -461,6 +740,12 @@ void RayTracer::processChunk(int start, int end, int h) {
  */
 void RayTracer::traceImage(int w, int h)
 {
+	// Workers write straight into the buffer, so finish off any render
+	// still in flight before traceSetup resizes it.
+	stopRender();
+	stopTrace = false;
+	RenderStats::reset();
+
 	// Always call traceSetup before rendering anything.
 	traceSetup(w, h);
 	// YOUR CODE HERE
@@ -479,15 +764,23 @@ void RayTracer::traceImage(int w, int h)
 //            tracePixel(i, j);
 //        }
 //	}
-    int chunkSize = w / this->threads;
-    for (int t = 0; t < this->threads; t++) {
-        int start = t * chunkSize;
-        int end = (t == this->threads - 1) ? w : start + chunkSize; // Ensure last thread covers the remainder
-        threadsVec.emplace_back([this, start, end, h]() { this->processChunk(start, end, h); });
+    // Tiles are block_size pixels square and handed out with work stealing,
+    // so cheap regions of the frame don't leave threads idle.
+    // Returns straight away; use checkRender/waitRender/getProgress to follow
+    // the frame.
+    // Each pass adds passSamples paths to every pixel still converging, so
+    // the frame is usable after the first pass and then keeps refining
+    // until every pixel is done or the time budget runs out.
+    ThreadPool &renderPool = workers();
+    int passes = (int)(((long long)maxSamples + passSamples - 1) / passSamples);
+    tileScheduler.setup(w, h, block_size, TileScheduler::parseOrder(traceUI->getTileOrder()), renderPool.size(), passes);
+    tileLocks.reset(new std::mutex[tileScheduler.tileCount()]);
+    // Kept between frames so the queues don't have to grow again
+    wavefronts.resize(renderPool.size());
+    activeWorkers = renderPool.size();
+    for (int t = 0; t < renderPool.size(); t++) {
+        renderPool.submit([this](int worker) { this->renderTiles(worker); });
     }
-
-    waitRender();
-
 }
 
 int RayTracer::aaImage()
@@ -500,6 +793,11 @@ int RayTracer::aaImage()
 	return 0;
 }
 
+bool RayTracer::outOfTime() const
+{
+	return timeBudget > 0.0 && tileScheduler.elapsed() >= timeBudget;
+}
+
 bool RayTracer::checkRender()
 {
 	// YOUR CODE HERE
@@ -508,7 +806,31 @@ bool RayTracer::checkRender()
 	//
 	// TIPS: Introduce an array to track the status of each worker thread.
 	//       This array is maintained by the worker threads.
-	return true;
+	return activeWorkers == 0;
+}
+
+RenderProgress RayTracer::getProgress() const
+{
+	RenderProgress progress;
+	progress.tilesDone = tileScheduler.completedTiles();
+	progress.tilesTotal = (long long)tileScheduler.tileCount() * tileScheduler.passCount();
+	progress.elapsed = tileScheduler.elapsed();
+	progress.timeBudget = timeBudget;
+	// Passes over pixels that are all done are never handed out
+	if (pixelsLeft == 0)
+		progress.tilesDone = progress.tilesTotal;
+	progress.eta = 0.0;
+	if (progress.tilesDone > 0 && progress.tilesDone < progress.tilesTotal)
+		progress.eta = progress.elapsed * (progress.tilesTotal - progress.tilesDone) / progress.tilesDone;
+	if (timeBudget > 0.0)
+		progress.eta = std::max(0.0, std::min(progress.eta, timeBudget - progress.elapsed));
+	return progress;
+}
+
+void RayTracer::setProgressCallback(ProgressCallback callback, double interval)
+{
+	progressCallback = callback;
+	progressInterval = interval;
 }
 
 void RayTracer::waitRender()
@@ -519,26 +841,64 @@ void RayTracer::waitRender()
 	//        traceImage implementation.
 	//
 	// TIPS: Join all worker threads here.
-    for (auto &th : threadsVec) {
-        th.join();
+    std::unique_lock<std::mutex> guard(renderLock);
+    if (!progressCallback) {
+        renderDone.wait(guard, [this]() { return activeWorkers == 0; });
+        return;
     }
-    threadsVec.clear();
+    // Report progress from the waiting thread, never from the workers
+    auto interval = std::chrono::duration<double>(progressInterval);
+    while (!renderDone.wait_for(guard, interval, [this]() { return activeWorkers == 0; })) {
+        guard.unlock();
+        progressCallback(getProgress());
+        guard.lock();
+    }
+    guard.unlock();
+    progressCallback(getProgress());
+}
+
+// Samples taken per pixel as a grey image, white being the most any pixel
+// got
+std::vector<unsigned char> RayTracer::getSampleCountImage() const
+{
+	int most = 1;
+	for (const PixelAccumulator &acc : accum)
+		most = std::max(most, acc.count);
+	std::vector<unsigned char> image(accum.size() * 3);
+	for (size_t k = 0; k < accum.size(); k++)
+	{
+		unsigned char level = (unsigned char)(255.0 * accum[k].count / most);
+		image[3 * k] = image[3 * k + 1] = image[3 * k + 2] = level;
+	}
+	return image;
+}
+
+double RayTracer::getAverageSampleCount() const
+{
+	if (accum.empty())
+		return 0.0;
+	double total = 0.0;
+	for (const PixelAccumulator &acc : accum)
+		total += acc.count;
+	return total / accum.size();
 }
 
 // Done.
 glm::dvec3 RayTracer::getPixel(int i, int j)
 {
-	unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
-	return glm::dvec3((double)pixel[0] / 255.0, (double)pixel[1] / 255.0,
-					  (double)pixel[2] / 255.0);
+	const PixelAccumulator &acc = accum[i + j * buffer_width];
+	if (acc.count == 0)
+		return glm::dvec3(0, 0, 0);
+	return acc.sum / glm::dvec3(acc.count);
 }
 
 // Done.
+// Replaces everything accumulated for the pixel with this one colour
 void RayTracer::setPixel(int i, int j, glm::dvec3 color)
 {
-	unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
-
-	pixel[0] = (int)(255.0 * color[0]);
-	pixel[1] = (int)(255.0 * color[1]);
-	pixel[2] = (int)(255.0 * color[2]);
+	PixelAccumulator &acc = accum[i + j * buffer_width];
+	acc.sum = color;
+	acc.mean = color;
+	acc.m2 = glm::dvec3(0, 0, 0);
+	acc.count = 1;
 }
@@ -5,13 +5,23 @@
 
 // The main ray tracer.
 
+#include "ThreadPool.h"
+#include "TileScheduler.h"
+#include "Wavefront.h"
 #include "scene/cubeMap.h"
 #include "scene/ray.h"
+#include "scene/rng.h"
+#include "scene/sampler.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <glm/vec3.hpp>
 #include <mutex>
 #include <queue>
 #include <thread>
 #include <time.h>
+#include <vector>
 
 class Scene;
 class Pixel {
@@ -24,6 +34,32 @@ public:
 };
 
 
+// Everything the progressive passes keep for one pixel. The display
+// buffer is resolved from sum / count.
+struct PixelAccumulator {
+  glm::dvec3 sum{0, 0, 0};
+  glm::dvec3 mean{0, 0, 0};
+  glm::dvec3 m2{0, 0, 0}; // Welford's running sum of squared differences
+  int count = 0;
+  bool converged = false; // no more samples wanted for this pixel
+};
+
+// Snapshot of how far the current frame has got
+struct RenderProgress {
+  long long tilesDone;
+  long long tilesTotal;
+  double elapsed;    // seconds since the frame started
+  double eta;        // estimated seconds left, 0 when unknown or done
+  double timeBudget; // seconds the frame may take, 0 for no limit
+
+  double fraction() const {
+    double done = tilesTotal > 0 ? (double)tilesDone / tilesTotal : 0.0;
+    if (timeBudget > 0.0)
+      done = std::max(done, std::min(elapsed / timeBudget, 1.0));
+    return done;
+  }
+};
+
 class RayTracer {
 public:
   RayTracer();
@@ -31,20 +67,36 @@ public:
 
   glm::dvec3 tracePixel(int i, int j);
   glm::dvec3 traceRay(ray &r, const glm::dvec3 &thresh, int depth,
-                      double &length, glm::dvec3 colorMultiplier);
-  glm::dvec3 tracePath(ray &r, const glm::dvec3 &thresh, int depth, glm::dvec3 colorMultiplier);
-  void processChunk(int start, int end, int h);
+                      double &length, glm::dvec3 colorMultiplier, Rng &rng);
+  glm::dvec3 tracePath(const ray &cameraRay, SampleStream &samples);
+  void renderTiles(int worker);
+  // One pass over a tile with the wavefront engine
+  void traceTileWavefront(Wavefront &wavefront, const Tile &tile);
 
   glm::dvec3 getPixel(int i, int j);
   void setPixel(int i, int j, glm::dvec3 color);
+  // Resolves the display buffer from the accumulator first
   void getBuffer(unsigned char *&buf, int &w, int &h);
+  void resolveBuffer();
+  // Sample-count AOV from adaptive sampling, same layout as the buffer
+  std::vector<unsigned char> getSampleCountImage() const;
+  double getAverageSampleCount() const;
   double aspectRatio();
 
+  // Starts the frame on the thread pool and returns immediately
   void traceImage(int w, int h);
   int aaImage();
+  // True once every worker has stopped, whether finished or cancelled
   bool checkRender();
   void waitRender();
 
+  // Safe to poll from the UI thread while a frame is rendering
+  RenderProgress getProgress() const;
+  // Called from waitRender() on the waiting thread every interval seconds
+  // and once more when the frame ends
+  typedef std::function<void(const RenderProgress &)> ProgressCallback;
+  void setProgressCallback(ProgressCallback callback, double interval = 1.0);
+
   void traceSetup(int w, int h);
 
   bool loadScene(const char *fn);
@@ -54,11 +106,27 @@ public:
   bool isReady() const { return m_bBufferReady; }
 
   const Scene &getScene() { return *scene; }
+  // For animation, between frames: move objects with
+  // getSceneToEdit().setObjectTransform() (and the camera with its
+  // getCamera()), then call updateScene() before the next traceImage().
+  // Both stop a render still in flight, since it reads the tree they change.
+  Scene &getSceneToEdit();
+  bool updateScene();
+  const TileScheduler &getTileScheduler() const { return tileScheduler; }
 
-  bool stopTrace;
+  // Set to cancel the current frame; workers stop after their current tile
+  std::atomic<bool> stopTrace{false};
 
 private:
-  glm::dvec3 trace(double x, double y);
+  ray cameraRay(int i, int j, SampleStream &stream);
+  bool bounce(PathState &path, const isect &i, SampleStream &samples,
+              glm::dvec3 &color, ShadowQuery &shadow, bool &castShadow);
+  glm::dvec3 background(const ray &r) const;
+  void addSample(PixelAccumulator &acc, const glm::dvec3 &sample);
+  void resolvePixels(int x0, int y0, int x1, int y1);
+  ThreadPool &workers();
+  void stopRender(); // cancels the current frame and waits for its workers
+  bool outOfTime() const;
 
   std::unique_ptr<Scene> scene;
   std::vector<unsigned char> buffer;
@@ -71,7 +139,26 @@ private:
   int block_size;
   double aaThresh;
   int samples;
-  std::vector<std::thread> threadsVec;
+  int minSamples;
+  int maxSamples;
+  int passSamples;
+  double timeBudget = 0.0;
+  int maxDepth = 10;  // bounces after the first hit
+  int rrDepth = 3;    // bounces before Russian roulette starts
+  bool wavefrontEngine = false;
+  int packetSize = 8; // rays per packet in the wavefront engine
+  std::atomic<int> pixelsLeft{0};
+  std::vector<PixelAccumulator> accum;
+  std::unique_ptr<Sampler> sampler;
+  std::unique_ptr<std::mutex[]> tileLocks;
+  std::unique_ptr<ThreadPool> pool;
+  std::vector<Wavefront> wavefronts; // one per render worker
+  TileScheduler tileScheduler;
+  std::atomic<int> activeWorkers{0};
+  std::mutex renderLock;
+  std::condition_variable renderDone;
+  ProgressCallback progressCallback;
+  double progressInterval = 1.0;
 
 };
 
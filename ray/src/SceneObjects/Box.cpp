@@ -3,6 +3,7 @@
 #include <cmath>
 
 #include "Box.h"
+#include "../scene/sampler.h"
 
 using namespace std;
 
@@ -51,7 +52,6 @@ bool Box::intersectLocal(ray &r, isect &i) const {
 
   i.setT(bestT);
   i.setObject(this);
-  i.setMaterial(this->getMaterial());
 
   // glm::dvec3 intersect_point = r.at((float)i.t);
   glm::dvec3 intersect_point = r.at(i);
@@ -72,3 +72,23 @@ bool Box::intersectLocal(ray &r, isect &i) const {
   }
   return true;
 }
+
+// Every face has unit area, so pick one and then a point on it, with the
+// same face numbering and uvs as intersectLocal()
+void Box::sampleLocalSurface(SampleStream &samples, glm::dvec3 &P, glm::dvec3 &N,
+                             glm::dvec2 &uv) const {
+  int face = min((int)(samples.next1D() * 6), 5);
+  int axis = face % 3;
+  int i1 = (face + 1) % 3;
+  int i2 = (face + 2) % 3;
+  glm::dvec2 u = samples.next2D();
+  P[axis] = (face / 3) - 0.5;
+  P[i1] = u[0] - 0.5;
+  P[i2] = u[1] - 0.5;
+  N = glm::dvec3(0.0);
+  N[axis] = face < 3 ? -1.0 : 1.0;
+  if (face < 3)
+    uv = glm::dvec2(0.5 - P[min(i1, i2)], 0.5 + P[max(i1, i2)]);
+  else
+    uv = glm::dvec2(0.5 + P[min(i1, i2)], 0.5 + P[max(i1, i2)]);
+}
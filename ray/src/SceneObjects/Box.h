@@ -20,6 +20,9 @@ public:
 protected:
   void glDrawLocal(int quality, bool actualMaterials,
                    bool actualTextures) const;
+  virtual double localSurfaceArea() const { return 6.0; }
+  virtual void sampleLocalSurface(SampleStream &samples, glm::dvec3 &P, glm::dvec3 &N,
+                                  glm::dvec2 &uv) const;
 };
 
 #endif // __BOX_H__
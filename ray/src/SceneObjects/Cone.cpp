@@ -100,7 +100,6 @@ bool Cone::intersectLocal(ray &r, isect &i) const {
   i.setT(theRoot);
   i.setN(glm::normalize(normal));
   i.setObject(this);
-  i.setMaterial(this->getMaterial());
   return true;
 
   return ret;
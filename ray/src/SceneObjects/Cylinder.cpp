@@ -7,7 +7,6 @@ using namespace std;
 bool Cylinder::intersectLocal(ray &r, isect &i) const {
   // FIXME: check these suspicious initialization.
   i.setObject(this);
-  i.setMaterial(this->getMaterial());
 
   if (intersectCaps(r, i)) {
     isect ii;
@@ -15,7 +14,6 @@ bool Cylinder::intersectLocal(ray &r, isect &i) const {
       if (ii.getT() < i.getT()) {
         i = ii;
         i.setObject(this);
-        i.setMaterial(this->getMaterial());
       }
     }
     return true;
@@ -1,6 +1,7 @@
 #include <cmath>
 
 #include "Sphere.h"
+#include "../scene/sampler.h"
 #include <glm/gtx/io.hpp>
 #include <iostream>
 
@@ -24,7 +25,6 @@ bool Sphere::intersectLocal(ray &r, isect &i) const {
   }
 
   i.setObject(this);
-  i.setMaterial(this->getMaterial());
 
   double t1 = b - discriminant;
 
@@ -38,3 +38,14 @@ bool Sphere::intersectLocal(ray &r, isect &i) const {
 
   return true;
 }
+
+void Sphere::sampleLocalSurface(SampleStream &samples, glm::dvec3 &P, glm::dvec3 &N,
+                                glm::dvec2 &uv) const {
+  glm::dvec2 u = samples.next2D();
+  double z = 1.0 - 2.0 * u[0];
+  double r = sqrt(max(0.0, 1.0 - z * z));
+  double phi = 2.0 * M_PI * u[1];
+  P = glm::dvec3(r * cos(phi), r * sin(phi), z);
+  N = P;
+  uv = glm::dvec2(0.0);
+}
@@ -20,5 +20,8 @@ public:
 protected:
   void glDrawLocal(int quality, bool actualMaterials,
                    bool actualTextures) const;
+  virtual double localSurfaceArea() const { return 4 * M_PI; }
+  virtual void sampleLocalSurface(SampleStream &samples, glm::dvec3 &P, glm::dvec3 &N,
+                                  glm::dvec2 &uv) const;
 };
 #endif // __SPHERE_H__
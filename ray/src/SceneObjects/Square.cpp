@@ -1,6 +1,7 @@
 #include <cmath>
 
 #include "Square.h"
+#include "../scene/sampler.h"
 
 using namespace std;
 
@@ -30,7 +31,6 @@ bool Square::intersectLocal(ray &r, isect &i) const {
   }
 
   i.setObject(this);
-  i.setMaterial(this->getMaterial());
   i.setT(t);
   if (d[2] > 0.0) {
     i.setN(glm::dvec3(0.0, 0.0, -1.0));
@@ -41,3 +41,10 @@ bool Square::intersectLocal(ray &r, isect &i) const {
   i.setUVCoordinates(glm::dvec2(P[0] + 0.5, P[1] + 0.5));
   return true;
 }
+
+void Square::sampleLocalSurface(SampleStream &samples, glm::dvec3 &P, glm::dvec3 &N,
+                                glm::dvec2 &uv) const {
+  uv = samples.next2D();
+  P = glm::dvec3(uv[0] - 0.5, uv[1] - 0.5, 0.0);
+  N = glm::dvec3(0.0, 0.0, 1.0);
+}
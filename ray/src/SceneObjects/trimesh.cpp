@@ -5,6 +5,7 @@
 #include <float.h>
 #include <string.h>
 #include <iostream>
+#include "../scene/sampler.h"
 #include "../ui/TraceUI.h"
 #include <glm/gtx/io.hpp>
 
@@ -13,23 +14,29 @@ extern TraceUI *traceUI;
 
 using namespace std;
 
-Trimesh::~Trimesh()
+TrimeshData::~TrimeshData()
 {
-	for (auto f : faces)
-		delete f;
+	if (!faceBlock)
+		for (auto f : faces)
+			delete f;
+	delete tree;
 }
 
 // must add vertices, normals, and materials IN ORDER
-void Trimesh::addVertex(const glm::dvec3 &v) { vertices.emplace_back(v); }
-void Trimesh::addNormal(const glm::dvec3 &n) { normals.emplace_back(n); }
-void Trimesh::addTangent(const glm::dvec3 &t) { tangents.emplace_back(t); }
-void Trimesh::addBitangent(const glm::dvec3 &bt) { tangents.emplace_back(bt); }
+void TrimeshData::addVertex(const glm::dvec3 &v)
+{
+	vertices.emplace_back(v);
+	boundsValid = false;
+}
+void TrimeshData::addNormal(const glm::dvec3 &n) { normals.emplace_back(n); }
+void TrimeshData::addTangent(const glm::dvec3 &t) { tangents.emplace_back(t); }
+void TrimeshData::addBitangent(const glm::dvec3 &bt) { tangents.emplace_back(bt); }
 
-void Trimesh::addColor(const glm::dvec3 &c) { vertColors.emplace_back(c); }
-void Trimesh::addUV(const glm::dvec2 &uv) { uvCoords.emplace_back(uv); }
+void TrimeshData::addColor(const glm::dvec3 &c) { vertColors.emplace_back(c); }
+void TrimeshData::addUV(const glm::dvec2 &uv) { uvCoords.emplace_back(uv); }
 
 // Returns false if the vertices a,b,c don't all exist
-bool Trimesh::addFace(int a, int b, int c)
+bool TrimeshData::addFace(int a, int b, int c)
 {
 	int vcnt = vertices.size();
 	if (a >= vcnt || b >= vcnt || c >= vcnt)
@@ -47,7 +54,7 @@ bool Trimesh::addFace(int a, int b, int c)
 
 // Check to make sure that if we have per-vertex materials or normals
 // they are the right number.
-const char *Trimesh::doubleCheck()
+const char *TrimeshData::doubleCheck()
 {
 	if (!vertColors.empty() && vertColors.size() != vertices.size())
 		return "Bad Trimesh: Wrong number of vertex colors.";
@@ -59,12 +66,81 @@ const char *Trimesh::doubleCheck()
 	return 0;
 }
 
-void Trimesh::buildTree()
+BVHBuildSettings TrimeshData::treeSettings(bool spatialSplits, double splitOverlap)
+{
+	BVHBuildSettings settings = currentBVHSettings();
+	if (spatialSplits)
+	{
+		settings.spatialSplits = true;
+		if (splitOverlap >= 0.0)
+			settings.splitOverlap = splitOverlap;
+	}
+	return settings;
+}
+
+void TrimeshData::buildTree(ThreadPool *pool)
+{
+	std::call_once(treeBuilt, [this, pool]() {
+		if (this->tree)
+			return;
+		this->tree = new BVH<TrimeshFace>(faces, treeSettings(spatialSplits, splitOverlap), pool);
+		double area = 0.0;
+		areaCdf.reserve(faces.size());
+		for (auto face : faces)
+		{
+			glm::dvec3 a = vertices[(*face)[0]];
+			glm::dvec3 b = vertices[(*face)[1]];
+			glm::dvec3 c = vertices[(*face)[2]];
+			area += 0.5 * glm::length(glm::cross(b - a, c - a));
+			areaCdf.push_back(area);
+		}
+		if (onTreeBuilt)
+			onTreeBuilt(*this);
+	});
+}
+
+BoundingBox TrimeshData::ComputeLocalBoundingBox()
 {
-	if (this->tree == nullptr)
+	if (boundsValid || vertices.empty())
+		return localBounds;
+	localBounds.setMax(vertices[0]);
+	localBounds.setMin(vertices[0]);
+	for (const glm::dvec3 &v : vertices)
 	{
-		this->tree = new BVH<TrimeshFace>(faces);
+		localBounds.setMax(glm::max(localBounds.getMax(), v));
+		localBounds.setMin(glm::min(localBounds.getMin(), v));
 	}
+	boundsValid = true;
+	return localBounds;
+}
+
+// Pick a face by area, then a uniform point on it
+void Trimesh::sampleLocalSurface(SampleStream &samples, glm::dvec3 &P, glm::dvec3 &N,
+								 glm::dvec2 &uv) const
+{
+	const auto &areaCdf = data->areaCdf;
+	const auto &faces = data->faces;
+	const auto &vertices = data->vertices;
+	const auto &uvCoords = data->uvCoords;
+	double pick = samples.next1D() * areaCdf.back();
+	size_t k = std::upper_bound(areaCdf.begin(), areaCdf.end(), pick) -
+			   areaCdf.begin();
+	const TrimeshFace *face = faces[std::min(k, faces.size() - 1)];
+
+	glm::dvec2 u = samples.next2D();
+	double su = sqrt(u[0]);
+	double v = u[1];
+	glm::dvec3 bary(1.0 - su, su * (1.0 - v), su * v);
+
+	P = glm::dvec3(0.0);
+	uv = glm::dvec2(0.0);
+	for (int j = 0; j < 3; j++)
+	{
+		P += vertices[(*face)[j]] * bary[j];
+		if (!uvCoords.empty())
+			uv += uvCoords[(*face)[j]] * bary[j];
+	}
+	N = face->getNormal();
 }
 
 bool Trimesh::intersectLocal(ray &r, isect &i) const
@@ -83,8 +159,19 @@ bool Trimesh::intersectLocal(ray &r, isect &i) const
 	//        i.setT(1000.0);
 	//    }
 	i.setT(1000.0);
-	bool have_one = this->tree->intersect(r, i);
-	return have_one;
+	if (!data->tree->intersect(r, i))
+		return false;
+	i.setObject(this);
+	// The face left the interpolated color in the intersection; it becomes
+	// the diffuse of the hit's own copy of this instance's material
+	if (data->shadesVertexColors())
+		i.setMaterial(material).setDiffuse(i.getVertexColor());
+	return true;
+}
+
+bool Trimesh::occludedLocal(ray &r, double tMax) const
+{
+	return data->tree->occluded(r, tMax);
 }
 
 bool TrimeshFace::intersect(ray &r, isect &i) const
@@ -92,24 +179,20 @@ bool TrimeshFace::intersect(ray &r, isect &i) const
 	return intersectLocal(r, i);
 }
 
+bool TrimeshFace::occludes(ray &r, double tMax) const
+{
+	double t;
+	glm::dvec3 bary;
+	return intersectTriangle(r, t, bary) && t < tMax;
+}
+
 // Intersect ray r with the triangle abc.  If it hits returns true,
 // and put the parameter in t and the barycentric coordinates of the
-// intersection in u (alpha) and v (beta).
-bool TrimeshFace::intersectLocal(ray &r, isect &i) const
+// intersection in fullBary.
+bool TrimeshFace::intersectTriangle(const ray &r, double &t, glm::dvec3 &fullBary) const
 {
-	/* To determine the color of an intersection, use the following rules:
-	 - If the parent mesh has non-empty `uvCoords`, barycentrically interpolate
-	   the UV coordinates of the three vertices of the face, then assign it to
-	   the intersection using i.setUVCoordinates().
-	 - Otherwise, if the parent mesh has non-empty `vertexColors`,
-	   barycentrically interpolate the colors from the three vertices of the
-	   face. Create a new material by copying the parent's material, set the
-	   diffuse color of this material to the interpolated color, and then
-	   assign this material to the intersection.
-	 - If neither is true, assign the parent's material to the intersection.
-	*/
 	// Get Triangle Coords + Vectors
-	Trimesh *parent = this->getParent();
+	TrimeshData *parent = this->getParent();
 	glm::dvec3 a = parent->vertices[this->ids[0]];
 	glm::dvec3 b = parent->vertices[this->ids[1]];
 	glm::dvec3 c = parent->vertices[this->ids[2]];
@@ -127,7 +210,7 @@ bool TrimeshFace::intersectLocal(ray &r, isect &i) const
 	// Use point a to define the plane
 	double num = glm::dot(a - origin, normal);
 	//    assert(glm::abs(glm::dot(normal, a - origin) - glm::dot(normal, b - origin)) < RAY_EPSILON);
-	double t = num / denom;
+	t = num / denom;
 	// Object was before ray cast
 	//    assert(glm::dot((origin + direction  * t - a), normal) < RAY_EPSILON);
 	if (t < 0)
@@ -142,13 +225,67 @@ bool TrimeshFace::intersectLocal(ray &r, isect &i) const
 	double bTerm2 = glm::dot(intersectPoint - a, c - a);
 	glm::dvec2 bVec(bTerm1, bTerm2);
 	glm::dvec2 partialBary = AMat * bVec;
-	glm::dvec3 fullBary(1 - partialBary[0] - partialBary[1], partialBary[0], partialBary[1]);
+	fullBary = glm::dvec3(1 - partialBary[0] - partialBary[1], partialBary[0], partialBary[1]);
 
 	// If not in triangle
-	if (!(fullBary[0] >= 0 && fullBary[0] <= 1 && fullBary[1] >= 0 && fullBary[1] <= 1 && fullBary[2] >= 0 && fullBary[2] <= 1))
+	return fullBary[0] >= 0 && fullBary[0] <= 1 && fullBary[1] >= 0 && fullBary[1] <= 1 && fullBary[2] >= 0 && fullBary[2] <= 1;
+}
+
+void TrimeshFace::clipBounds(int axis, double pos, BoundingBox &left,
+							 BoundingBox &right) const
+{
+	glm::dvec3 leftMin(DBL_MAX), leftMax(-DBL_MAX);
+	glm::dvec3 rightMin(DBL_MAX), rightMax(-DBL_MAX);
+	for (int k = 0; k < 3; k++)
+	{
+		const glm::dvec3 &v0 = parent->vertices[ids[k]];
+		const glm::dvec3 &v1 = parent->vertices[ids[(k + 1) % 3]];
+		if (v0[axis] <= pos)
+		{
+			leftMin = glm::min(leftMin, v0);
+			leftMax = glm::max(leftMax, v0);
+		}
+		if (v0[axis] >= pos)
+		{
+			rightMin = glm::min(rightMin, v0);
+			rightMax = glm::max(rightMax, v0);
+		}
+		// Where the edge crosses the plane belongs to both sides
+		if ((v0[axis] < pos && v1[axis] > pos) || (v0[axis] > pos && v1[axis] < pos))
+		{
+			glm::dvec3 p = v0 + (v1 - v0) * ((pos - v0[axis]) / (v1[axis] - v0[axis]));
+			p[axis] = pos;
+			leftMin = glm::min(leftMin, p);
+			leftMax = glm::max(leftMax, p);
+			rightMin = glm::min(rightMin, p);
+			rightMax = glm::max(rightMax, p);
+		}
+	}
+	left = BoundingBox(leftMin, leftMax);
+	right = BoundingBox(rightMin, rightMax);
+}
+
+bool TrimeshFace::intersectLocal(ray &r, isect &i) const
+{
+	/* To determine the color of an intersection, use the following rules:
+	 - If the parent mesh has non-empty `uvCoords`, barycentrically interpolate
+	   the UV coordinates of the three vertices of the face, then assign it to
+	   the intersection using i.setUVCoordinates().
+	 - Otherwise, if the parent mesh has non-empty `vertexColors`,
+	   barycentrically interpolate the colors from the three vertices of the
+	   face and store it with i.setVertexColor(). The Trimesh that traced
+	   the ray then gives the intersection a copy of its material with that
+	   diffuse color (see Trimesh::intersectLocal).
+	 - If neither is true, the intersection uses the Trimesh's material.
+	*/
+	double t;
+	glm::dvec3 fullBary;
+	if (!intersectTriangle(r, t, fullBary))
 	{
 		return false;
 	}
+	TrimeshData *parent = this->getParent();
+	glm::dvec3 normal = getNormal();
 
 	// If contains vertex norms
 	if (!this->parent->normals.empty())
@@ -181,19 +318,13 @@ bool TrimeshFace::intersectLocal(ray &r, isect &i) const
 		glm::dvec3 colorA = parent->vertColors[this->ids[0]] * fullBary[0];
 		glm::dvec3 colorB = parent->vertColors[this->ids[1]] * fullBary[1];
 		glm::dvec3 colorC = parent->vertColors[this->ids[2]] * fullBary[2];
-		glm::dvec3 interpolatedColor = colorA + colorB + colorC;
-		// Material is an object, so a deep copy should work... hopefully. If there are bugs cehck this statement.
-		Material newMaterial = parent->material;
-		newMaterial.setDiffuse(interpolatedColor);
-		i.setMaterial(newMaterial);
-	}
-	else
-	{
-		i.setMaterial(parent->material);
+		// The mesh's material belongs to the Trimesh that traced the ray,
+		// which puts the color into it
+		i.setVertexColor(colorA + colorB + colorC);
 	}
+	// Otherwise getMaterial() falls back to the Trimesh's material
 
 	i.setT(t);
-	i.setObject(this->parent);
 	i.setTangent(this->getTangent());
 	i.setBiTangent(this->getBitangent());
 	return true;
@@ -201,7 +332,7 @@ bool TrimeshFace::intersectLocal(ray &r, isect &i) const
 
 // Once all the verts and faces are loaded, per vertex normals can be
 // generated by averaging the normals of the neighboring faces.
-void Trimesh::generateNormals()
+void TrimeshData::generateNormals()
 {
 	int cnt = vertices.size();
 	normals.resize(cnt);
@@ -223,7 +354,6 @@ void Trimesh::generateNormals()
 		if (numFaces[i])
 			normals[i] /= numFaces[i];
 	}
-	vertNorms = true;
 	// ADDED FOR NORMAL MAP
 	// Once normals are computed, we can compute tangent and bitangent spaces
 	// for implementing a normal map.
@@ -231,7 +361,7 @@ void Trimesh::generateNormals()
 }
 
 // ADDED FOR NORMAL MAP
-void Trimesh::generateTangentsAndBitangents()
+void TrimeshData::generateTangentsAndBitangents()
 {
     if(uvCoords.empty()){
         return;
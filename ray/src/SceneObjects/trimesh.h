@@ -1,8 +1,10 @@
 #ifndef TRIMESH_H__
 #define TRIMESH_H__
 
+#include <functional>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include "../scene/bvh.h"
@@ -15,9 +17,17 @@
 
 class TrimeshFace;
 
-class Trimesh : public SceneObject
+/* The geometry of a mesh: vertices, per-vertex attributes, faces and the
+BVH over them. Once loaded it never changes, so any number of Trimesh
+instances can share one TrimeshData (through a shared_ptr), each with its
+own transform and material. The parser hands the same TrimeshData to every
+obj_mesh and instance that reads the same OBJ file, so a hundred copies of
+a mesh cost one copy of its triangles and one BVH build. */
+class TrimeshData
 {
+  friend class Trimesh;
   friend class TrimeshFace;
+  friend class MeshCache;
 
   typedef std::vector<glm::dvec3> Normals;
   typedef std::vector<glm::dvec3> Tangents;
@@ -37,22 +47,24 @@ class Trimesh : public SceneObject
   VertColors vertColors;
   UVCoords uvCoords;
   BoundingBox localBounds;
-  BVH<TrimeshFace> *tree;
+  bool boundsValid = false;
+  BVH<TrimeshFace> *tree = nullptr;
+  // Running sum of the face areas, so lights can pick faces by area
+  std::vector<double> areaCdf;
+  // Instances build the shared tree from several pool threads at once
+  std::once_flag treeBuilt;
+  bool spatialSplits = false;
+  double splitOverlap = -1.0;
+  // Faces read back by MeshCache live in one block rather than one
+  // allocation each
+  std::unique_ptr<TrimeshFace[]> faceBlock;
+  std::function<void(const TrimeshData &)> onTreeBuilt;
 
 public:
-  Trimesh(Scene *scene, Material *mat, MatrixTransform transform)
-      : SceneObject(scene, mat), displayListWithMaterials(0),
-        displayListWithoutMaterials(0)
-  {
-    this->transform = transform;
-    vertNorms = false;
-  }
-
-  bool vertNorms;
-
-  bool intersectLocal(ray &r, isect &i) const;
-
-  ~Trimesh();
+  TrimeshData() {}
+  TrimeshData(const TrimeshData &) = delete;
+  TrimeshData &operator=(const TrimeshData &) = delete;
+  ~TrimeshData();
 
   // must add vertices, normals, and materials IN ORDER
   void addVertex(const glm::dvec3 &);
@@ -68,30 +80,110 @@ public:
 
   void generateNormals();
   void generateTangentsAndBitangents();
-  void buildTree();
+  // Build the BVH with spatial splits (an SBVH, see BVH::makeSBVH), for
+  // meshes with long thin triangles. A negative overlap budget keeps the
+  // one from the render settings.
+  void useSpatialSplits(double overlap = -1.0)
+  {
+    spatialSplits = true;
+    splitOverlap = overlap;
+  }
+  // The settings buildTree() uses for a mesh with these spatial split options
+  static BVHBuildSettings treeSettings(bool spatialSplits, double splitOverlap);
+  // Safe to call from every instance; only the first call builds, and
+  // then calls f (e.g. to save the mesh to a MeshCache). A mesh restored
+  // by MeshCache already has its tree.
+  void buildTree(ThreadPool *pool);
+  void whenTreeBuilt(std::function<void(const TrimeshData &)> f)
+  {
+    onTreeBuilt = std::move(f);
+  }
+  const BVHBuildInfo *treeInfo() const
+  {
+    return tree ? &tree->buildInfo() : nullptr;
+  }
+
+  int faceCount() const { return (int)faces.size(); }
+  bool hasNormals() const { return !normals.empty(); }
+  // Vertex colors only shade the mesh when it has no UVs
+  bool shadesVertexColors() const
+  {
+    return uvCoords.empty() && !vertColors.empty();
+  }
+
+  BoundingBox ComputeLocalBoundingBox();
+};
+
+class Trimesh : public SceneObject
+{
+  typedef TrimeshData::Faces Faces;
+
+  std::shared_ptr<TrimeshData> data;
+
+public:
+  // A mesh with geometry of its own, filled in with the add*() calls
+  Trimesh(Scene *scene, Material *mat, MatrixTransform transform)
+      : Trimesh(scene, mat, transform, std::make_shared<TrimeshData>())
+  {
+  }
+  // An instance of data, which must already be complete
+  Trimesh(Scene *scene, Material *mat, MatrixTransform transform,
+          std::shared_ptr<TrimeshData> data)
+      : SceneObject(scene, mat), data(std::move(data)),
+        displayListWithMaterials(0), displayListWithoutMaterials(0)
+  {
+    this->transform = transform;
+    vertNorms = this->data->hasNormals();
+  }
+
+  bool vertNorms;
+
+  bool intersectLocal(ray &r, isect &i) const;
+  bool occludedLocal(ray &r, double tMax) const;
+
+  const std::shared_ptr<TrimeshData> &getData() const { return data; }
+
+  // must add vertices, normals, and materials IN ORDER
+  void addVertex(const glm::dvec3 &v) { data->addVertex(v); }
+  void addNormal(const glm::dvec3 &n) { data->addNormal(n); }
+  void addTangent(const glm::dvec3 &t) { data->addTangent(t); }
+  void addBitangent(const glm::dvec3 &bt) { data->addBitangent(bt); }
+
+  void addColor(const glm::dvec3 &c) { data->addColor(c); }
+  void addUV(const glm::dvec2 &uv) { data->addUV(uv); }
+  bool addFace(int a, int b, int c) { return data->addFace(a, b, c); }
+
+  const char *doubleCheck() { return data->doubleCheck(); }
+
+  void generateNormals()
+  {
+    data->generateNormals();
+    vertNorms = true;
+  }
+  void useSpatialSplits(double overlap = -1.0)
+  {
+    data->useSpatialSplits(overlap);
+  }
+  void buildTree(ThreadPool *pool) { data->buildTree(pool); }
+  int treeSize() const { return data->faceCount(); }
+  const BVHBuildInfo *treeInfo() const { return data->treeInfo(); }
 
   bool hasBoundingBoxCapability() const { return true; }
 
   BoundingBox ComputeLocalBoundingBox()
   {
-    BoundingBox localbounds;
-    if (vertices.size() == 0)
-      return localbounds;
-    localbounds.setMax(vertices[0]);
-    localbounds.setMin(vertices[0]);
-    Vertices::const_iterator viter;
-    for (viter = vertices.begin(); viter != vertices.end(); ++viter)
-    {
-      localbounds.setMax(glm::max(localbounds.getMax(), *viter));
-      localbounds.setMin(glm::min(localbounds.getMin(), *viter));
-    }
-    localBounds = localbounds;
-    return localbounds;
+    return data->ComputeLocalBoundingBox();
   }
 
 protected:
   void glDrawLocal(int quality, bool actualMaterials,
                    bool actualTextures) const;
+  double localSurfaceArea() const
+  {
+    return data->areaCdf.empty() ? 0.0 : data->areaCdf.back();
+  }
+  void sampleLocalSurface(SampleStream &samples, glm::dvec3 &P, glm::dvec3 &N,
+                          glm::dvec2 &uv) const;
   mutable int displayListWithMaterials;
   mutable int displayListWithoutMaterials;
 };
@@ -105,11 +197,14 @@ these in every single TrimeshFace would explode memory usage. Because of this,
 TrimeshFace is treated as an implementation detail of Trimesh and is not within
 the SceneObject hierarchy.
 
-Access to materials and transform are provided by referencing the parent
-Trimesh object. */
+A face belongs to the shared TrimeshData, not to any one Trimesh, so it fills
+in everything about a hit except the object and its material; the Trimesh
+that traced the ray sets those. */
 class TrimeshFace
 {
-  Trimesh *parent;
+  friend class MeshCache;
+
+  TrimeshData *parent;
   int ids[3];
   glm::dvec3 normal;
   glm::dvec3 tangent;   // ADDED FOR NORMAL MAP
@@ -119,8 +214,11 @@ class TrimeshFace
   BoundingBox bounds;
   glm::dmat2 AMat;
 
+  // Left blank for MeshCache to copy a saved face into
+  TrimeshFace() {}
+
 public:
-  TrimeshFace(Trimesh *parent, int a, int b, int c)
+  TrimeshFace(TrimeshData *parent, int a, int b, int c)
   {
     this->parent = parent;
     ids[0] = a;
@@ -168,7 +266,15 @@ public:
 
   bool intersect(ray &r, isect &i) const;
   bool intersectLocal(ray &r, isect &i) const;
-  Trimesh *getParent() const { return parent; }
+  // Hit-only test used by shadow rays; skips all the shading work
+  bool occludes(ray &r, double tMax) const;
+  bool intersectTriangle(const ray &r, double &t, glm::dvec3 &fullBary) const;
+  // Bounds of the parts of the triangle on either side of the plane where
+  // coordinate axis equals pos; a side with none of it gets an inverted box.
+  // Lets the SBVH builder split the triangle between nodes.
+  void clipBounds(int axis, double pos, BoundingBox &left,
+                  BoundingBox &right) const;
+  TrimeshData *getParent() const { return parent; }
 
   bool hasBoundingBoxCapability() const { return true; }
 
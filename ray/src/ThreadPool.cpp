@@ -0,0 +1,100 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace {
+thread_local int poolWorkerIndex = -1;
+} // anonymous namespace
+
+ThreadPool::ThreadPool(int numThreads) {
+  numThreads = std::max(numThreads, 1);
+  for (int i = 0; i < numThreads; i++)
+    workers.emplace_back([this, i]() { workerLoop(i); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  taskReady.notify_all();
+  for (auto &th : workers)
+    th.join();
+}
+
+void ThreadPool::submit(std::function<void(int)> task) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    tasks.push_back(std::move(task));
+  }
+  taskReady.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> guard(lock);
+  allDone.wait(guard, [this]() { return tasks.empty() && running == 0; });
+}
+
+int ThreadPool::currentWorker() { return poolWorkerIndex; }
+
+void ThreadPool::workerLoop(int index) {
+  poolWorkerIndex = index;
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    taskReady.wait(guard, [this]() { return stopping || !tasks.empty(); });
+    if (tasks.empty())
+      return; // stopping
+    std::function<void(int)> task = std::move(tasks.front());
+    tasks.pop_front();
+    running++;
+    guard.unlock();
+    task(index);
+    guard.lock();
+    running--;
+    if (tasks.empty() && running == 0)
+      allDone.notify_all();
+  }
+}
+
+void ThreadPool::parallelFor(int begin, int end,
+                             const std::function<void(int)> &body) {
+  if (end <= begin)
+    return;
+  if (currentWorker() >= 0 || size() == 1 || end - begin == 1) {
+    for (int i = begin; i < end; i++)
+      body(i);
+    return;
+  }
+
+  // Everyone pulls indices from a shared counter; the caller then waits for
+  // just the helpers it queued, not for unrelated work on the pool.
+  struct Loop {
+    std::atomic<int> next;
+    int helpers;
+    std::mutex lock;
+    std::condition_variable done;
+  };
+  auto loop = std::make_shared<Loop>();
+  loop->next = begin;
+  // Helpers may finish and count themselves off while the rest are still
+  // being queued, so loop over a copy of the count.
+  int helpers = std::min(size(), end - begin - 1);
+  loop->helpers = helpers;
+  auto run = [loop, end, &body]() {
+    for (int i = loop->next++; i < end; i = loop->next++)
+      body(i);
+  };
+  for (int k = 0; k < helpers; k++) {
+    submit([loop, run](int) {
+      run();
+      std::lock_guard<std::mutex> guard(loop->lock);
+      if (--loop->helpers == 0)
+        loop->done.notify_all();
+    });
+  }
+  run();
+  std::unique_lock<std::mutex> guard(loop->lock);
+  loop->done.wait(guard, [&loop]() { return loop->helpers == 0; });
+}
@@ -0,0 +1,48 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+// A fixed set of long-lived worker threads. Rendering, scene building and
+// texture decoding all run on the same pool, so there is no per-frame
+// thread start-up and no oversubscription when they overlap.
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+  explicit ThreadPool(int numThreads);
+  ~ThreadPool();
+
+  int size() const { return (int)workers.size(); }
+
+  // Queue a task. It is passed the index of the worker that runs it.
+  void submit(std::function<void(int)> task);
+
+  // Block until every submitted task has finished.
+  void wait();
+
+  // Run body(i) for every i in [begin, end) across the pool and return once
+  // all of them are done. The calling thread takes indices too. Called from
+  // inside a pool task it simply runs the loop inline.
+  void parallelFor(int begin, int end, const std::function<void(int)> &body);
+
+  // Index of the pool worker running the calling thread, or -1.
+  static int currentWorker();
+
+private:
+  void workerLoop(int index);
+
+  std::vector<std::thread> workers;
+  std::deque<std::function<void(int)>> tasks;
+  std::mutex lock;
+  std::condition_variable taskReady;
+  std::condition_variable allDone;
+  int running = 0;
+  bool stopping = false;
+};
+
+#endif // __THREADPOOL_H__
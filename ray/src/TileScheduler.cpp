@@ -0,0 +1,210 @@
+#include "TileScheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+
+namespace {
+
+// Position of (x, y) along the Hilbert curve filling an n x n grid, n a
+// power of two. Neighbouring tiles on the curve are neighbours on screen,
+// which keeps each worker's run of tiles compact.
+int hilbertIndex(int n, int x, int y) {
+  int d = 0;
+  for (int s = n / 2; s > 0; s /= 2) {
+    int rx = (x & s) > 0;
+    int ry = (y & s) > 0;
+    d += s * s * ((3 * rx) ^ ry);
+    if (ry == 0) {
+      if (rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+} // anonymous namespace
+
+TileOrder TileScheduler::parseOrder(const std::string &name) {
+  if (name == "hilbert")
+    return TileOrder::Hilbert;
+  if (name == "spiral")
+    return TileOrder::Spiral;
+  return TileOrder::Scanline;
+}
+
+void TileScheduler::setup(int w, int h, int tileSize, TileOrder order,
+                          int numWorkers, int passes) {
+  tileSize = std::max(tileSize, 1);
+  numWorkers = std::max(numWorkers, 1);
+  numPasses = std::max(passes, 1);
+  int nx = (w + tileSize - 1) / tileSize;
+  int ny = (h + tileSize - 1) / tileSize;
+
+  tiles.clear();
+  tiles.reserve(nx * ny);
+  std::vector<double> keys;
+  keys.reserve(nx * ny);
+  int hilbertSize = 1;
+  while (hilbertSize < std::max(nx, ny))
+    hilbertSize *= 2;
+  double cx = (nx - 1) * 0.5;
+  double cy = (ny - 1) * 0.5;
+  for (int ty = 0; ty < ny; ty++) {
+    for (int tx = 0; tx < nx; tx++) {
+      Tile t;
+      t.x0 = tx * tileSize;
+      t.y0 = ty * tileSize;
+      t.x1 = std::min(t.x0 + tileSize, w);
+      t.y1 = std::min(t.y0 + tileSize, h);
+      t.index = (int)tiles.size();
+      t.pass = 0;
+      tiles.push_back(t);
+
+      double key = 0.0;
+      switch (order) {
+      case TileOrder::Scanline:
+        key = ty * nx + tx;
+        break;
+      case TileOrder::Hilbert:
+        key = hilbertIndex(hilbertSize, tx, ty);
+        break;
+      case TileOrder::Spiral: {
+        // Square rings around the centre, each ring walked by angle
+        double dx = tx - cx;
+        double dy = ty - cy;
+        double ring = std::floor(std::max(std::abs(dx), std::abs(dy)) + 0.5);
+        key = ring * 8.0 + (std::atan2(dy, dx) + M_PI);
+        break;
+      }
+      }
+      keys.push_back(key);
+    }
+  }
+  numTiles = (int)tiles.size();
+
+  std::vector<int> ordered(numTiles);
+  for (int i = 0; i < numTiles; i++)
+    ordered[i] = i;
+  std::stable_sort(ordered.begin(), ordered.end(),
+                   [&keys](int a, int b) { return keys[a] < keys[b]; });
+
+  // Deal the ordered tiles out in contiguous runs so every worker starts
+  // on its own coherent patch of the image, and keeps it in later passes.
+  workers.clear();
+  for (int k = 0; k < numWorkers; k++) {
+    workers.emplace_back(new Worker());
+    int begin = (int)((long long)numTiles * k / numWorkers);
+    int end = (int)((long long)numTiles * (k + 1) / numWorkers);
+    workers[k]->run.assign(ordered.begin() + begin, ordered.begin() + end);
+    workers[k]->nextPass = workers[k]->run.empty() ? numPasses : 0;
+    refill(*workers[k]);
+  }
+
+  start = std::chrono::steady_clock::now();
+  wallTime = 0.0;
+  tilesCompleted = 0;
+  finished = false;
+}
+
+bool TileScheduler::next(int worker, Tile &tile) {
+  Worker &own = *workers[worker];
+  while (true) {
+    {
+      std::lock_guard<std::mutex> guard(own.lock);
+      if (!own.tiles.empty()) {
+        tile = own.tiles.front();
+        own.tiles.pop_front();
+        own.tilesDone++;
+        return true;
+      }
+    }
+    // Help anyone still on an earlier pass before starting our next one
+    if (steal(worker, own.nextPass, tile)) {
+      own.tilesDone++;
+      return true;
+    }
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!refill(own))
+      break;
+  }
+  if (!steal(worker, numPasses, tile))
+    return false;
+  own.tilesDone++;
+  return true;
+}
+
+bool TileScheduler::refill(Worker &w) {
+  if (w.nextPass >= numPasses)
+    return false;
+  for (int idx : w.run) {
+    Tile t = tiles[idx];
+    t.pass = w.nextPass;
+    w.tiles.push_back(t);
+  }
+  w.nextPass++;
+  return true;
+}
+
+bool TileScheduler::steal(int thief, int beforePass, Tile &tile) {
+  int n = (int)workers.size();
+  for (int k = 1; k < n; k++) {
+    Worker &victim = *workers[(thief + k) % n];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tiles.empty() && victim.tiles.back().pass < beforePass) {
+      // Take from the far end, away from where the owner is working
+      tile = victim.tiles.back();
+      victim.tiles.pop_back();
+      workers[thief]->tilesStolen++;
+      return true;
+    }
+  }
+  return false;
+}
+
+void TileScheduler::tileDone(int worker, double seconds) {
+  workers[worker]->busy += seconds;
+  tilesCompleted++;
+}
+
+void TileScheduler::finish() {
+  if (finished)
+    return;
+  wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           start)
+                 .count();
+  finished = true;
+}
+
+double TileScheduler::elapsed() const {
+  if (finished)
+    return wallTime;
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+void TileScheduler::report(std::ostream &out) const {
+  std::ios::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision();
+  int passes = 0;
+  for (const auto &w : workers)
+    passes = std::max(passes, w->nextPass);
+  out << numTiles << " tiles";
+  if (passes > 1)
+    out << " x " << passes << " passes";
+  out << " in " << std::fixed << std::setprecision(3) << wallTime << "s"
+      << std::endl;
+  for (size_t k = 0; k < workers.size(); k++) {
+    const Worker &w = *workers[k];
+    out << "  thread " << k << ": busy " << w.busy << "s, idle "
+        << std::max(0.0, wallTime - w.busy) << "s, " << w.tilesDone
+        << " tiles (" << w.tilesStolen << " stolen)" << std::endl;
+  }
+  out.flags(flags);
+  out.precision(precision);
+}
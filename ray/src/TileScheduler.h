@@ -0,0 +1,95 @@
+#ifndef __TILESCHEDULER_H__
+#define __TILESCHEDULER_H__
+
+// Hands out the tiles of a frame to the render threads.
+//
+// The frame is cut into square tiles, which are put in the requested order
+// and dealt out as contiguous runs, one per worker deque. A worker takes
+// tiles from the front of its own deque and, once that is empty, steals
+// from someone else's, so no thread sits idle while another still has a
+// backlog of expensive tiles.
+//
+// A progressive frame visits every tile once per pass. A worker only
+// queues its run of tiles for the next pass once its deque is empty and
+// nobody is left on an earlier pass to steal from, so the whole frame gets
+// its first pass before any tile gets its second. Passes are queued
+// lazily, so the pass count may be practically unbounded and the frame
+// ended early instead.
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct Tile {
+  int x0, y0; // inclusive
+  int x1, y1; // exclusive
+  int index;  // same tile, same index, in every pass
+  int pass;
+};
+
+enum class TileOrder { Scanline, Hilbert, Spiral };
+
+class TileScheduler {
+public:
+  // Unknown names fall back to scanline
+  static TileOrder parseOrder(const std::string &name);
+
+  void setup(int w, int h, int tileSize, TileOrder order, int workers,
+             int passes = 1);
+
+  // Next tile for this worker. Returns false once the frame is exhausted.
+  bool next(int worker, Tile &tile);
+
+  // Workers report each finished tile and the time spent tracing it
+  void tileDone(int worker, double seconds);
+
+  // Call once all the workers have returned; later calls are ignored
+  void finish();
+
+  // Tiles per pass; a frame run to the end hands out tileCount() *
+  // passCount() in all
+  int tileCount() const { return numTiles; }
+  // The tile with this index; fixed from setup() until the next one
+  const Tile &tileAt(int index) const { return tiles[index]; }
+  int passCount() const { return numPasses; }
+  // Safe to call from any thread while the frame renders
+  int completedTiles() const { return tilesCompleted.load(); }
+  // Seconds since setup(), frozen once finish() has been called
+  double elapsed() const;
+  int workerCount() const { return (int)workers.size(); }
+
+  // Per-thread busy and idle time for the last frame
+  void report(std::ostream &out) const;
+
+private:
+  struct Worker {
+    std::mutex lock;
+    std::deque<Tile> tiles;
+    std::vector<int> run; // this worker's share of the tiles, in order
+    int nextPass = 0;     // the pass to queue once tiles runs dry
+    double busy = 0.0;
+    int tilesDone = 0;
+    int tilesStolen = 0;
+  };
+
+  // Queue w's run for its next pass; call with w.lock held
+  bool refill(Worker &w);
+  // Take a tile of a pass before beforePass from another worker
+  bool steal(int thief, int beforePass, Tile &tile);
+
+  std::vector<Tile> tiles;
+  std::vector<std::unique_ptr<Worker>> workers;
+  int numTiles = 0;
+  int numPasses = 1;
+  std::atomic<int> tilesCompleted{0};
+  std::chrono::steady_clock::time_point start;
+  double wallTime = 0.0;
+  std::atomic<bool> finished{false};
+};
+
+#endif // __TILESCHEDULER_H__
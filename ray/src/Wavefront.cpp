@@ -0,0 +1,117 @@
+#include "Wavefront.h"
+
+#include "scene/scene.h"
+
+#include <algorithm>
+#include <functional>
+#include <numeric>
+
+void Wavefront::reset(int slots) {
+  paths.clear();
+  next.clear();
+  shadows.clear();
+  results.assign(slots, glm::dvec3(0.0, 0.0, 0.0));
+  firstRound = true;
+}
+
+void Wavefront::intersect(const Scene &scene) {
+  int n = (int)paths.size();
+  if ((int)hits.size() < n)
+    hits.resize(n);
+  found.resize(n);
+  if (!firstRound || packetSize <= 1) {
+    for (int k = 0; k < n; k++)
+      found[k] = scene.intersect(paths[k].r, hits[k]);
+    return;
+  }
+  ray *rays[Scene::MaxPacketSize] = {};
+  isect *packetHits[Scene::MaxPacketSize] = {};
+  bool packetFound[Scene::MaxPacketSize];
+  for (int first = 0; first < n; first += packetSize) {
+    int count = std::min(packetSize, n - first);
+    for (int k = 0; k < count; k++) {
+      rays[k] = &paths[first + k].r;
+      packetHits[k] = &hits[first + k];
+    }
+    scene.intersect(rays, packetHits, packetFound, count);
+    for (int k = 0; k < count; k++)
+      found[first + k] = packetFound[k];
+  }
+}
+
+void Wavefront::sortHits() {
+  order.resize(paths.size());
+  std::iota(order.begin(), order.end(), 0);
+  auto key = [this](int k) -> const void * {
+    return found[k] ? hits[k].getObject() : nullptr;
+  };
+  std::less<const void *> before;
+  std::sort(order.begin(), order.end(),
+            [&](int a, int b) { return before(key(a), key(b)); });
+}
+
+void Wavefront::traceShadows(const Scene &scene) {
+  if (packetSize <= 1) {
+    for (ShadowQuery &shadow : shadows)
+      results[shadow.slot] +=
+          shadow.weight * scene.transmittance(shadow.r, shadow.distance);
+    shadows.clear();
+    return;
+  }
+
+  // Group the rays by light, keeping the queue order (and so the screen order)
+  // within each light
+  shadowOrder.resize(shadows.size());
+  std::iota(shadowOrder.begin(), shadowOrder.end(), 0);
+  std::less<const void *> before;
+  std::stable_sort(shadowOrder.begin(), shadowOrder.end(), [&](int a, int b) {
+    return before(shadows[a].deltaLight, shadows[b].deltaLight);
+  });
+  int n = (int)shadowOrder.size();
+  for (int first = 0; first < n;) {
+    const Light *light = shadows[shadowOrder[first]].deltaLight;
+    int count = 1;
+    while (first + count < n && count < packetSize &&
+           shadows[shadowOrder[first + count]].deltaLight == light)
+      count++;
+    if (light) {
+      traceShadowPacket(scene, &shadowOrder[first], count);
+    } else {
+      for (int k = first; k < first + count; k++) {
+        ShadowQuery &shadow = shadows[shadowOrder[k]];
+        results[shadow.slot] +=
+            shadow.weight * scene.transmittance(shadow.r, shadow.distance);
+      }
+    }
+    first += count;
+  }
+  shadows.clear();
+}
+
+void Wavefront::traceShadowPacket(const Scene &scene, const int *queries,
+                                  int n) {
+  ray *rays[Scene::MaxPacketSize] = {};
+  double tMax[Scene::MaxPacketSize] = {};
+  bool blocked[Scene::MaxPacketSize];
+  for (int k = 0; k < n; k++) {
+    rays[k] = &shadows[queries[k]].r;
+    tMax[k] = shadows[queries[k]].distance;
+  }
+  scene.occluded(rays, tMax, blocked, n);
+  for (int k = 0; k < n; k++) {
+    if (blocked[k])
+      continue;
+    ShadowQuery &shadow = shadows[queries[k]];
+    glm::dvec3 light(1.0);
+    if (scene.hasTranslucentObjects())
+      light = scene.translucentTransmittance(shadow.r, shadow.distance);
+    results[shadow.slot] += shadow.weight * light;
+  }
+}
+
+bool Wavefront::advance() {
+  paths.swap(next);
+  next.clear();
+  firstRound = false;
+  return !paths.empty();
+}
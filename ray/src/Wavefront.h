@@ -0,0 +1,115 @@
+#ifndef __WAVEFRONT_H__
+#define __WAVEFRONT_H__
+
+// Queues for the wavefront path tracing engine.
+//
+// The megakernel engine (RayTracer::tracePath) follows one path from the
+// camera to its end, switching between BVH traversal, intersectLocal and
+// shading at every bounce. The wavefront engine keeps a batch of paths
+// and runs one stage over all of them before starting the next: intersect
+// the batch, sort the hits by the object they landed on, shade them, then
+// trace the shadow rays the shading asked for. Paths that carry on are
+// queued for the next round. Each stage is a plain loop over an array, so
+// it keeps its own code and data in cache, and batched kernels (packets,
+// SIMD traversal) can replace a stage without touching the others.
+//
+// The camera rays of a batch, and the shadow rays toward one point or
+// directional light, are coherent enough to walk the BVH as packets; see
+// setPacketSize().
+//
+// A Wavefront only holds the queues and runs the scene queries. RayTracer
+// makes the camera rays and shades each hit with the same per-bounce code
+// as tracePath, so both engines render the same image.
+
+#include "scene/ray.h"
+#include <glm/vec3.hpp>
+#include <stdint.h>
+#include <vector>
+
+class Light;
+class Scene;
+
+// A path between bounces
+struct PathState {
+  explicit PathState(const ray &r, uint32_t pixel = 0, uint32_t index = 0,
+                     int slot = 0)
+      : r(r), pixel(pixel), index(index), slot(slot) {}
+
+  ray r;
+  // Product of the BRDF/pdf factors so far
+  glm::dvec3 throughput{1.0, 1.0, 1.0};
+  // Solid-angle pdf of the bounce that sent r; 0 for the camera ray
+  double bsdfPdf = 0.0;
+  int depth = 0;
+  uint32_t pixel; // the sample this path belongs to, for its SampleStream
+  uint32_t index;
+  int slot; // where the wavefront adds up its radiance
+};
+
+// A next-event shadow ray: weight is what arrives if nothing is in the way
+struct ShadowQuery {
+  ShadowQuery()
+      : r(glm::dvec3(0.0), glm::dvec3(0.0), glm::dvec3(1.0), ray::SHADOW) {}
+
+  ray r;
+  double distance = 0.0;
+  glm::dvec3 weight{0.0, 0.0, 0.0};
+  int slot = 0;
+  // Set for point and directional lights, whose shadow rays all head for
+  // the same point or in the same direction
+  const Light *deltaLight = nullptr;
+};
+
+class Wavefront {
+public:
+  // Start a new batch whose paths add up their radiance in slots
+  // [0, slots)
+  void reset(int slots);
+  void addPath(const PathState &path) { paths.push_back(path); }
+
+  // Rays per packet for the camera rays and delta-light shadow rays, up to
+  // Scene::MaxPacketSize; 1 traces every ray on its own
+  void setPacketSize(int size) { packetSize = size; }
+
+  // Closest hit of every queued path. In the first round, paths queued
+  // one after another (neighbouring samples) are traced as packets.
+  void intersect(const Scene &scene);
+  // Order the paths so that hits on the same object, and so with the same
+  // material and intersection code, are shaded together. Misses come
+  // first.
+  void sortHits();
+
+  // The queued paths, in shading order once sortHits() has run
+  int pathCount() const { return (int)paths.size(); }
+  PathState &path(int k) { return paths[order[k]]; }
+  bool hit(int k) const { return found[order[k]] != 0; }
+  const isect &hitInfo(int k) const { return hits[order[k]]; }
+
+  // Filled in while shading
+  void continuePath(const PathState &path) { next.push_back(path); }
+  void addShadow(const ShadowQuery &shadow) { shadows.push_back(shadow); }
+
+  // Trace every queued shadow ray and add what gets through to its slot.
+  // Rays toward the same delta light go in packets.
+  void traceShadows(const Scene &scene);
+  // Make the continued paths the new batch; false once none are left
+  bool advance();
+
+  glm::dvec3 &radiance(int slot) { return results[slot]; }
+
+private:
+  void traceShadowPacket(const Scene &scene, const int *queries, int n);
+
+  int packetSize = 1;
+  bool firstRound = true;
+  std::vector<PathState> paths;
+  std::vector<PathState> next;
+  std::vector<isect> hits;
+  std::vector<char> found;
+  std::vector<int> order;
+  std::vector<ShadowQuery> shadows;
+  std::vector<int> shadowOrder;
+  std::vector<glm::dvec3> results;
+};
+
+#endif // __WAVEFRONT_H__
@@ -1,5 +1,6 @@
 #include "JsonParser.h"
 #include "ParserException.h"
+#include "../ui/TraceUI.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #define TINYOBJLOADER_USE_DOUBLE
@@ -13,6 +14,8 @@
 #include <json.hpp>
 using json = nlohmann::json;
 
+extern TraceUI *traceUI;
+
 // 1.5GB of memory at ~300B per Material
 constexpr size_t MAX_RECOMMENDED_VERTS = 5'000'000;
 
@@ -228,11 +231,19 @@ Cone *parseConeBody(const json &j, ParseData &pd)
   return c;
 }
 
+MeshOptions parseMeshOptions(const json &j)
+{
+  MeshOptions options;
+  IGNORE_MISSING(j.at("gennormals").get_to(options.genNormals));
+  IGNORE_MISSING(j.at("spatial_splits").get_to(options.spatialSplits));
+  IGNORE_MISSING(j.at("split_overlap").get_to(options.splitOverlap));
+  return options;
+}
+
 Trimesh *parseTrimeshBody(const json &j, ParseData &pd)
 {
   Material m = GET_MAT_W_CUR(j, pd);
   auto t = new Trimesh(pd.s, &m, pd.getCurrentTransform());
-  bool genNormals = false;
 
   glm::dvec3 point;
   for (const json &pt_json : j.at("points"))
@@ -294,18 +305,19 @@ Trimesh *parseTrimeshBody(const json &j, ParseData &pd)
                           "obj_mesh instead");
   }
 
-  IGNORE_MISSING(j.at("gennormals").get_to(genNormals));
+  MeshOptions options = parseMeshOptions(j);
   if (t->doubleCheck() != nullptr)
   {
     throw ParserException("Error in mesh: " + std::string(t->doubleCheck()));
   }
-  if (genNormals)
+  if (options.genNormals)
   {
     t->generateNormals();
   }
-
-  // Build BVH
-  t->buildTree();
+  if (options.spatialSplits)
+  {
+    t->useSpatialSplits(options.splitOverlap);
+  }
 
   return t;
 }
@@ -357,6 +369,11 @@ std::vector<Geometry *> parseGeometry(const json &j, ParseData &pd)
     std::vector<Trimesh *> trimeshes = parseObjmeshBody(val, pd);
     return std::vector<Geometry *>(trimeshes.begin(), trimeshes.end());
   }
+  else if (key == "instance")
+  {
+    std::vector<Trimesh *> trimeshes = parseInstanceBody(val, pd);
+    return std::vector<Geometry *>(trimeshes.begin(), trimeshes.end());
+  }
   else
   {
     throw ParserException("Unknown geometry type: " + key);
@@ -370,8 +387,9 @@ bool isTransformKey(const std::string &s)
   return std::find(std::begin(transformKeys), std::end(transformKeys), s) !=
          std::end(transformKeys);
 }
-const std::string geomKeys[7] = {"sphere", "box", "square", "cylinder",
-                                 "cone", "tri_mesh", "obj_mesh"};
+const std::string geomKeys[8] = {"sphere",   "box",      "square",
+                                 "cylinder", "cone",     "tri_mesh",
+                                 "obj_mesh", "instance"};
 bool isGeometryKey(const std::string &s)
 {
   return std::find(std::begin(geomKeys), std::end(geomKeys), s) !=
@@ -453,6 +471,10 @@ Scene *JsonParser::parseScene()
   ParseData pd;
   pd.s = scene;
   pd.scene_dir = this->fileDirPath;
+  if (traceUI && !traceUI->getMeshCacheDir().empty())
+  {
+    pd.meshCache = std::make_unique<MeshCache>(traceUI->getMeshCacheDir());
+  }
 
   for (const auto &object : j)
   {
@@ -470,6 +492,10 @@ Scene *JsonParser::parseScene()
       pd.cur_mat = Material{};
       pd.cur_mat = parseMaterial(val, pd);
     }
+    else if (key == "mesh")
+    {
+      parseMeshDefinition(val, pd);
+    }
     else if (key == "ambient_light")
     {
       scene->addAmbient(parseAmbientLight(val));
@@ -508,9 +534,6 @@ Scene *JsonParser::parseScene()
     }
   }
 
-  // Build tree
-  scene->buildTree();
-
   return scene;
 }
 
@@ -553,12 +576,10 @@ struct TinyObjIndexEq
 /* The full OBJ file format is chaotic neutral. To try to tame some of this, we
 only support certain features. See jsonformat.md for the limitations.
 */
-Trimesh *loadObjToTrimesh(const tinyobj::ObjReader &rdr,
-                          const tinyobj::shape_t &s, Trimesh *t,
-                          ParseData &pd)
+void loadObjToTrimesh(const tinyobj::ObjReader &rdr, const tinyobj::shape_t &s,
+                      TrimeshData *t)
 {
   auto &attrib = rdr.GetAttrib();
-  auto &materials = rdr.GetMaterials();
 
   /* Faces in OBJ files can use different indices for
      UV/normals/positions. For example, naively you can specify a face as
@@ -624,8 +645,19 @@ Trimesh *loadObjToTrimesh(const tinyobj::ObjReader &rdr,
     t->addFace(i0, i1, i2);
   }
 
-  /* Finished parsing geometry, now parse materials. The parser currently
-  only supports a single material per mesh, because to do otherwise
+  const char *err = t->doubleCheck();
+  if (err != nullptr)
+  {
+    throw ParserException("Error while parsing OBJ file: " + std::string(err));
+  }
+}
+
+ObjMaterialRecord loadObjMaterial(const tinyobj::ObjReader &rdr)
+{
+  auto &materials = rdr.GetMaterials();
+
+  /* The parser currently only supports a single material per mesh, because
+  to do otherwise
   would require modification of the Trimesh class itself.
 
   If you want to support multiple materials, you need to do the following:
@@ -648,56 +680,85 @@ auto k = s.mesh.material_ids[f];
 */
 
   // Take the first material associated with the mesh and use it.
-  Material *m = new Material();
+  ObjMaterialRecord record;
   if (materials.size() > 0)
   {
-    tinyobj::material_t mtl = materials[0];
-    m->setDiffuse(glm::make_vec3(mtl.diffuse));
-    m->setSpecular(glm::make_vec3(mtl.specular));
-    m->setAmbient(glm::make_vec3(mtl.ambient));
-    m->setTransmissive(glm::make_vec3(mtl.transmittance));
-    m->setEmissive(glm::make_vec3(mtl.emission));
-    m->setShininess(mtl.shininess);
-    m->setIndex(mtl.ior);
+    const tinyobj::material_t &mtl = materials[0];
+    record.present = true;
+    record.diffuse = glm::make_vec3(mtl.diffuse);
+    record.specular = glm::make_vec3(mtl.specular);
+    record.ambient = glm::make_vec3(mtl.ambient);
+    record.transmissive = glm::make_vec3(mtl.transmittance);
+    record.emissive = glm::make_vec3(mtl.emission);
+    record.shininess = mtl.shininess;
+    record.index = mtl.ior;
+    record.diffuseTexture = mtl.diffuse_texname;
+    record.specularTexture = mtl.specular_texname;
+  }
+  return record;
+}
 
-    if (!mtl.diffuse_texname.empty())
+Material objMaterial(const ObjMaterialRecord &mtl, ParseData &pd)
+{
+  Material m;
+  if (mtl.present)
+  {
+    m.setDiffuse(mtl.diffuse);
+    m.setSpecular(mtl.specular);
+    m.setAmbient(mtl.ambient);
+    m.setTransmissive(mtl.transmissive);
+    m.setEmissive(mtl.emissive);
+    m.setShininess(mtl.shininess);
+    m.setIndex(mtl.index);
+
+    if (!mtl.diffuseTexture.empty())
     {
-      std::string texPath = (pd.scene_dir / mtl.diffuse_texname).string();
-      m->setDiffuse(MaterialParameter(pd.s->getTexture(texPath)));
+      std::string texPath = (pd.scene_dir / mtl.diffuseTexture).string();
+      m.setDiffuse(MaterialParameter(pd.s->getTexture(texPath)));
     }
 
-    if (!mtl.specular_texname.empty())
+    if (!mtl.specularTexture.empty())
     {
-      std::string texPath = (pd.scene_dir / mtl.specular_texname).string();
-      m->setSpecular(MaterialParameter(pd.s->getTexture(texPath)));
+      std::string texPath = (pd.scene_dir / mtl.specularTexture).string();
+      m.setSpecular(MaterialParameter(pd.s->getTexture(texPath)));
     }
   }
 
-  t->setMaterial(m);
+  return m;
+}
 
-  if (attrib.normals.size() > 0)
+// Reads an OBJ file, or returns the copy an earlier obj_mesh or mesh
+// already read. Each shape of the file becomes one TrimeshData.
+std::shared_ptr<const ObjAsset> loadObjAsset(const std::string &objFile,
+                                             const MeshOptions &options,
+                                             ParseData &pd)
+{
+  std::string path = (pd.scene_dir / objFile).lexically_normal().string();
+  auto cached = pd.objCache.find({path, options.key()});
+  if (cached != pd.objCache.end())
   {
-    t->vertNorms = true;
+    return cached->second;
   }
 
-  const char *err = t->doubleCheck();
-  if (err != nullptr)
+  // Then the mesh cache on disk, from an earlier run
+  uint64_t cacheKey = 0;
+  if (pd.meshCache)
   {
-    throw ParserException("Error while parsing OBJ file: " + std::string(err));
+    BVHBuildSettings settings =
+        TrimeshData::treeSettings(options.spatialSplits, options.splitOverlap);
+    cacheKey = pd.meshCache->key(path, pd.scene_dir.string(),
+                                 options.genNormals, settings);
+    auto asset = std::make_shared<ObjAsset>();
+    ObjMaterialRecord material;
+    if (cacheKey != 0 &&
+        pd.meshCache->load(cacheKey, settings, asset->shapes, material))
+    {
+      asset->material = objMaterial(material, pd);
+      pd.objCache[{path, options.key()}] = asset;
+      return asset;
+    }
   }
 
-  return t;
-}
-
-std::vector<Trimesh *> parseObjmeshBody(const json &j, ParseData &pd)
-{
-  std::string objFile = j.at("objfile").get<std::string>();
-  std::string path = (pd.scene_dir / objFile).string();
-  bool genNormals = false;
-  IGNORE_MISSING(j.at("gennormals").get_to(genNormals));
-
-  std::vector<Trimesh *> results;
-
   tinyobj::ObjReaderConfig reader_config;
   reader_config.mtl_search_path = pd.scene_dir.string();
   reader_config.triangulate = true;
@@ -736,19 +797,81 @@ std::vector<Trimesh *> parseObjmeshBody(const json &j, ParseData &pd)
               << std::endl;
   }
 
+  ObjMaterialRecord material = loadObjMaterial(reader);
+  auto asset = std::make_shared<ObjAsset>();
   for (const tinyobj::shape_t &s : shapes)
   {
-    Trimesh *t = new Trimesh(pd.s, &pd.cur_mat, pd.getCurrentTransform());
+    auto t = std::make_shared<TrimeshData>();
 
-    loadObjToTrimesh(reader, s, t, pd);
+    loadObjToTrimesh(reader, s, t.get());
 
-    if (genNormals)
+    if (options.genNormals)
     {
       t->generateNormals();
     }
+    if (options.spatialSplits)
+    {
+      t->useSpatialSplits(options.splitOverlap);
+    }
+    if (cacheKey != 0)
+    {
+      // Saved once Scene::buildTree has built its tree
+      std::string file = pd.meshCache->path(cacheKey, asset->shapes.size());
+      int shape = asset->shapes.size();
+      int shapeCount = shapes.size();
+      t->whenTreeBuilt([=](const TrimeshData &mesh) {
+        MeshCache::save(file, cacheKey, shape, shapeCount, mesh, material);
+      });
+    }
 
-    t->buildTree();
-    results.push_back(t);
+    asset->shapes.push_back(t);
+  }
+  asset->material = objMaterial(material, pd);
+
+  pd.objCache[{path, options.key()}] = asset;
+  return asset;
+}
+
+// One Trimesh per shape of asset, all sharing the asset's geometry
+std::vector<Trimesh *> instantiateObjAsset(const ObjAsset &asset,
+                                           Material &mat, ParseData &pd)
+{
+  std::vector<Trimesh *> results;
+  for (const auto &shape : asset.shapes)
+  {
+    results.push_back(
+        new Trimesh(pd.s, &mat, pd.getCurrentTransform(), shape));
   }
   return results;
 }
+
+std::vector<Trimesh *> parseObjmeshBody(const json &j, ParseData &pd)
+{
+  std::string objFile = j.at("objfile").get<std::string>();
+
+  auto asset = loadObjAsset(objFile, parseMeshOptions(j), pd);
+  Material m = asset->material;
+  return instantiateObjAsset(*asset, m, pd);
+}
+
+void parseMeshDefinition(const json &j, ParseData &pd)
+{
+  std::string name = j.at("name").get<std::string>();
+  std::string objFile = j.at("objfile").get<std::string>();
+
+  pd.meshes[name] = loadObjAsset(objFile, parseMeshOptions(j), pd);
+}
+
+std::vector<Trimesh *> parseInstanceBody(const json &j, ParseData &pd)
+{
+  std::string name = j.at("mesh").get<std::string>();
+  auto mesh = pd.meshes.find(name);
+  if (mesh == pd.meshes.end())
+  {
+    throw ParserException("Instance of unknown mesh \"" + name +
+                          "\": declare it with a mesh object first");
+  }
+  Material m = hasKey(j, "material") ? parseMaterial(j.at("material"), pd)
+                                     : mesh->second->material;
+  return instantiateObjAsset(*mesh->second, m, pd);
+}
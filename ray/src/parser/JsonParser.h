@@ -16,7 +16,9 @@ and backtracing to the error frame, then printing the JSON object to
 see what's going wrong. */
 
 #include <map>
+#include <memory>
 #include <string>
+#include <tuple>
 
 #include <filesystem>
 #include <fstream>
@@ -37,9 +39,30 @@ using json = nlohmann::json;
 #include "../SceneObjects/trimesh.h"
 #include "../scene/light.h"
 #include "../scene/scene.h"
+#include "MeshCache.h"
 
 typedef std::map<string, Material> mmap;
 
+/* The meshes of an OBJ file and the material its MTL file gives them. The
+geometry is shared by every obj_mesh and instance made from the file. */
+struct ObjAsset {
+  std::vector<std::shared_ptr<TrimeshData>> shapes;
+  Material material;
+};
+
+/* How a mesh is prepared: the gennormals, spatial_splits and split_overlap
+keys of tri_mesh, obj_mesh and mesh. */
+struct MeshOptions {
+  bool genNormals = false;
+  bool spatialSplits = false;
+  double splitOverlap = -1.0; // negative: the render settings' budget
+
+  std::tuple<bool, bool, double> key() const
+  {
+    return {genNormals, spatialSplits, splitOverlap};
+  }
+};
+
 /* While parsing, we need to track certain data, such as the current
 scene, the directory of the scene file (for loading textures + cubemaps),
 the stack of transforms that is currently active, and the last material
@@ -53,6 +76,14 @@ struct ParseData {
   std::vector<glm::dmat4> transformStack;
   Scene *s;
   std::filesystem::path scene_dir;
+  // OBJ files read so far, by path and MeshOptions
+  std::map<std::pair<std::string, std::tuple<bool, bool, double>>,
+           std::shared_ptr<const ObjAsset>>
+      objCache;
+  // Meshes declared with a top-level "mesh" object, by name
+  std::map<std::string, std::shared_ptr<const ObjAsset>> meshes;
+  // Set when the mesh_cache setting names a directory
+  std::unique_ptr<MeshCache> meshCache;
 
   glm::dmat4 getCurrentTransform();
 };
@@ -75,8 +106,11 @@ Box *parseBoxBody(const json &j, ParseData &pd);
 Square *parseSquareBody(const json &j, ParseData &pd);
 Cylinder *parseCylinderBody(const json &j, ParseData &pd);
 Cone *parseConeBody(const json &j, ParseData &pd);
+MeshOptions parseMeshOptions(const json &j);
 Trimesh *parseTrimeshBody(const json &j, ParseData &pd);
 std::vector<Trimesh *> parseObjmeshBody(const json &j, ParseData &pd);
+void parseMeshDefinition(const json &j, ParseData &pd);
+std::vector<Trimesh *> parseInstanceBody(const json &j, ParseData &pd);
 std::vector<Geometry *> parseGeometry(const json &j, ParseData &pd);
 
 std::vector<Geometry *> parseTransform(const json &j, ParseData &pd);
@@ -0,0 +1,432 @@
+#include "MeshCache.h"
+#include "../SceneObjects/trimesh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Faces and nodes are saved as their bytes
+static_assert(std::is_trivially_copyable<TrimeshFace>::value,
+              "MeshCache copies TrimeshFace as raw bytes");
+static_assert(std::is_trivially_copyable<LinearBVHNode>::value,
+              "MeshCache copies LinearBVHNode as raw bytes");
+
+namespace {
+
+const char Magic[8] = "RAYMESH";
+// Bump whenever the blob layout or anything saved in it changes meaning
+const uint32_t Version = 1;
+
+// Fixed-size start of a blob. The sections follow in the order of the
+// counts, each padded to 8 bytes, then the texture names.
+struct BlobHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t faceSize;
+  uint32_t nodeSize;
+  int32_t shape;
+  int32_t shapeCount;
+  int32_t depth; // of the saved tree
+  uint64_t key;
+  uint64_t vertices, normals, tangents, bitangents, colors, uvs;
+  uint64_t faces; // also the length of the area CDF
+  uint64_t nodes, prims;
+  uint64_t diffuseTexture, specularTexture; // name lengths
+  double sahCost;
+  int32_t hasMaterial;
+  int32_t pad;
+  double material[5][3]; // diffuse, specular, ambient, transmissive, emissive
+  double shininess, index;
+};
+static_assert(sizeof(BlobHeader) % 8 == 0, "sections start 8-byte aligned");
+
+// A whole file, memory-mapped where the platform allows
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+#ifdef _WIN32
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      return;
+    buffer.assign(std::istreambuf_iterator<char>(in),
+                  std::istreambuf_iterator<char>());
+    data = (const unsigned char *)buffer.data();
+    length = buffer.size();
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data = (const unsigned char *)p;
+        length = st.st_size;
+      }
+    }
+    close(fd);
+#endif
+  }
+  ~MappedFile() {
+#ifndef _WIN32
+    if (data)
+      munmap((void *)data, length);
+#endif
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool valid() const { return data != nullptr; }
+  const unsigned char *bytes() const { return data; }
+  size_t size() const { return length; }
+
+private:
+  const unsigned char *data = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  std::vector<char> buffer;
+#endif
+};
+
+// 64-bit hash of n bytes, eight at a time. Not cryptographic; it only has
+// to tell edited files apart.
+uint64_t hashBytes(const void *bytes, size_t n, uint64_t h) {
+  const unsigned char *p = (const unsigned char *)bytes;
+  const uint64_t mul = 0x9e3779b97f4a7c15ull;
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    uint64_t word;
+    memcpy(&word, p + k, 8);
+    h = (h ^ word) * mul;
+    h ^= h >> 29;
+  }
+  for (; k < n; k++)
+    h = (h ^ p[k]) * 0x100000001b3ull;
+  h = (h ^ n) * mul;
+  return h ^ (h >> 32);
+}
+
+// The file names on the OBJ's mtllib lines
+std::vector<std::string> mtlLibraries(std::string_view obj) {
+  std::vector<std::string> names;
+  for (size_t pos = obj.find("mtllib"); pos != std::string_view::npos;
+       pos = obj.find("mtllib", pos + 6)) {
+    if (pos > 0 && obj[pos - 1] != '\n')
+      continue;
+    size_t end = obj.find('\n', pos);
+    std::istringstream line(
+        std::string(obj.substr(pos + 6, end == std::string_view::npos
+                                            ? std::string_view::npos
+                                            : end - pos - 6)));
+    std::string name;
+    while (line >> name)
+      names.push_back(name);
+  }
+  return names;
+}
+
+// Bounds-checked reads of the sections after the header
+class BlobReader {
+public:
+  BlobReader(const unsigned char *p, size_t n) : at(p), left(n) {}
+
+  bool read(void *dst, uint64_t bytes) {
+    if (bytes > left)
+      return false;
+    memcpy(dst, at, bytes);
+    skip(bytes);
+    return true;
+  }
+  template <typename T> bool read(std::vector<T> &dst, uint64_t count) {
+    if (count > left / sizeof(T))
+      return false;
+    dst.resize(count);
+    return read(dst.data(), count * sizeof(T));
+  }
+  bool read(std::string &dst, uint64_t length) {
+    if (length > left)
+      return false;
+    dst.assign((const char *)at, length);
+    skip(length);
+    return true;
+  }
+
+private:
+  void skip(uint64_t bytes) {
+    uint64_t padded = std::min<uint64_t>((bytes + 7) & ~7ull, left);
+    at += padded;
+    left -= padded;
+  }
+
+  const unsigned char *at;
+  size_t left;
+};
+
+// Are all links of the saved tree inside it? Also finds the depth of the
+// tree, which sizes the traversal stacks, rather than trusting the header's.
+bool validTree(const std::vector<LinearBVHNode> &nodes, size_t prims,
+               int &depth) {
+  // Children always come after their parent, so one pass in order sees
+  // every parent of a node before the node itself
+  std::vector<int> depths(nodes.size(), 1);
+  depth = nodes.empty() ? 0 : 1;
+  for (size_t k = 0; k < nodes.size(); k++) {
+    const LinearBVHNode &node = nodes[k];
+    depth = std::max(depth, depths[k]);
+    if (node.isLeaf()) {
+      if (node.primOffset < 0 || (size_t)node.primOffset + node.primCount > prims)
+        return false;
+    } else if (node.rightChild <= (int)k || node.rightChild >= (int)nodes.size() ||
+               k + 1 >= nodes.size()) {
+      return false;
+    } else {
+      depths[k + 1] = std::max(depths[k + 1], depths[k] + 1);
+      depths[node.rightChild] = std::max(depths[node.rightChild], depths[k] + 1);
+    }
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+MeshCache::MeshCache(const std::string &dir) : dir(dir) {
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+}
+
+uint64_t MeshCache::key(const std::string &objPath, const std::string &mtlDir,
+                        bool genNormals,
+                        const BVHBuildSettings &settings) const {
+  MappedFile obj(objPath);
+  if (!obj.valid())
+    return 0;
+  uint64_t h = hashBytes(obj.bytes(), obj.size(), Version);
+  for (const std::string &name : mtlLibraries(
+           std::string_view((const char *)obj.bytes(), obj.size()))) {
+    h = hashBytes(name.data(), name.size(), h);
+    MappedFile mtl((std::filesystem::path(mtlDir) / name).string());
+    if (mtl.valid())
+      h = hashBytes(mtl.bytes(), mtl.size(), h);
+  }
+  // Everything that changes the saved mesh or its binary tree; the wide
+  // tree and the box test kernel are redone on every load
+  std::ostringstream options;
+  options << std::hexfloat << genNormals << ' ' << settings.bins << ' '
+          << settings.traversalCost << ' ' << settings.leafCost << ' '
+          << settings.maxLeafSize << ' ' << settings.builder << ' '
+          << settings.spatialSplits << ' ' << settings.splitOverlap << ' '
+          << BVH_USE_SAH;
+  std::string text = options.str();
+  h = hashBytes(text.data(), text.size(), h);
+  return h ? h : 1;
+}
+
+std::string MeshCache::path(uint64_t key, int shape) const {
+  char name[48];
+  snprintf(name, sizeof(name), "%016llx.%d.mesh", (unsigned long long)key,
+           shape);
+  return (std::filesystem::path(dir) / name).string();
+}
+
+bool MeshCache::load(uint64_t key, const BVHBuildSettings &settings,
+                     std::vector<std::shared_ptr<TrimeshData>> &shapes,
+                     ObjMaterialRecord &material) const {
+  shapes.clear();
+  int shapeCount = 0;
+  auto first = loadShape(key, 0, shapeCount, settings, material);
+  if (!first)
+    return false;
+  shapes.push_back(first);
+  for (int k = 1; k < shapeCount; k++) {
+    int count = 0;
+    ObjMaterialRecord same;
+    auto shape = loadShape(key, k, count, settings, same);
+    if (!shape || count != shapeCount) {
+      shapes.clear();
+      return false;
+    }
+    shapes.push_back(shape);
+  }
+  return true;
+}
+
+std::shared_ptr<TrimeshData>
+MeshCache::loadShape(uint64_t key, int shape, int &shapeCount,
+                     const BVHBuildSettings &settings,
+                     ObjMaterialRecord &material) const {
+  MappedFile file(path(key, shape));
+  BlobHeader h;
+  if (!file.valid() || file.size() < sizeof(h))
+    return nullptr;
+  memcpy(&h, file.bytes(), sizeof(h));
+  if (memcmp(h.magic, Magic, sizeof(Magic)) != 0 || h.version != Version ||
+      h.faceSize != sizeof(TrimeshFace) ||
+      h.nodeSize != sizeof(LinearBVHNode) || h.key != key ||
+      h.shape != shape || h.shapeCount <= shape)
+    return nullptr;
+
+  auto mesh = std::make_shared<TrimeshData>();
+  BlobReader in(file.bytes() + sizeof(h), file.size() - sizeof(h));
+  std::vector<LinearBVHNode> nodes;
+  std::vector<int32_t> primIndex;
+  int depth = 0;
+  bool ok = in.read(mesh->vertices, h.vertices) &&
+            in.read(mesh->normals, h.normals) &&
+            in.read(mesh->tangents, h.tangents) &&
+            in.read(mesh->bitangents, h.bitangents) &&
+            in.read(mesh->vertColors, h.colors) &&
+            in.read(mesh->uvCoords, h.uvs) &&
+            h.faces <= file.size() / sizeof(TrimeshFace);
+  if (!ok)
+    return nullptr;
+  mesh->faceBlock.reset(new TrimeshFace[h.faces]);
+  ok = in.read(mesh->faceBlock.get(), h.faces * sizeof(TrimeshFace)) &&
+       in.read(mesh->areaCdf, h.faces) && in.read(nodes, h.nodes) &&
+       in.read(primIndex, h.prims) &&
+       validTree(nodes, primIndex.size(), depth);
+  if (!ok)
+    return nullptr;
+
+  mesh->faces.resize(h.faces);
+  for (uint64_t k = 0; k < h.faces; k++) {
+    TrimeshFace &face = mesh->faceBlock[k];
+    face.parent = mesh.get();
+    for (int v = 0; v < 3; v++)
+      if (face.ids[v] < 0 || (uint64_t)face.ids[v] >= h.vertices)
+        return nullptr;
+    mesh->faces[k] = &face;
+  }
+  std::vector<TrimeshFace *> prims(primIndex.size());
+  for (size_t k = 0; k < prims.size(); k++) {
+    if (primIndex[k] < 0 || (uint64_t)primIndex[k] >= h.faces)
+      return nullptr;
+    prims[k] = mesh->faces[primIndex[k]];
+  }
+
+  material = ObjMaterialRecord();
+  material.present = h.hasMaterial != 0;
+  material.diffuse = glm::dvec3(h.material[0][0], h.material[0][1], h.material[0][2]);
+  material.specular = glm::dvec3(h.material[1][0], h.material[1][1], h.material[1][2]);
+  material.ambient = glm::dvec3(h.material[2][0], h.material[2][1], h.material[2][2]);
+  material.transmissive = glm::dvec3(h.material[3][0], h.material[3][1], h.material[3][2]);
+  material.emissive = glm::dvec3(h.material[4][0], h.material[4][1], h.material[4][2]);
+  material.shininess = h.shininess;
+  material.index = h.index;
+  if (!in.read(material.diffuseTexture, h.diffuseTexture) ||
+      !in.read(material.specularTexture, h.specularTexture))
+    return nullptr;
+
+  BVHBuildInfo info;
+  info.prims = (int)h.faces;
+  info.references = (int)h.prims;
+  info.nodes = (int)h.nodes;
+  info.depth = depth;
+  info.sahCost = h.sahCost;
+  mesh->tree = new BVH<TrimeshFace>(std::move(nodes), std::move(prims),
+                                    settings, info);
+  shapeCount = h.shapeCount;
+  return mesh;
+}
+
+void MeshCache::save(const std::string &file, uint64_t key, int shape,
+                     int shapeCount, const TrimeshData &mesh,
+                     const ObjMaterialRecord &material) {
+  const BVH<TrimeshFace> *tree = mesh.tree;
+  if (!tree)
+    return;
+
+  std::unordered_map<const TrimeshFace *, int32_t> faceIndex;
+  for (size_t k = 0; k < mesh.faces.size(); k++)
+    faceIndex[mesh.faces[k]] = (int32_t)k;
+  std::vector<int32_t> primIndex;
+  primIndex.reserve(tree->primitives().size());
+  for (const TrimeshFace *face : tree->primitives())
+    primIndex.push_back(faceIndex[face]);
+
+  BlobHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, Magic, sizeof(Magic));
+  h.version = Version;
+  h.faceSize = sizeof(TrimeshFace);
+  h.nodeSize = sizeof(LinearBVHNode);
+  h.shape = shape;
+  h.shapeCount = shapeCount;
+  h.depth = tree->buildInfo().depth;
+  h.key = key;
+  h.vertices = mesh.vertices.size();
+  h.normals = mesh.normals.size();
+  h.tangents = mesh.tangents.size();
+  h.bitangents = mesh.bitangents.size();
+  h.colors = mesh.vertColors.size();
+  h.uvs = mesh.uvCoords.size();
+  h.faces = mesh.faces.size();
+  h.nodes = tree->flatNodes().size();
+  h.prims = primIndex.size();
+  h.diffuseTexture = material.diffuseTexture.size();
+  h.specularTexture = material.specularTexture.size();
+  h.sahCost = tree->buildInfo().sahCost;
+  h.hasMaterial = material.present;
+  const glm::dvec3 *colors[5] = {&material.diffuse, &material.specular,
+                                 &material.ambient, &material.transmissive,
+                                 &material.emissive};
+  for (int c = 0; c < 5; c++)
+    for (int i = 0; i < 3; i++)
+      h.material[c][i] = (*colors[c])[i];
+  h.shininess = material.shininess;
+  h.index = material.index;
+
+  std::string tmp =
+      file + "." +
+      std::to_string(
+          std::chrono::steady_clock::now().time_since_epoch().count()) +
+      ".tmp";
+  std::ofstream out(tmp, std::ios::binary);
+  const char zeros[8] = {};
+  auto write = [&out, &zeros](const void *p, size_t bytes) {
+    out.write((const char *)p, bytes);
+    out.write(zeros, (8 - bytes % 8) % 8);
+  };
+  write(&h, sizeof(h));
+  write(mesh.vertices.data(), mesh.vertices.size() * sizeof(glm::dvec3));
+  write(mesh.normals.data(), mesh.normals.size() * sizeof(glm::dvec3));
+  write(mesh.tangents.data(), mesh.tangents.size() * sizeof(glm::dvec3));
+  write(mesh.bitangents.data(), mesh.bitangents.size() * sizeof(glm::dvec3));
+  write(mesh.vertColors.data(), mesh.vertColors.size() * sizeof(glm::dvec3));
+  write(mesh.uvCoords.data(), mesh.uvCoords.size() * sizeof(glm::dvec2));
+  // Faces go contiguous, in order; the parent pointer is fixed up on load
+  for (const TrimeshFace *face : mesh.faces)
+    out.write((const char *)face, sizeof(TrimeshFace));
+  write(mesh.areaCdf.data(), mesh.areaCdf.size() * sizeof(double));
+  write(tree->flatNodes().data(),
+        tree->flatNodes().size() * sizeof(LinearBVHNode));
+  write(primIndex.data(), primIndex.size() * sizeof(int32_t));
+  write(material.diffuseTexture.data(), material.diffuseTexture.size());
+  write(material.specularTexture.data(), material.specularTexture.size());
+  out.close();
+
+  std::error_code ec;
+  if (out.good())
+    std::filesystem::rename(tmp, file, ec);
+  if (!out.good() || ec) {
+    std::cerr << "Warning: could not write mesh cache entry " << file
+              << std::endl;
+    std::filesystem::remove(tmp, ec);
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+/*
+An on-disk cache of meshes read from OBJ files, so that rendering the same
+scene again skips tinyobj, the vertex deduplication in loadObjToTrimesh,
+the per-face setup in TrimeshFace and the BVH build.
+
+Each shape of an OBJ file is saved, once its tree is built, as one binary
+blob in the cache directory: vertices, normals, UVs and colors, the faces
+as constructed, the flattened binary BVH and the material the MTL file
+gives the mesh. The blob's name is a 64-bit key hashed from the contents of
+the OBJ file and the MTL files it names, the gennormals option and the BVH
+build settings, so editing any of them makes a new entry rather than
+reading a stale one. Later runs memory-map the blobs and copy the arrays
+straight out; only the wide BVH nodes are made again.
+
+Blobs are a cache, not a file format: they are only read by a build whose
+face and node layouts match, and a blob that doesn't check out is ignored.
+Nothing ever removes old entries; delete the directory to clear it.
+*/
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+#include "../scene/bvh.h"
+
+class TrimeshData;
+
+// The parts of an OBJ file's first material the parser uses (see
+// loadObjMaterial)
+struct ObjMaterialRecord {
+  bool present = false;
+  glm::dvec3 diffuse{0.0}, specular{0.0}, ambient{0.0};
+  glm::dvec3 transmissive{0.0}, emissive{0.0};
+  double shininess = 0.0;
+  double index = 1.0;
+  std::string diffuseTexture;
+  std::string specularTexture;
+};
+
+class MeshCache {
+public:
+  // Creates dir if it doesn't exist yet
+  explicit MeshCache(const std::string &dir);
+
+  // Key for the OBJ file at objPath, whose MTL files are looked up in
+  // mtlDir, read with these options and built with settings. 0 if the file
+  // can't be read.
+  uint64_t key(const std::string &objPath, const std::string &mtlDir,
+               bool genNormals, const BVHBuildSettings &settings) const;
+
+  // Reads every shape saved under key, with trees for settings. False,
+  // leaving shapes empty, unless all of them are there and valid.
+  bool load(uint64_t key, const BVHBuildSettings &settings,
+            std::vector<std::shared_ptr<TrimeshData>> &shapes,
+            ObjMaterialRecord &material) const;
+
+  // Where shape (of shapeCount) of the file with key is saved
+  std::string path(uint64_t key, int shape) const;
+
+  // Saves mesh, whose tree must be built, as shape of shapeCount to file.
+  // Writes to a temporary file first, so a blob is either whole or
+  // missing. Failures are reported on stderr and otherwise ignored.
+  static void save(const std::string &file, uint64_t key, int shape,
+                   int shapeCount, const TrimeshData &mesh,
+                   const ObjMaterialRecord &material);
+
+private:
+  std::shared_ptr<TrimeshData> loadShape(uint64_t key, int shape,
+                                         int &shapeCount,
+                                         const BVHBuildSettings &settings,
+                                         ObjMaterialRecord &material) const;
+
+  std::string dir;
+};
@@ -2,57 +2,326 @@
 #define BVH_H__
 
 #include "bbox.h"
+#include "bvhsimd.h"
 #include "scene.h"
+#include "stats.h"
+#include "../ThreadPool.h"
 #include <glm/gtx/io.hpp>
 #include <algorithm>
 #include <assert.h>
+#include <chrono>
 #include <cmath>
 #include <float.h>
+#include <stdint.h>
 #include <string.h>
 #include <iostream>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 using namespace std;
 
-struct BVHNode
+// Build-time switch between the binned SAH builder and the original
+// longest-axis midpoint splitter, so both trees can be A/B tested.
+// Configure with -DRAY_BVH_SAH=OFF (or define BVH_USE_SAH=0) for midpoints.
+#ifndef BVH_USE_SAH
+#define BVH_USE_SAH 1
+#endif
+
+// Knobs for the SAH builder. Costs are relative to each other: a split is
+// only taken if traversalCost plus the area-weighted cost of intersecting
+// both children is cheaper than intersecting every primitive in the node.
+struct BVHBuildSettings
+{
+    int bins = 16;              // SAH buckets per axis
+    double traversalCost = 1.0; // cost of visiting an interior node
+    double leafCost = 1.0;      // cost of intersecting a single primitive
+    int maxLeafSize = 4;        // nodes bigger than this are always split
+    int width = 2;              // children per node for single-ray traversal: 2, 4 or 8
+    std::string simd = "auto";  // box test kernel for the wide tree, see bvhsimd.h
+    std::string builder = "sah"; // "sah", or "lbvh" for a quick Morton-order build
+    int parallelThreshold = 16384; // smaller trees are built on one thread
+    bool spatialSplits = false; // SBVH: let nodes split primitives, see makeSBVH
+    double splitOverlap = 1e-5; // child overlap, over root area, that triggers a spatial split search
+    double rebuildRatio = 1.5;  // Scene::updateTree rebuilds once refitting raises the SAH cost this much
+};
+
+// The builder a "builder" setting actually gets in this build: "sah" means
+// midpoint splits when BVH_USE_SAH is off.
+inline const char *bvhBuilderName(const std::string &builder){
+    if(builder == "lbvh"){
+        return "lbvh";
+    }
+    return BVH_USE_SAH ? "sah" : "midpoint";
+}
+
+// Settings currently requested by the UI (defined in scene.cpp).
+BVHBuildSettings currentBVHSettings();
+
+// One node of the flattened tree. Nodes are stored depth first, so the left
+// child of an interior node is always the next node in the array and only
+// the right child needs an index. Leaves point at a contiguous run of
+// primitives in BVH::geoObjects, which is reordered to match the tree.
+struct LinearBVHNode
+{
+    glm::dvec3 boundsMin;
+    glm::dvec3 boundsMax;
+    union {
+        int primOffset; // leaf: first primitive
+        int rightChild; // interior: index of the second child
+    };
+    uint16_t primCount; // 0 for interior nodes
+    uint8_t axis;       // split axis
+    uint8_t pad;
+
+    bool isLeaf() const { return primCount > 0; }
+};
+
+// A node of the wide (4 or 8 way) tree, made by collapsing the binary one.
+// Child boxes are stored structure-of-arrays for the kernels in bvhsimd.h;
+// unused slots get an inverted box that no ray enters. A child with
+// count > 0 is a leaf holding count primitives from index; otherwise index
+// is the child's node.
+template <int W>
+struct alignas(32) WideBVHNode
 {
-    BoundingBox nodeBounds;
-    BVHNode* left, *right;
-    bool isLeaf = false;
-    int indirIdx;
-    int amt;
+    double bounds[2][3][W]; // [min/max][axis][child]
+    int index[W];
+    uint16_t count[W];
 };
 
-struct IndirectGeo
+// Per-primitive data that only lives while the tree is being built.
+struct BVHBuildPrim
 {
-    BoundingBox nodeBounds;
+    BoundingBox bounds;
+    glm::dvec3 centroid;
     int geoIdx;
+    uint64_t morton; // LBVH only
+};
+
+// What building a tree took and how good it came out. sahCost is the
+// expected cost of a ray that hits the root, in the units of the build
+// settings' traversalCost and leafCost, so lower is a better tree.
+struct BVHBuildInfo
+{
+    int prims = 0;
+    int references = 0; // more than prims once spatial splits duplicate some
+    int nodes = 0;
+    int depth = 0;
+    double seconds = 0.0;
+    double sahCost = 0.0;
 };
 
 template <typename objType>
 class BVH {
 
-    BVHNode* root;
-    vector<BVHNode*> garbageCollector;
-    vector<IndirectGeo*> allNodes;
+    vector<LinearBVHNode> nodes;
     vector<objType*> geoObjects;
+    vector<BVHBuildPrim> buildPrims;
+    BVHBuildSettings settings;
+    int treeDepth = 0;
+    BVHBuildInfo info;
 
-public:
-    void makeBVH(BVHNode* curr, int beginIdx, int amt){
-        int endIdx = beginIdx + amt - 1;
-        //Create bounding box
-        for(int k = beginIdx; k <= endIdx; k++){
-            curr->nodeBounds.merge(allNodes[k]->nodeBounds);
+    //The wide tree, if settings.width asks for one; the binary nodes stay
+    //for the packet traversals
+    vector<WideBVHNode<4>> wide4;
+    vector<WideBVHNode<8>> wide8;
+    int wideDepth = 0;
+    WideBoxTest boxTest = nullptr;
+
+    //Leaves can't hold more than primCount can count
+    static const int maxPrimsInNode = UINT16_MAX;
+
+    static double surfaceArea(const BoundingBox &b){
+        glm::dvec3 d = b.getMax() - b.getMin();
+        return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+    }
+
+    //Bounds of prims[beginIdx, endIdx) and of their centroids
+    static void rangeBounds(const vector<BVHBuildPrim> &prims, int beginIdx, int endIdx,
+                            BoundingBox &bounds, BoundingBox &centroidBounds){
+        for(int k = beginIdx; k < endIdx; k++){
+            const glm::dvec3 &c = prims[k].centroid;
+            bounds.merge(prims[k].bounds);
+            centroidBounds.merge(BoundingBox(c, c));
         }
-        curr->indirIdx = beginIdx;
-        curr->amt = amt;
-        //Terminate early if <= 2
-        if(curr->amt <= 2){
-            curr->isLeaf = true;
+    }
+
+    //The same, split into chunks across the pool. Merging boxes is exact,
+    //so this finds the very same bounds as the serial loop.
+    void rangeBounds(int beginIdx, int endIdx, BoundingBox &bounds, BoundingBox &centroidBounds, ThreadPool *pool) const {
+        int chunks = buildChunks(endIdx - beginIdx, pool);
+        if(chunks == 1){
+            rangeBounds(buildPrims, beginIdx, endIdx, bounds, centroidBounds);
             return;
         }
+        vector<BoundingBox> partBounds(chunks), partCentroids(chunks);
+        pool->parallelFor(0, chunks, [&](int c){
+            rangeBounds(buildPrims, chunkBegin(beginIdx, endIdx, chunks, c),
+                        chunkBegin(beginIdx, endIdx, chunks, c + 1), partBounds[c], partCentroids[c]);
+        });
+        for(int c = 0; c < chunks; c++){
+            bounds.merge(partBounds[c]);
+            centroidBounds.merge(partCentroids[c]);
+        }
+    }
+
+    //Sorts prims[beginIdx, endIdx) into nBins buckets along each axis of
+    //centroidBounds. Bucket b of axis a is binBounds/binCounts[a * nBins + b].
+    static void binRange(const vector<BVHBuildPrim> &prims, int beginIdx, int endIdx,
+                         const BoundingBox &centroidBounds, int nBins, BoundingBox *binBounds, int *binCounts){
+        glm::dvec3 lo = centroidBounds.getMin();
+        glm::dvec3 extent = centroidBounds.getMax() - lo;
+        for(int axis = 0; axis < 3; axis++){
+            if(extent[axis] <= 0){
+                continue;
+            }
+            double scale = nBins / extent[axis];
+            BoundingBox *bounds = binBounds + axis * nBins;
+            int *counts = binCounts + axis * nBins;
+            for(int k = beginIdx; k < endIdx; k++){
+                int b = std::min(nBins - 1, (int)((prims[k].centroid[axis] - lo[axis]) * scale));
+                counts[b]++;
+                bounds[b].merge(prims[k].bounds);
+            }
+        }
+    }
+
+    //A candidate split and what the SAH says it costs
+    struct SplitChoice
+    {
+        double cost = DBL_MAX;
+        int axis = -1;
+        int bin = -1;
+        BoundingBox left;
+        BoundingBox right;
+    };
+
+    //Binned SAH: bucket the centroids of prims[beginIdx, beginIdx + amt)
+    //along each axis and find the bucket boundary with the lowest expected
+    //cost. With a pool, big ranges are bucketed in chunks that are merged
+    //afterwards, which picks the same split. axis is -1 if no boundary
+    //separates the centroids.
+    SplitChoice bestObjectSplit(const vector<BVHBuildPrim> &prims, const BoundingBox &nodeBounds,
+                                const BoundingBox &centroidBounds, int beginIdx, int amt, ThreadPool *pool) const {
+        int endIdx = beginIdx + amt;
+        glm::dvec3 extent = centroidBounds.getMax() - centroidBounds.getMin();
+
+        int nBins = std::max(2, settings.bins);
+        vector<BoundingBox> binBounds(3 * nBins);
+        vector<int> binCounts(3 * nBins);
+        int chunks = buildChunks(amt, pool);
+        if(chunks == 1){
+            binRange(prims, beginIdx, endIdx, centroidBounds, nBins, binBounds.data(), binCounts.data());
+        }
+        else{
+            vector<BoundingBox> partBounds(chunks * 3 * nBins);
+            vector<int> partCounts(chunks * 3 * nBins);
+            pool->parallelFor(0, chunks, [&](int c){
+                binRange(prims, chunkBegin(beginIdx, endIdx, chunks, c), chunkBegin(beginIdx, endIdx, chunks, c + 1),
+                         centroidBounds, nBins, &partBounds[c * 3 * nBins], &partCounts[c * 3 * nBins]);
+            });
+            for(int c = 0; c < chunks; c++){
+                for(int b = 0; b < 3 * nBins; b++){
+                    binBounds[b].merge(partBounds[c * 3 * nBins + b]);
+                    binCounts[b] += partCounts[c * 3 * nBins + b];
+                }
+            }
+        }
+
+        SplitChoice best;
+        double parentArea = surfaceArea(nodeBounds);
+        for(int axis = 0; axis < 3; axis++){
+            if(extent[axis] <= 0){
+                continue;
+            }
+            sweepSAH(&binBounds[axis * nBins], &binCounts[axis * nBins], &binCounts[axis * nBins],
+                     nBins, axis, parentArea, best);
+        }
+        return best;
+    }
+
+    //Tries every boundary between the nBins buckets of one axis, keeping the
+    //cheapest in best. A primitive counts on the left of the boundaries
+    //after the bucket it enters (entries) and on the right of those before
+    //the one it leaves (exits); for object splits the two are the same.
+    void sweepSAH(const BoundingBox *bounds, const int *entries, const int *exits, int nBins, int axis,
+                  double parentArea, SplitChoice &best) const {
+        //Sweep from the right to get the cost of everything past each boundary
+        vector<BoundingBox> rightBounds(nBins);
+        vector<int> rightCount(nBins);
+        BoundingBox acc;
+        int count = 0;
+        for(int b = nBins - 1; b > 0; b--){
+            acc.merge(bounds[b]);
+            count += exits[b];
+            rightBounds[b] = acc;
+            rightCount[b] = count;
+        }
+        //Then from the left, splitting between bin b - 1 and bin b
+        acc = BoundingBox();
+        count = 0;
+        for(int b = 1; b < nBins; b++){
+            acc.merge(bounds[b - 1]);
+            count += entries[b - 1];
+            if(count == 0 || rightCount[b] == 0){
+                continue;
+            }
+            double cost = settings.traversalCost + settings.leafCost *
+                    (count * surfaceArea(acc) + rightCount[b] * surfaceArea(rightBounds[b])) / parentArea;
+            if(cost < best.cost){
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.left = acc;
+                best.right = rightBounds[b];
+            }
+        }
+    }
+
+    //Moves the primitives left of an object split to the front of the range
+    //and returns where the right side starts
+    int partitionObjects(vector<BVHBuildPrim> &prims, const BoundingBox &centroidBounds, int beginIdx, int amt,
+                         const SplitChoice &choice) const {
+        int nBins = std::max(2, settings.bins);
+        int axis = choice.axis;
+        double lo = centroidBounds.getMin()[axis];
+        double scale = nBins / (centroidBounds.getMax()[axis] - lo);
+        auto mid = std::partition(prims.begin() + beginIdx, prims.begin() + beginIdx + amt,
+                                  [&](const BVHBuildPrim &p){
+            return std::min(nBins - 1, (int)((p.centroid[axis] - lo) * scale)) < choice.bin;
+        });
+        return (int)(mid - prims.begin());
+    }
+
+    //Returns the partition point of the best binned SAH split, or -1 if
+    //making a leaf is cheaper.
+    int splitSAH(const BoundingBox &nodeBounds, const BoundingBox &centroidBounds, int beginIdx, int amt,
+                 int &splitAxis, ThreadPool *pool){
+        SplitChoice best = bestObjectSplit(buildPrims, nodeBounds, centroidBounds, beginIdx, amt, pool);
+        if(best.axis == -1){
+            //Every centroid is in the same spot, no bucket boundary separates them.
+            //Oversized nodes still get split down the middle of the range.
+            return amt > settings.maxLeafSize ? beginIdx + amt / 2 : -1;
+        }
+        if(amt <= settings.maxLeafSize && best.cost >= settings.leafCost * amt){
+            return -1;
+        }
+        splitAxis = best.axis;
+        return partitionObjects(buildPrims, centroidBounds, beginIdx, amt, best);
+    }
+
+    //Original builder: split the longest axis at its spatial midpoint.
+    int splitMidpoint(const BoundingBox &nodeBounds, int beginIdx, int amt, int &splitAxis){
+        int endIdx = beginIdx + amt - 1;
+        //Terminate early if <= 2
+        if(amt <= 2){
+            return -1;
+        }
 
         //Find longest axis
-        glm::dvec3 lengths = curr->nodeBounds.getMax() - curr->nodeBounds.getMin();
+        glm::dvec3 lengths = nodeBounds.getMax() - nodeBounds.getMin();
         //Sanity check
         assert(glm::abs(lengths) == lengths);
         int axis = 0;
@@ -62,129 +331,1310 @@ public:
         if(lengths[2] > lengths[axis]){
             axis = 2;
         }
+        splitAxis = axis;
         //Quickly Sort among current group by axis (half and half)
-        double half = lengths[axis] / 2 + curr->nodeBounds.getMin()[axis];
+        double half = lengths[axis] / 2 + nodeBounds.getMin()[axis];
         int i = beginIdx;
         int j = endIdx;
         while(i <= j){
-            double midPoint = (allNodes[i]->nodeBounds.getMin()[axis] + allNodes[i]->nodeBounds.getMax()[axis]) / 2;
-            if(midPoint >= half){
-                auto temp = allNodes[i];
-                allNodes[i] = allNodes[j];
-                allNodes[j] = temp;
+            if(buildPrims[i].centroid[axis] >= half){
+                std::swap(buildPrims[i], buildPrims[j]);
                 j--;
             }
             else{
                 i++;
             }
         }
-        //Sanity Check
-        for(int k = beginIdx; k <= endIdx; k++){
-            double midPoint = (allNodes[k]->nodeBounds.getMin()[axis] + allNodes[k]->nodeBounds.getMax()[axis]) / 2;
-            if(k < i){
-                assert(midPoint < half);
+        int leftCount = i - beginIdx;
+        //if empty box on left or right, we should just make it a leaf.
+        if(leftCount == 0 || leftCount == amt){
+            return -1;
+        }
+        return i;
+    }
+
+    //Spreads the bits of a 21 bit integer out to every third bit
+    static uint64_t expandBits(uint64_t v){
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffULL;
+        v = (v | v << 16) & 0x1f0000ff0000ffULL;
+        v = (v | v << 8) & 0x100f00f00f00f00fULL;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+        v = (v | v << 2) & 0x1249249249249249ULL;
+        return v;
+    }
+
+    //LBVH: the primitives are sorted along a Morton curve through their
+    //centroids, so every node is a run of them whose codes share a prefix.
+    //It splits where the first bit after that prefix flips, which is a
+    //binary search and no SAH at all.
+    int splitMorton(int beginIdx, int amt, int &splitAxis){
+        int endIdx = beginIdx + amt;
+        uint64_t first = buildPrims[beginIdx].morton;
+        uint64_t last = buildPrims[endIdx - 1].morton;
+        if(amt <= settings.maxLeafSize){
+            return -1;
+        }
+        if(first == last){
+            //Centroids too close to tell apart
+            return beginIdx + amt / 2;
+        }
+        int bit = 63;
+        while(!((first ^ last) >> bit & 1)){
+            bit--;
+        }
+        //Bits are interleaved x, y, z from the top of each triple down
+        splitAxis = 2 - bit % 3;
+        auto mid = std::partition_point(buildPrims.begin() + beginIdx, buildPrims.begin() + endIdx,
+                                        [bit](const BVHBuildPrim &p){ return !(p.morton >> bit & 1); });
+        return (int)(mid - buildPrims.begin());
+    }
+
+    //Gives every primitive its Morton code and sorts them by it: chunks are
+    //sorted across the pool, then merged pairwise.
+    void sortMorton(ThreadPool *pool){
+        int n = (int)buildPrims.size();
+        BoundingBox bounds, centroidBounds;
+        rangeBounds(0, n, bounds, centroidBounds, pool);
+        glm::dvec3 lo = centroidBounds.getMin();
+        glm::dvec3 extent = centroidBounds.getMax() - lo;
+        const double cells = (1 << 21) - 1;
+        auto code = [&](int begin, int end){
+            for(int k = begin; k < end; k++){
+                uint64_t morton = 0;
+                for(int axis = 0; axis < 3; axis++){
+                    double t = extent[axis] > 0 ? (buildPrims[k].centroid[axis] - lo[axis]) / extent[axis] : 0.0;
+                    morton |= expandBits((uint64_t)(t * cells)) << (2 - axis);
+                }
+                buildPrims[k].morton = morton;
+            }
+        };
+        auto before = [](const BVHBuildPrim &a, const BVHBuildPrim &b){ return a.morton < b.morton; };
+
+        int chunks = buildChunks(n, pool);
+        if(chunks == 1){
+            code(0, n);
+            std::sort(buildPrims.begin(), buildPrims.end(), before);
+            return;
+        }
+        pool->parallelFor(0, chunks, [&](int c){
+            int begin = chunkBegin(0, n, chunks, c);
+            int end = chunkBegin(0, n, chunks, c + 1);
+            code(begin, end);
+            std::sort(buildPrims.begin() + begin, buildPrims.begin() + end, before);
+        });
+        for(int width = 1; width < chunks; width *= 2){
+            int pairs = (chunks + 2 * width - 1) / (2 * width);
+            pool->parallelFor(0, pairs, [&](int p){
+                int begin = chunkBegin(0, n, chunks, 2 * p * width);
+                int mid = chunkBegin(0, n, chunks, std::min(chunks, (2 * p + 1) * width));
+                int end = chunkBegin(0, n, chunks, std::min(chunks, (2 * p + 2) * width));
+                std::inplace_merge(buildPrims.begin() + begin, buildPrims.begin() + mid,
+                                   buildPrims.begin() + end, before);
+            });
+        }
+    }
+
+    //Where to split the node over buildPrims[beginIdx, beginIdx + amt), with
+    //whichever builder the settings ask for. -1 makes a leaf.
+    int split(const BoundingBox &nodeBounds, const BoundingBox &centroidBounds, int beginIdx, int amt,
+              int &splitAxis, ThreadPool *pool){
+        int i = -1;
+        if(amt > 1){
+            if(settings.builder == "lbvh"){
+                i = splitMorton(beginIdx, amt, splitAxis);
             }
             else{
-                assert(midPoint >= half);
+#if BVH_USE_SAH
+                i = splitSAH(nodeBounds, centroidBounds, beginIdx, amt, splitAxis, pool);
+#else
+                i = splitMidpoint(nodeBounds, beginIdx, amt, splitAxis);
+#endif
             }
         }
-        //Create child nodes for each half
-        BVHNode* left;
-        BVHNode* right;
-        left = new BVHNode();
-        int leftCount = i - beginIdx;
-        //if empty box on left or right, we should just make it a leaf.
-        if(leftCount == 0 || leftCount == amt){
-            curr->isLeaf = true;
+        if(i < 0 && amt > maxPrimsInNode){
+            i = beginIdx + amt / 2;
+        }
+        return i;
+    }
+
+    //Builds the subtree over buildPrims[beginIdx, beginIdx + amt) straight into
+    //out in depth first order, and returns the index of its root.
+    int makeBVH(vector<LinearBVHNode> &out, int beginIdx, int amt, int depth, int &maxDepth){
+        int idx = (int)out.size();
+        out.emplace_back();
+        maxDepth = std::max(maxDepth, depth);
+
+        //Create bounding box
+        BoundingBox nodeBounds, centroidBounds;
+        rangeBounds(buildPrims, beginIdx, beginIdx + amt, nodeBounds, centroidBounds);
+        if(amt > 0){
+            out[idx].boundsMin = nodeBounds.getMin();
+            out[idx].boundsMax = nodeBounds.getMax();
+        }
+
+        int axis = 0;
+        int i = split(nodeBounds, centroidBounds, beginIdx, amt, axis, nullptr);
+        if(i < 0){
+            out[idx].primOffset = beginIdx;
+            out[idx].primCount = (uint16_t)amt;
+            out[idx].axis = 0;
+            return idx;
+        }
+
+        //Create child nodes for each half. The left child lands at idx + 1.
+        makeBVH(out, beginIdx, i - beginIdx, depth + 1, maxDepth);
+        int right = makeBVH(out, i, beginIdx + amt - i, depth + 1, maxDepth);
+        out[idx].rightChild = right;
+        out[idx].primCount = 0;
+        out[idx].axis = (uint8_t)axis;
+        return idx;
+    }
+
+    //Chunks to split n primitives' worth of build work into: one if it
+    //isn't worth sharing out
+    static int buildChunks(int n, ThreadPool *pool){
+        const int minChunk = 4096;
+        if(pool == nullptr || pool->size() == 1 || n < 2 * minChunk){
+            return 1;
+        }
+        return std::min(4 * pool->size(), n / minChunk);
+    }
+
+    static int chunkBegin(int beginIdx, int endIdx, int chunks, int c){
+        return beginIdx + (int)((int64_t)(endIdx - beginIdx) * c / chunks);
+    }
+
+    //The top of a parallel build, before it's laid out depth first: a node
+    //split on the calling thread, or a subtree left to a pool task.
+    struct UpperNode
+    {
+        BoundingBox bounds;
+        int axis = 0;
+        int left = -1;
+        int right = -1;
+        int subtree = -1;
+    };
+
+    struct Subtree
+    {
+        int beginIdx;
+        int amt;
+        int depth;
+        vector<LinearBVHNode> nodes;
+        int maxDepth = 0;
+    };
+
+    //Splits nodes with more than subtreeSize primitives, binning them across
+    //the pool, and queues everything below as subtrees.
+    int makeUpper(vector<UpperNode> &upper, vector<Subtree> &subtrees, int beginIdx, int amt, int depth,
+                  int subtreeSize, ThreadPool *pool){
+        int idx = (int)upper.size();
+        upper.emplace_back();
+        BoundingBox nodeBounds, centroidBounds;
+        int i = -1;
+        int axis = 0;
+        if(amt > subtreeSize){
+            rangeBounds(beginIdx, beginIdx + amt, nodeBounds, centroidBounds, pool);
+            i = split(nodeBounds, centroidBounds, beginIdx, amt, axis, pool);
+        }
+        if(i < 0){
+            upper[idx].subtree = (int)subtrees.size();
+            subtrees.push_back(Subtree{beginIdx, amt, depth, {}, 0});
+            return idx;
+        }
+        upper[idx].bounds = nodeBounds;
+        upper[idx].axis = axis;
+        int left = makeUpper(upper, subtrees, beginIdx, i - beginIdx, depth + 1, subtreeSize, pool);
+        int right = makeUpper(upper, subtrees, i, beginIdx + amt - i, depth + 1, subtreeSize, pool);
+        upper[idx].left = left;
+        upper[idx].right = right;
+        return idx;
+    }
+
+    //Lays the upper nodes and the finished subtrees out depth first in nodes
+    void flatten(const vector<UpperNode> &upper, vector<Subtree> &subtrees, int u){
+        int idx = (int)nodes.size();
+        if(upper[u].subtree >= 0){
+            const Subtree &sub = subtrees[upper[u].subtree];
+            for(LinearBVHNode node : sub.nodes){
+                if(!node.isLeaf()){
+                    node.rightChild += idx;
+                }
+                nodes.push_back(node);
+            }
+            treeDepth = std::max(treeDepth, sub.maxDepth);
             return;
         }
-        int rightCount = amt - leftCount;
-        makeBVH(left, beginIdx, leftCount);
-        //Same thing here
-        right = new BVHNode();
-        makeBVH(right, i, rightCount);
-        curr->left = left;
-        curr->right = right;
-        garbageCollector.push_back(left);
-        garbageCollector.push_back(right);
+        nodes.emplace_back();
+        nodes[idx].boundsMin = upper[u].bounds.getMin();
+        nodes[idx].boundsMax = upper[u].bounds.getMax();
+        nodes[idx].primCount = 0;
+        nodes[idx].axis = (uint8_t)upper[u].axis;
+        flatten(upper, subtrees, upper[u].left);
+        int right = (int)nodes.size();
+        flatten(upper, subtrees, upper[u].right);
+        nodes[idx].rightChild = right;
+    }
+
+    //The top levels are split on this thread with the binning spread over
+    //the pool; the subtrees under them are then built as pool tasks. Builds
+    //the same tree as the serial makeBVH.
+    void makeBVHParallel(ThreadPool *pool){
+        int n = (int)buildPrims.size();
+        int subtreeSize = std::max(1024, n / (8 * pool->size()));
+        vector<UpperNode> upper;
+        vector<Subtree> subtrees;
+        makeUpper(upper, subtrees, 0, n, 1, subtreeSize, pool);
+        //Biggest first, so a large one doesn't start last
+        vector<int> order(subtrees.size());
+        for(int k = 0; k < (int)order.size(); k++){
+            order[k] = k;
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b){ return subtrees[a].amt > subtrees[b].amt; });
+        pool->parallelFor(0, (int)subtrees.size(), [&](int k){
+            Subtree &sub = subtrees[order[k]];
+            sub.nodes.reserve(2 * sub.amt);
+            makeBVH(sub.nodes, sub.beginIdx, sub.amt, sub.depth, sub.maxDepth);
+        });
+        flatten(upper, subtrees, 0);
+    }
+
+    //Primitives that can tell which part of them lies on either side of a
+    //plane (triangles) give the SBVH tight boxes for split references;
+    //anything else has its box cut at the plane instead.
+    template <typename T, typename = void>
+    struct CanClip : std::false_type {};
+    template <typename T>
+    struct CanClip<T, std::void_t<decltype(std::declval<const T &>().clipBounds(
+            0, 0.0, std::declval<BoundingBox &>(), std::declval<BoundingBox &>()))>> : std::true_type {};
+
+    //Splits the reference ref of obj at axis = pos into the parts on either
+    //side. Either part comes back empty if nothing of obj is there.
+    static void splitReference(const objType *obj, const BoundingBox &ref, int axis, double pos,
+                               BoundingBox &left, BoundingBox &right){
+        glm::dvec3 lo = ref.getMin();
+        glm::dvec3 hi = ref.getMax();
+        if constexpr (CanClip<objType>::value){
+            BoundingBox clipLeft, clipRight;
+            obj->clipBounds(axis, pos, clipLeft, clipRight);
+            left = clipLeft.getMin()[axis] <= clipLeft.getMax()[axis] ? overlap(clipLeft, ref) : BoundingBox();
+            right = clipRight.getMin()[axis] <= clipRight.getMax()[axis] ? overlap(clipRight, ref) : BoundingBox();
+        }
+        else{
+            glm::dvec3 mid = hi;
+            mid[axis] = pos;
+            left = BoundingBox(lo, mid);
+            mid = lo;
+            mid[axis] = pos;
+            right = BoundingBox(mid, hi);
+        }
+        //Whatever the clipping did, the parts stay on their own sides
+        if(!left.isEmpty()){
+            left.setMax(axis, std::min(left.getMax()[axis], pos));
+        }
+        if(!right.isEmpty()){
+            right.setMin(axis, std::max(right.getMin()[axis], pos));
+        }
+    }
+
+    //The intersection of two boxes, or an empty box
+    static BoundingBox overlap(const BoundingBox &a, const BoundingBox &b){
+        glm::dvec3 lo = glm::max(a.getMin(), b.getMin());
+        glm::dvec3 hi = glm::min(a.getMax(), b.getMax());
+        if(lo[0] > hi[0] || lo[1] > hi[1] || lo[2] > hi[2]){
+            return BoundingBox();
+        }
+        return BoundingBox(lo, hi);
+    }
+
+    static BVHBuildPrim makeReference(const BoundingBox &bounds, int geoIdx){
+        BVHBuildPrim ref;
+        ref.bounds = bounds;
+        ref.centroid = (bounds.getMin() + bounds.getMax()) / 2.0;
+        ref.geoIdx = geoIdx;
+        ref.morton = 0;
+        return ref;
+    }
+
+    //The SBVH's other option: cut space at a bucket boundary along an axis of
+    //nodeBounds, splitting every reference that straddles it. A reference
+    //enters the bucket holding its minimum and exits the one holding its
+    //maximum; the buckets in between get its clipped pieces.
+    SplitChoice bestSpatialSplit(const vector<BVHBuildPrim> &refs, const BoundingBox &nodeBounds,
+                                 const vector<objType*> &objects) const {
+        int nBins = std::max(2, settings.bins);
+        vector<BoundingBox> binBounds(nBins);
+        vector<int> entries(nBins), exits(nBins);
+        glm::dvec3 lo = nodeBounds.getMin();
+        glm::dvec3 extent = nodeBounds.getMax() - lo;
+        double parentArea = surfaceArea(nodeBounds);
+        SplitChoice best;
+        for(int axis = 0; axis < 3; axis++){
+            if(extent[axis] <= 0){
+                continue;
+            }
+            double binWidth = extent[axis] / nBins;
+            auto binOf = [&](double x){
+                return std::max(0, std::min(nBins - 1, (int)((x - lo[axis]) / binWidth)));
+            };
+            std::fill(binBounds.begin(), binBounds.end(), BoundingBox());
+            std::fill(entries.begin(), entries.end(), 0);
+            std::fill(exits.begin(), exits.end(), 0);
+            for(const BVHBuildPrim &ref : refs){
+                int first = binOf(ref.bounds.getMin()[axis]);
+                int last = binOf(ref.bounds.getMax()[axis]);
+                entries[first]++;
+                exits[last]++;
+                BoundingBox rest = ref.bounds;
+                for(int b = first; b < last && !rest.isEmpty(); b++){
+                    BoundingBox piece;
+                    splitReference(objects[ref.geoIdx], rest, axis, lo[axis] + (b + 1) * binWidth, piece, rest);
+                    binBounds[b].merge(piece);
+                }
+                binBounds[last].merge(rest);
+            }
+            sweepSAH(binBounds.data(), entries.data(), exits.data(), nBins, axis, parentArea, best);
+        }
+        return best;
+    }
+
+    //Splits refs at a spatial split into left and right. A straddling
+    //reference is only split if that's cheaper, by the SAH, than moving it
+    //whole to one side ("reference unsplitting").
+    void partitionSpatial(const vector<BVHBuildPrim> &refs, const BoundingBox &nodeBounds, const SplitChoice &choice,
+                          const vector<objType*> &objects, vector<BVHBuildPrim> &left, vector<BVHBuildPrim> &right) const {
+        int nBins = std::max(2, settings.bins);
+        int axis = choice.axis;
+        double lo = nodeBounds.getMin()[axis];
+        double pos = lo + choice.bin * (nodeBounds.getMax()[axis] - lo) / nBins;
+        BoundingBox leftBounds, rightBounds;
+        vector<int> straddling;
+        for(int k = 0; k < (int)refs.size(); k++){
+            if(refs[k].bounds.getMax()[axis] <= pos){
+                left.push_back(refs[k]);
+                leftBounds.merge(refs[k].bounds);
+            }
+            else if(refs[k].bounds.getMin()[axis] >= pos){
+                right.push_back(refs[k]);
+                rightBounds.merge(refs[k].bounds);
+            }
+            else{
+                straddling.push_back(k);
+            }
+        }
+        double nLeft = (double)(left.size() + straddling.size());
+        double nRight = (double)(right.size() + straddling.size());
+        for(int k : straddling){
+            const BVHBuildPrim &ref = refs[k];
+            BoundingBox leftPart, rightPart;
+            splitReference(objects[ref.geoIdx], ref.bounds, axis, pos, leftPart, rightPart);
+            if(leftPart.isEmpty() || rightPart.isEmpty()){
+                //Only the box straddled the plane
+                bool goesLeft = !leftPart.isEmpty();
+                (goesLeft ? left : right).push_back(makeReference(goesLeft ? leftPart : rightPart, ref.geoIdx));
+                (goesLeft ? leftBounds : rightBounds).merge(goesLeft ? leftPart : rightPart);
+                (goesLeft ? nRight : nLeft) -= 1;
+                continue;
+            }
+            BoundingBox splitLeft = leftBounds, splitRight = rightBounds;
+            splitLeft.merge(leftPart);
+            splitRight.merge(rightPart);
+            BoundingBox wholeLeft = leftBounds, wholeRight = rightBounds;
+            wholeLeft.merge(ref.bounds);
+            wholeRight.merge(ref.bounds);
+            double splitCost = surfaceArea(splitLeft) * nLeft + surfaceArea(splitRight) * nRight;
+            double leftCost = surfaceArea(wholeLeft) * nLeft + surfaceArea(rightBounds.isEmpty() ? splitRight : rightBounds) * (nRight - 1);
+            double rightCost = surfaceArea(leftBounds.isEmpty() ? splitLeft : leftBounds) * (nLeft - 1) + surfaceArea(wholeRight) * nRight;
+            if(leftCost < splitCost && leftCost <= rightCost){
+                left.push_back(ref);
+                leftBounds = wholeLeft;
+                nRight -= 1;
+            }
+            else if(rightCost < splitCost){
+                right.push_back(ref);
+                rightBounds = wholeRight;
+                nLeft -= 1;
+            }
+            else{
+                left.push_back(makeReference(leftPart, ref.geoIdx));
+                right.push_back(makeReference(rightPart, ref.geoIdx));
+                leftBounds = splitLeft;
+                rightBounds = splitRight;
+            }
+        }
     }
 
-    BVH(vector<objType*> geometryObjects){
-        geoObjects = geometryObjects;
-        for(int i = 0; i < geometryObjects.size(); i++){
+    //Builds the SBVH subtree over refs into nodes, appending the references
+    //of its leaves to leafRefs in order. Each node weighs the best object
+    //split against the best spatial one, but only looks for the latter when
+    //the object split's children overlap by more than splitOverlap of the
+    //root's surface area, which keeps the duplication in check.
+    int makeSBVH(vector<BVHBuildPrim> &refs, int depth, double rootArea, const vector<objType*> &objects,
+                 vector<BVHBuildPrim> &leafRefs){
+        int idx = (int)nodes.size();
+        nodes.emplace_back();
+        treeDepth = std::max(treeDepth, depth);
+        int amt = (int)refs.size();
+
+        BoundingBox nodeBounds, centroidBounds;
+        rangeBounds(refs, 0, amt, nodeBounds, centroidBounds);
+        if(amt > 0){
+            nodes[idx].boundsMin = nodeBounds.getMin();
+            nodes[idx].boundsMax = nodeBounds.getMax();
+        }
+
+        SplitChoice object, spatial;
+        if(amt > 1){
+            object = bestObjectSplit(refs, nodeBounds, centroidBounds, 0, amt, nullptr);
+            //Past this depth boxes are small enough that spatial splits
+            //mostly just duplicate
+            const int maxSpatialDepth = 48;
+            double overlapArea = object.axis >= 0 ? surfaceArea(overlap(object.left, object.right)) : DBL_MAX;
+            if(overlapArea > settings.splitOverlap * rootArea && depth < maxSpatialDepth){
+                spatial = bestSpatialSplit(refs, nodeBounds, objects);
+            }
+        }
+        bool useSpatial = spatial.axis >= 0 && spatial.cost < object.cost;
+        double bestCost = std::min(object.cost, spatial.cost);
+        bool leaf = amt <= 1 || (amt <= settings.maxLeafSize && bestCost >= settings.leafCost * amt);
+
+        vector<BVHBuildPrim> left, right;
+        int axis = 0;
+        if(!leaf && useSpatial){
+            partitionSpatial(refs, nodeBounds, spatial, objects, left, right);
+            axis = spatial.axis;
+            if(left.empty() || right.empty()){
+                left.clear();
+                right.clear();
+                useSpatial = false;
+            }
+        }
+        if(!leaf && !useSpatial){
+            //As in splitSAH, centroids in one spot are split down the middle
+            int mid = amt / 2;
+            if(object.axis >= 0){
+                mid = partitionObjects(refs, centroidBounds, 0, amt, object);
+                axis = object.axis;
+            }
+            left.assign(refs.begin(), refs.begin() + mid);
+            right.assign(refs.begin() + mid, refs.end());
+        }
+        if(leaf){
+            nodes[idx].primOffset = (int)leafRefs.size();
+            nodes[idx].primCount = (uint16_t)amt;
+            nodes[idx].axis = 0;
+            leafRefs.insert(leafRefs.end(), refs.begin(), refs.end());
+            return idx;
+        }
+
+        vector<BVHBuildPrim>().swap(refs);
+        makeSBVH(left, depth + 1, rootArea, objects, leafRefs);
+        int rightChild = makeSBVH(right, depth + 1, rootArea, objects, leafRefs);
+        nodes[idx].rightChild = rightChild;
+        nodes[idx].primCount = 0;
+        nodes[idx].axis = (uint8_t)axis;
+        return idx;
+    }
+
+    //Expected cost of a ray that hits the root, by the same measure the SAH
+    //builder minimises: interior nodes cost traversalCost and leaves
+    //leafCost per primitive, each weighted by its area over the root's.
+    double computeSAHCost() const {
+        if(nodes.empty()){
+            return 0.0;
+        }
+        double rootArea = surfaceArea(BoundingBox(nodes[0].boundsMin, nodes[0].boundsMax));
+        if(rootArea <= 0){
+            return 0.0;
+        }
+        double cost = 0.0;
+        for(const LinearBVHNode &node : nodes){
+            double area = surfaceArea(BoundingBox(node.boundsMin, node.boundsMax));
+            cost += area * (node.isLeaf() ? settings.leafCost * node.primCount : settings.traversalCost);
+        }
+        return cost / rootArea;
+    }
+
+    //Collapses the binary subtree under node into nodes of up to W children
+    //and returns the index of the one made for node. Interior children are
+    //opened up biggest surface first, as those are the likeliest to be
+    //visited.
+    template <int W>
+    int collapse(vector<WideBVHNode<W>> &wide, int node, int depth = 1){
+        int idx = (int)wide.size();
+        wide.emplace_back();
+        wideDepth = std::max(wideDepth, depth);
+
+        int children[W];
+        int n = 0;
+        if(nodes[node].isLeaf()){
+            children[n++] = node;
+        }
+        else{
+            children[n++] = node + 1;
+            children[n++] = nodes[node].rightChild;
+        }
+        while(n < W){
+            int best = -1;
+            double bestArea = -1.0;
+            for(int c = 0; c < n; c++){
+                const LinearBVHNode &child = nodes[children[c]];
+                if(child.isLeaf()){
+                    continue;
+                }
+                double area = surfaceArea(BoundingBox(child.boundsMin, child.boundsMax));
+                if(area > bestArea){
+                    bestArea = area;
+                    best = c;
+                }
+            }
+            if(best < 0){
+                break;
+            }
+            int open = children[best];
+            children[best] = open + 1;
+            children[n++] = nodes[open].rightChild;
+        }
+
+        const double inf = std::numeric_limits<double>::infinity();
+        for(int c = 0; c < W; c++){
+            for(int axis = 0; axis < 3; axis++){
+                wide[idx].bounds[0][axis][c] = c < n ? nodes[children[c]].boundsMin[axis] : inf;
+                wide[idx].bounds[1][axis][c] = c < n ? nodes[children[c]].boundsMax[axis] : -inf;
+            }
+            wide[idx].index[c] = -1;
+            wide[idx].count[c] = 0;
+            if(c >= n){
+                continue;
+            }
+            const LinearBVHNode &child = nodes[children[c]];
+            if(child.isLeaf()){
+                wide[idx].index[c] = child.primOffset;
+                wide[idx].count[c] = child.primCount;
+            }
+            else{
+                int sub = collapse(wide, children[c], depth + 1);
+                wide[idx].index[c] = sub;
+            }
+        }
+        return idx;
+    }
+
+    //(Re)makes the wide tree the settings ask for from the binary one
+    void collapseWide(){
+        wide4.clear();
+        wide8.clear();
+        wideDepth = 0;
+        if(geoObjects.empty()){
+            return;
+        }
+        if(settings.width == 4){
+            collapse(wide4, 0);
+        }
+        else if(settings.width == 8){
+            collapse(wide8, 0);
+        }
+    }
+
+public:
+    //Builds the tree over geometryObjects. With a pool, a big enough tree
+    //is built in parallel; the result is the same either way.
+    BVH(vector<objType*> geometryObjects, const BVHBuildSettings &buildSettings = BVHBuildSettings(),
+        ThreadPool *pool = nullptr)
+        : settings(buildSettings) {
+        auto start = std::chrono::steady_clock::now();
+        buildPrims.reserve(geometryObjects.size());
+        for(size_t i = 0; i < geometryObjects.size(); i++){
             if(geometryObjects[i]->hasBoundingBoxCapability()){
-                IndirectGeo* newGeo = new IndirectGeo();
-                newGeo->nodeBounds = geometryObjects[i]->getBoundingBox();
-                newGeo->geoIdx = i;
-                allNodes.push_back(newGeo);
+                BVHBuildPrim prim;
+                prim.bounds = geometryObjects[i]->getBoundingBox();
+                prim.centroid = (prim.bounds.getMin() + prim.bounds.getMax()) / 2.0;
+                prim.geoIdx = i;
+                buildPrims.push_back(prim);
             }
             else{
                 throw("Uh oh, can't create bounding box.");
             }
         }
-        root = new BVHNode();
-        garbageCollector.push_back(root);
-        makeBVH(root, 0, allNodes.size());
-//        cout << "SANITY CHECK" << endl;
-//        sanityCheck(root, 0);
-//        cout << "SANITY CHECK END" << endl;
-    }
-
-    ~BVH(){
-        for(auto i : garbageCollector){
-            delete i;
-        }
-        for(auto i : allNodes){
-            delete i;
-        }
-    }
-
-//    void sanityCheck(BVHNode* curr, int depth){
-//        if(curr == nullptr){
-//            return;
-//        }
-//        cout << "Depth is " << depth << endl;
-//        cout << "The bounding box for this node is:" << endl << curr->nodeBounds.getMin() << endl << curr->nodeBounds.getMax() << endl;
-//        if(curr->isLeaf){
-//            for(int j = 0; j < curr->amt; j++) {
-//                cout << allNodes[curr->indirIdx + j]->geoIdx << endl;
-//                cout << geoObjects[allNodes[curr->indirIdx + j]->geoIdx] << endl;
-//            }
-//        }
-//        cout <<"Moving left" << endl;
-//        sanityCheck(curr->left, depth + 1);
-//        cout << "Moving right" << endl;
-//        sanityCheck(curr->right, depth + 1);
-//    }
-
-    bool checkIntersect(BVHNode* curr, ray &r, isect &i) {
-        double trash  = 0;
-        double trash2 = 0;
-        if(!curr->nodeBounds.intersect(r, trash, trash2)){
-            //Terminate if doesn't intersect bounding box
+        if((int)buildPrims.size() < settings.parallelThreshold || (pool && pool->size() == 1)){
+            pool = nullptr;
+        }
+        int prims = (int)buildPrims.size();
+        nodes.reserve(2 * prims + 1);
+        if(settings.spatialSplits && prims > 0){
+            //The SBVH needs the references of each node in a list of their
+            //own, since splitting them changes their number, so it builds
+            //serially. buildPrims gets the leaves' references.
+            vector<BVHBuildPrim> refs;
+            refs.swap(buildPrims);
+            BoundingBox rootBounds, centroidBounds;
+            rangeBounds(refs, 0, prims, rootBounds, centroidBounds);
+            makeSBVH(refs, 1, surfaceArea(rootBounds), geometryObjects, buildPrims);
+        }
+        else{
+            if(settings.builder == "lbvh" && prims > 0){
+                sortMorton(pool);
+            }
+            if(pool && prims > 0){
+                makeBVHParallel(pool);
+            }
+            else{
+                makeBVH(nodes, 0, prims, 1, treeDepth);
+            }
+        }
+        nodes.shrink_to_fit();
+
+        //Reorder the primitives so each leaf covers a contiguous range.
+        geoObjects.resize(buildPrims.size());
+        for(size_t k = 0; k < buildPrims.size(); k++){
+            geoObjects[k] = geometryObjects[buildPrims[k].geoIdx];
+        }
+        vector<BVHBuildPrim>().swap(buildPrims);
+
+        boxTest = wideBoxTest(settings.simd);
+        collapseWide();
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        info.prims = prims;
+        info.references = (int)geoObjects.size();
+        info.nodes = (int)nodes.size();
+        info.depth = treeDepth;
+        info.seconds = elapsed.count();
+        info.sahCost = computeSAHCost();
+    }
+
+    //Restores a tree from the flatNodes() and primitives() of one built
+    //with the same settings, as saved by MeshCache. Only the wide tree is
+    //made again; builtInfo is what the original build reported.
+    BVH(vector<LinearBVHNode> flatNodes, vector<objType*> prims, const BVHBuildSettings &buildSettings,
+        const BVHBuildInfo &builtInfo)
+        : nodes(std::move(flatNodes)), geoObjects(std::move(prims)), settings(buildSettings), info(builtInfo) {
+        auto start = std::chrono::steady_clock::now();
+        treeDepth = info.depth;
+        boxTest = wideBoxTest(settings.simd);
+        collapseWide();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        info.seconds = elapsed.count();
+    }
+
+    const BVHBuildInfo &buildInfo() const { return info; }
+
+    //The binary tree and the primitives its leaves index, in leaf order
+    const vector<LinearBVHNode> &flatNodes() const { return nodes; }
+    const vector<objType*> &primitives() const { return geoObjects; }
+
+    //For primitives that have moved since the build: recomputes every box
+    //bottom-up from the primitives' current bounds, keeping the tree's
+    //shape, and collapses the wide tree again. Linear in the node count.
+    //Returns the refitted tree's SAH cost; compare it with
+    //buildInfo().sahCost to see how far the tree has degraded. Boxes clipped
+    //by spatial splits are refitted to whole primitives.
+    double refit(){
+        if(geoObjects.empty()){
+            return 0.0;
+        }
+        //Children always come after their parent
+        for(int idx = (int)nodes.size() - 1; idx >= 0; idx--){
+            LinearBVHNode &node = nodes[idx];
+            BoundingBox box;
+            if(node.isLeaf()){
+                for(int k = node.primOffset; k < node.primOffset + node.primCount; k++){
+                    box.merge(geoObjects[k]->getBoundingBox());
+                }
+            }
+            else{
+                box = BoundingBox(nodes[idx + 1].boundsMin, nodes[idx + 1].boundsMax);
+                box.merge(BoundingBox(nodes[node.rightChild].boundsMin, nodes[node.rightChild].boundsMax));
+            }
+            node.boundsMin = box.getMin();
+            node.boundsMax = box.getMax();
+        }
+        collapseWide();
+        return computeSAHCost();
+    }
+
+private:
+    //Ray data shared by every box test of one traversal.
+    struct TraversalRay
+    {
+        glm::dvec3 origin;
+        glm::dvec3 invDir;
+        int dirIsNeg[3];
+
+        TraversalRay(){}
+        TraversalRay(const ray &r){
+            origin = r.getPosition();
+            glm::dvec3 d = r.getDirection();
+            invDir = glm::dvec3(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]);
+            dirIsNeg[0] = invDir[0] < 0;
+            dirIsNeg[1] = invDir[1] < 0;
+            dirIsNeg[2] = invDir[2] < 0;
+        }
+    };
+
+    struct StackEntry
+    {
+        int node;
+        double tEntry;
+    };
+
+    //Slab test against a node using the precomputed reciprocal direction.
+    //Misses if the box is behind the ray or starts beyond tLimit.
+    static bool intersectNode(const LinearBVHNode &node, const TraversalRay &tr, double tLimit, double &tEntry){
+        double tMin = -DBL_MAX;
+        double tMax = DBL_MAX;
+        for(int axis = 0; axis < 3; axis++){
+            double nearSlab = tr.dirIsNeg[axis] ? node.boundsMax[axis] : node.boundsMin[axis];
+            double farSlab = tr.dirIsNeg[axis] ? node.boundsMin[axis] : node.boundsMax[axis];
+            double t0 = (nearSlab - tr.origin[axis]) * tr.invDir[axis];
+            double t1 = (farSlab - tr.origin[axis]) * tr.invDir[axis];
+            //Written so a NaN (ray parallel to and on a slab plane) is ignored
+            if(t0 > tMin){
+                tMin = t0;
+            }
+            if(t1 < tMax){
+                tMax = t1;
+            }
+        }
+        tEntry = tMin;
+        return tMin <= tMax && tMax >= RAY_EPSILON && tMin < tLimit;
+    }
+
+    //Iterative closest-hit traversal. Children are visited nearest first and
+    //anything that starts past the closest hit so far is skipped.
+    bool traverse(ray &r, isect &i){
+        TraversalRay tr(r);
+        StackEntry localStack[64];
+        vector<StackEntry> deepStack;
+        StackEntry* stack = localStack;
+        if(treeDepth >= 64){
+            deepStack.resize(treeDepth + 1);
+            stack = deepStack.data();
+        }
+        int sp = 0;
+        bool intersected = false;
+        //Counted locally and published once, so they vanish without RAY_STATS
+        uint64_t visits = 0, tests = 0, hits = 0;
+
+        double tEntry;
+        if(!intersectNode(nodes[0], tr, i.getT(), tEntry)){
             return false;
         }
-        if(curr->isLeaf){
-            bool intersected = false;
-            for(int j = 0; j < curr->amt; j++){
-                isect test;
-                bool check = geoObjects[allNodes[curr->indirIdx + j]->geoIdx]->intersect(r, test);
-                if(check && test.getT() < i.getT()){
-                    i = test;
+        int curr = 0;
+        while(true){
+            const LinearBVHNode &node = nodes[curr];
+            visits++;
+            if(node.isLeaf()){
+                for(int j = node.primOffset; j < node.primOffset + node.primCount; j++){
+                    isect test;
+                    tests++;
+                    if(geoObjects[j]->intersect(r, test) && test.getT() < i.getT()){
+                        i = std::move(test);
+                        intersected = true;
+                        hits++;
+                    }
+                }
+            }
+            else{
+                int left = curr + 1;
+                int right = node.rightChild;
+                double tLeft, tRight;
+                bool hitLeft = intersectNode(nodes[left], tr, i.getT(), tLeft);
+                bool hitRight = intersectNode(nodes[right], tr, i.getT(), tRight);
+                if(hitLeft && hitRight){
+                    //Go to the nearer child, come back to the other one later
+                    if(tRight < tLeft){
+                        std::swap(left, right);
+                        std::swap(tLeft, tRight);
+                    }
+                    stack[sp].node = right;
+                    stack[sp].tEntry = tRight;
+                    sp++;
+                    curr = left;
+                    continue;
+                }
+                if(hitLeft){
+                    curr = left;
+                    continue;
+                }
+                if(hitRight){
+                    curr = right;
+                    continue;
                 }
-                intersected |= check;
             }
-            return intersected;
+            //Pop the next node that could still hold a closer hit
+            bool found = false;
+            while(sp > 0){
+                sp--;
+                if(stack[sp].tEntry < i.getT()){
+                    curr = stack[sp].node;
+                    found = true;
+                    break;
+                }
+            }
+            if(!found){
+                break;
+            }
         }
-        else{
-            //Recurse
-            bool result = checkIntersect(curr->left, r, i);
-            result |= checkIntersect(curr->right, r, i);
-            return result;
+        RenderStats::add(RenderStats::NodeVisits, visits);
+        RenderStats::add(RenderStats::PrimitiveTests, tests);
+        RenderStats::add(RenderStats::PrimitiveHits, hits);
+        return intersected;
+    }
+
+    //Any-hit traversal for shadow rays. Order doesn't matter here, so children
+    //are pushed as they are found and the first blocker ends the search.
+    bool traverseOcclusion(ray &r, double tMax){
+        TraversalRay tr(r);
+        int localStack[64];
+        vector<int> deepStack;
+        int* stack = localStack;
+        if(treeDepth >= 64){
+            deepStack.resize(treeDepth + 1);
+            stack = deepStack.data();
+        }
+        int sp = 0;
+        uint64_t visits = 0, tests = 0;
+
+        double tEntry;
+        if(!intersectNode(nodes[0], tr, tMax, tEntry)){
+            return false;
         }
+        stack[sp++] = 0;
+        bool occluded = false;
+        while(sp > 0 && !occluded){
+            const LinearBVHNode &node = nodes[stack[--sp]];
+            visits++;
+            if(node.isLeaf()){
+                for(int j = node.primOffset; j < node.primOffset + node.primCount; j++){
+                    tests++;
+                    if(geoObjects[j]->occludes(r, tMax)){
+                        occluded = true;
+                        break;
+                    }
+                }
+                continue;
+            }
+            int left = (int)(&node - nodes.data()) + 1;
+            if(intersectNode(nodes[node.rightChild], tr, tMax, tEntry)){
+                stack[sp++] = node.rightChild;
+            }
+            if(intersectNode(nodes[left], tr, tMax, tEntry)){
+                stack[sp++] = left;
+            }
+        }
+        RenderStats::add(RenderStats::NodeVisits, visits);
+        RenderStats::add(RenderStats::PrimitiveTests, tests);
+        RenderStats::add(RenderStats::PrimitiveHits, occluded ? 1 : 0);
+        return occluded;
     }
+
+    static WideRay wideRay(const TraversalRay &tr){
+        WideRay wr;
+        for(int axis = 0; axis < 3; axis++){
+            wr.origin[axis] = tr.origin[axis];
+            wr.invDir[axis] = tr.invDir[axis];
+            wr.dirIsNeg[axis] = tr.dirIsNeg[axis];
+        }
+        return wr;
+    }
+
+    struct WideEntry
+    {
+        int index;
+        int count; //> 0 for a leaf
+        double tEntry;
+    };
+
+    //Closest-hit traversal of the wide tree. One kernel call tests every
+    //child of a node; the ones hit are pushed farthest first, so the nearest
+    //is popped next, and anything that starts past the closest hit so far
+    //is skipped when popped.
+    template <int W>
+    bool traverseWide(const vector<WideBVHNode<W>> &wide, ray &r, isect &i){
+        TraversalRay tr(r);
+        WideRay wr = wideRay(tr);
+        WideEntry localStack[256];
+        vector<WideEntry> deepStack;
+        WideEntry* stack = localStack;
+        if((W - 1) * wideDepth + 1 > 256){
+            deepStack.resize((W - 1) * wideDepth + 1);
+            stack = deepStack.data();
+        }
+        int sp = 0;
+        bool intersected = false;
+        uint64_t visits = 0, tests = 0, hits = 0;
+
+        double tEntry;
+        if(!intersectNode(nodes[0], tr, i.getT(), tEntry)){
+            return false;
+        }
+        stack[sp++] = {0, 0, tEntry};
+        while(sp > 0){
+            WideEntry entry = stack[--sp];
+            if(entry.tEntry >= i.getT()){
+                continue;
+            }
+            if(entry.count > 0){
+                for(int j = entry.index; j < entry.index + entry.count; j++){
+                    isect test;
+                    tests++;
+                    if(geoObjects[j]->intersect(r, test) && test.getT() < i.getT()){
+                        i = std::move(test);
+                        intersected = true;
+                        hits++;
+                    }
+                }
+                continue;
+            }
+            visits++;
+            const WideBVHNode<W> &node = wide[entry.index];
+            double tChild[W];
+            unsigned mask = boxTest(&node.bounds[0][0][0], W, wr, i.getT(), tChild);
+            int first = sp;
+            for(int c = 0; c < W; c++){
+                if(!(mask & (1u << c))){
+                    continue;
+                }
+                WideEntry child = {node.index[c], node.count[c], tChild[c]};
+                int k = sp++;
+                while(k > first && stack[k - 1].tEntry < child.tEntry){
+                    stack[k] = stack[k - 1];
+                    k--;
+                }
+                stack[k] = child;
+            }
+        }
+        RenderStats::add(RenderStats::NodeVisits, visits);
+        RenderStats::add(RenderStats::PrimitiveTests, tests);
+        RenderStats::add(RenderStats::PrimitiveHits, hits);
+        return intersected;
+    }
+
+    //Any-hit traversal of the wide tree for shadow rays
+    template <int W>
+    bool traverseWideOcclusion(const vector<WideBVHNode<W>> &wide, ray &r, double tMax){
+        TraversalRay tr(r);
+        WideRay wr = wideRay(tr);
+        WideEntry localStack[256];
+        vector<WideEntry> deepStack;
+        WideEntry* stack = localStack;
+        if((W - 1) * wideDepth + 1 > 256){
+            deepStack.resize((W - 1) * wideDepth + 1);
+            stack = deepStack.data();
+        }
+        int sp = 0;
+        uint64_t visits = 0, tests = 0;
+
+        double tEntry;
+        if(!intersectNode(nodes[0], tr, tMax, tEntry)){
+            return false;
+        }
+        stack[sp++] = {0, 0, tEntry};
+        bool occluded = false;
+        while(sp > 0 && !occluded){
+            WideEntry entry = stack[--sp];
+            if(entry.count > 0){
+                for(int j = entry.index; j < entry.index + entry.count; j++){
+                    tests++;
+                    if(geoObjects[j]->occludes(r, tMax)){
+                        occluded = true;
+                        break;
+                    }
+                }
+                continue;
+            }
+            visits++;
+            const WideBVHNode<W> &node = wide[entry.index];
+            double tChild[W];
+            unsigned mask = boxTest(&node.bounds[0][0][0], W, wr, tMax, tChild);
+            for(int c = 0; c < W; c++){
+                if(mask & (1u << c)){
+                    stack[sp++] = {node.index[c], node.count[c], tChild[c]};
+                }
+            }
+        }
+        RenderStats::add(RenderStats::NodeVisits, visits);
+        RenderStats::add(RenderStats::PrimitiveTests, tests);
+        RenderStats::add(RenderStats::PrimitiveHits, occluded ? 1 : 0);
+        return occluded;
+    }
+
+public:
+    //Most rays traversed together as one packet
+    static const int MaxPacketSize = 16;
+
+private:
+    //Bounds on the origins and reciprocal directions of a packet's rays, so
+    //one interval slab test can cull a node for the whole packet. Only
+    //meaningful when every ray's direction has the same signs.
+    struct PacketInterval
+    {
+        glm::dvec3 originMin, originMax;
+        glm::dvec3 invMin, invMax;
+        int dirIsNeg[3];
+    };
+
+    //False if the packet is too incoherent for an interval: the rays'
+    //direction signs differ, or one runs parallel to an axis.
+    static bool makeInterval(const TraversalRay *tr, int n, PacketInterval &pi){
+        pi.originMin = pi.originMax = tr[0].origin;
+        pi.invMin = pi.invMax = tr[0].invDir;
+        for(int axis = 0; axis < 3; axis++){
+            pi.dirIsNeg[axis] = tr[0].dirIsNeg[axis];
+        }
+        for(int k = 0; k < n; k++){
+            for(int axis = 0; axis < 3; axis++){
+                if(tr[k].dirIsNeg[axis] != pi.dirIsNeg[axis] || std::isinf(tr[k].invDir[axis])){
+                    return false;
+                }
+            }
+            pi.originMin = glm::min(pi.originMin, tr[k].origin);
+            pi.originMax = glm::max(pi.originMax, tr[k].origin);
+            pi.invMin = glm::min(pi.invMin, tr[k].invDir);
+            pi.invMax = glm::max(pi.invMax, tr[k].invDir);
+        }
+        return true;
+    }
+
+    //The slab test in interval arithmetic. Every ray's entry into the box is
+    //at least the largest lower bound of the near slabs, and its exit at most
+    //the smallest upper bound of the far ones, so if those don't overlap no
+    //ray of the packet hits the node before tLimit.
+    static bool intervalMiss(const LinearBVHNode &node, const PacketInterval &pi, double tLimit){
+        double tNear = -DBL_MAX;
+        double tFar = DBL_MAX;
+        for(int axis = 0; axis < 3; axis++){
+            double nearSlab = pi.dirIsNeg[axis] ? node.boundsMax[axis] : node.boundsMin[axis];
+            double farSlab = pi.dirIsNeg[axis] ? node.boundsMin[axis] : node.boundsMax[axis];
+            double n0 = (nearSlab - pi.originMax[axis]) * pi.invMin[axis];
+            double n1 = (nearSlab - pi.originMax[axis]) * pi.invMax[axis];
+            double n2 = (nearSlab - pi.originMin[axis]) * pi.invMin[axis];
+            double n3 = (nearSlab - pi.originMin[axis]) * pi.invMax[axis];
+            double f0 = (farSlab - pi.originMax[axis]) * pi.invMin[axis];
+            double f1 = (farSlab - pi.originMax[axis]) * pi.invMax[axis];
+            double f2 = (farSlab - pi.originMin[axis]) * pi.invMin[axis];
+            double f3 = (farSlab - pi.originMin[axis]) * pi.invMax[axis];
+            tNear = std::max(tNear, std::min(std::min(n0, n1), std::min(n2, n3)));
+            tFar = std::min(tFar, std::max(std::max(f0, f1), std::max(f2, f3)));
+        }
+        return tNear > tFar || tFar < RAY_EPSILON || tNear >= tLimit;
+    }
+
+    struct PacketEntry
+    {
+        int node;
+        int first; //rays before this one are known to miss the node
+    };
+
+    //Closest hits for a packet of up to MaxPacketSize rays. A node is skipped
+    //if the interval test rules it out for the whole packet, and otherwise
+    //visited if any ray still in play hits it. Rays before the first one
+    //that does are left out of the node's whole subtree. Children are
+    //visited near first, judged by the packet's common direction. Packets
+    //whose rays don't share direction signs fall back to single rays.
+    void traversePacket(ray *const rays[], isect *const hits[], bool found[], int n){
+        TraversalRay tr[MaxPacketSize];
+        for(int k = 0; k < n; k++){
+            tr[k] = TraversalRay(*rays[k]);
+            found[k] = false;
+        }
+        PacketInterval pi;
+        if(n == 1 || !makeInterval(tr, n, pi)){
+            RenderStats::add(RenderStats::PacketFallbacks);
+            for(int k = 0; k < n; k++){
+                found[k] = traverse(*rays[k], *hits[k]);
+            }
+            return;
+        }
+        RenderStats::add(RenderStats::PacketRays, n);
+
+        PacketEntry localStack[64];
+        vector<PacketEntry> deepStack;
+        PacketEntry* stack = localStack;
+        if(treeDepth >= 64){
+            deepStack.resize(treeDepth + 1);
+            stack = deepStack.data();
+        }
+        int sp = 0;
+        uint64_t visits = 0, tests = 0, hitCount = 0;
+
+        stack[sp++] = {0, 0};
+        while(sp > 0){
+            PacketEntry entry = stack[--sp];
+            const LinearBVHNode &node = nodes[entry.node];
+            double tLimit = 0.0;
+            for(int k = entry.first; k < n; k++){
+                tLimit = std::max(tLimit, hits[k]->getT());
+            }
+            if(intervalMiss(node, pi, tLimit)){
+                continue;
+            }
+            int first = entry.first;
+            double tEntry;
+            while(first < n && !intersectNode(node, tr[first], hits[first]->getT(), tEntry)){
+                first++;
+            }
+            if(first == n){
+                continue;
+            }
+            visits++;
+            if(node.isLeaf()){
+                for(int k = first; k < n; k++){
+                    if(k > first && !intersectNode(node, tr[k], hits[k]->getT(), tEntry)){
+                        continue;
+                    }
+                    for(int j = node.primOffset; j < node.primOffset + node.primCount; j++){
+                        isect test;
+                        tests++;
+                        if(geoObjects[j]->intersect(*rays[k], test) && test.getT() < hits[k]->getT()){
+                            *hits[k] = std::move(test);
+                            found[k] = true;
+                            hitCount++;
+                        }
+                    }
+                }
+                continue;
+            }
+            //Push the far child first so the near one is popped next
+            int nearChild = entry.node + 1;
+            int farChild = node.rightChild;
+            if(pi.dirIsNeg[node.axis]){
+                std::swap(nearChild, farChild);
+            }
+            stack[sp++] = {farChild, first};
+            stack[sp++] = {nearChild, first};
+        }
+        RenderStats::add(RenderStats::NodeVisits, visits);
+        RenderStats::add(RenderStats::PrimitiveTests, tests);
+        RenderStats::add(RenderStats::PrimitiveHits, hitCount);
+    }
+
+    //Any-hit version of traversePacket for shadow rays; a ray drops out of
+    //the packet as soon as something blocks it.
+    void traversePacketOcclusion(ray *const rays[], const double tMax[], bool blocked[], int n){
+        TraversalRay tr[MaxPacketSize];
+        for(int k = 0; k < n; k++){
+            tr[k] = TraversalRay(*rays[k]);
+            blocked[k] = false;
+        }
+        PacketInterval pi;
+        if(n == 1 || !makeInterval(tr, n, pi)){
+            RenderStats::add(RenderStats::PacketFallbacks);
+            for(int k = 0; k < n; k++){
+                blocked[k] = traverseOcclusion(*rays[k], tMax[k]);
+            }
+            return;
+        }
+        RenderStats::add(RenderStats::PacketRays, n);
+
+        PacketEntry localStack[64];
+        vector<PacketEntry> deepStack;
+        PacketEntry* stack = localStack;
+        if(treeDepth >= 64){
+            deepStack.resize(treeDepth + 1);
+            stack = deepStack.data();
+        }
+        int sp = 0;
+        int unblocked = n;
+        uint64_t visits = 0, tests = 0;
+
+        stack[sp++] = {0, 0};
+        while(sp > 0 && unblocked > 0){
+            PacketEntry entry = stack[--sp];
+            const LinearBVHNode &node = nodes[entry.node];
+            double tLimit = 0.0;
+            for(int k = entry.first; k < n; k++){
+                if(!blocked[k]){
+                    tLimit = std::max(tLimit, tMax[k]);
+                }
+            }
+            if(intervalMiss(node, pi, tLimit)){
+                continue;
+            }
+            int first = entry.first;
+            double tEntry;
+            while(first < n && (blocked[first] || !intersectNode(node, tr[first], tMax[first], tEntry))){
+                first++;
+            }
+            if(first == n){
+                continue;
+            }
+            visits++;
+            if(node.isLeaf()){
+                for(int k = first; k < n; k++){
+                    if(blocked[k] || (k > first && !intersectNode(node, tr[k], tMax[k], tEntry))){
+                        continue;
+                    }
+                    for(int j = node.primOffset; j < node.primOffset + node.primCount; j++){
+                        tests++;
+                        if(geoObjects[j]->occludes(*rays[k], tMax[k])){
+                            blocked[k] = true;
+                            unblocked--;
+                            break;
+                        }
+                    }
+                }
+                continue;
+            }
+            stack[sp++] = {node.rightChild, first};
+            stack[sp++] = {entry.node + 1, first};
+        }
+        RenderStats::add(RenderStats::NodeVisits, visits);
+        RenderStats::add(RenderStats::PrimitiveTests, tests);
+        RenderStats::add(RenderStats::PrimitiveHits, n - unblocked);
+    }
+
+public:
     bool intersect(ray &r, isect &i){
-        return checkIntersect(root, r, i);
+        if(geoObjects.empty()){
+            return false;
+        }
+        if(!wide4.empty()){
+            return traverseWide(wide4, r, i);
+        }
+        if(!wide8.empty()){
+            return traverseWide(wide8, r, i);
+        }
+        return traverse(r, i);
+    }
+
+    //True if any object blocks r before tMax
+    bool occluded(ray &r, double tMax){
+        if(geoObjects.empty()){
+            return false;
+        }
+        if(!wide4.empty()){
+            return traverseWideOcclusion(wide4, r, tMax);
+        }
+        if(!wide8.empty()){
+            return traverseWideOcclusion(wide8, r, tMax);
+        }
+        return traverseOcclusion(r, tMax);
+    }
+
+    //Packet versions of intersect() and occluded() for n rays, traced
+    //MaxPacketSize at a time. They pay off when the rays are coherent, such
+    //as neighbouring camera rays or shadow rays toward one light.
+    void intersect(ray *const rays[], isect *const hits[], bool found[], int n){
+        if(geoObjects.empty()){
+            std::fill(found, found + n, false);
+            return;
+        }
+        for(int k = 0; k < n; k += MaxPacketSize){
+            traversePacket(rays + k, hits + k, found + k, std::min(n - k, MaxPacketSize));
+        }
+    }
+
+    void occluded(ray *const rays[], const double tMax[], bool blocked[], int n){
+        if(geoObjects.empty()){
+            std::fill(blocked, blocked + n, false);
+            return;
+        }
+        for(int k = 0; k < n; k += MaxPacketSize){
+            traversePacketOcclusion(rays + k, tMax + k, blocked + k, std::min(n - k, MaxPacketSize));
+        }
     }
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,154 @@
+#include "bvhsimd.h"
+
+#include "ray.h"
+#include <float.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BVH_SIMD_X86 1
+#define BVH_SIMD_AVX 1
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+// x64 always has SSE2; AVX would need its own build flags on MSVC
+#define BVH_SIMD_X86 1
+#define BVH_SIMD_AVX 0
+#include <immintrin.h>
+#else
+#define BVH_SIMD_X86 0
+#define BVH_SIMD_AVX 0
+#endif
+
+namespace {
+
+// Offset of the near or far slab of axis within a node's bounds
+inline int slab(int side, int axis, int width) {
+  return (side * 3 + axis) * width;
+}
+
+unsigned testScalar(const double *bounds, int width, const WideRay &ray,
+                    double tLimit, double *tEntry) {
+  unsigned mask = 0;
+  for (int c = 0; c < width; c++) {
+    double tMin = -DBL_MAX;
+    double tMax = DBL_MAX;
+    for (int axis = 0; axis < 3; axis++) {
+      int neg = ray.dirIsNeg[axis];
+      double t0 = (bounds[slab(neg, axis, width) + c] - ray.origin[axis]) *
+                  ray.invDir[axis];
+      double t1 = (bounds[slab(1 - neg, axis, width) + c] - ray.origin[axis]) *
+                  ray.invDir[axis];
+      if (t0 > tMin)
+        tMin = t0;
+      if (t1 < tMax)
+        tMax = t1;
+    }
+    tEntry[c] = tMin;
+    if (tMin <= tMax && tMax >= RAY_EPSILON && tMin < tLimit)
+      mask |= 1u << c;
+  }
+  return mask;
+}
+
+#if BVH_SIMD_X86
+
+#if defined(__GNUC__)
+__attribute__((target("sse2")))
+#endif
+unsigned testSSE2(const double *bounds, int width, const WideRay &ray,
+                  double tLimit, double *tEntry) {
+  const __m128d eps = _mm_set1_pd(RAY_EPSILON);
+  const __m128d limit = _mm_set1_pd(tLimit);
+  unsigned mask = 0;
+  for (int c = 0; c < width; c += 2) {
+    __m128d tMin = _mm_set1_pd(-DBL_MAX);
+    __m128d tMax = _mm_set1_pd(DBL_MAX);
+    for (int axis = 0; axis < 3; axis++) {
+      int neg = ray.dirIsNeg[axis];
+      __m128d origin = _mm_set1_pd(ray.origin[axis]);
+      __m128d invDir = _mm_set1_pd(ray.invDir[axis]);
+      __m128d nearSlab = _mm_loadu_pd(bounds + slab(neg, axis, width) + c);
+      __m128d farSlab = _mm_loadu_pd(bounds + slab(1 - neg, axis, width) + c);
+      __m128d t0 = _mm_mul_pd(_mm_sub_pd(nearSlab, origin), invDir);
+      __m128d t1 = _mm_mul_pd(_mm_sub_pd(farSlab, origin), invDir);
+      // max/min return their second operand when either is NaN, which
+      // ignores a NaN slab the same way the scalar test does
+      tMin = _mm_max_pd(t0, tMin);
+      tMax = _mm_min_pd(t1, tMax);
+    }
+    _mm_storeu_pd(tEntry + c, tMin);
+    __m128d hit = _mm_and_pd(_mm_cmple_pd(tMin, tMax),
+                             _mm_and_pd(_mm_cmpge_pd(tMax, eps),
+                                        _mm_cmplt_pd(tMin, limit)));
+    mask |= (unsigned)_mm_movemask_pd(hit) << c;
+  }
+  return mask;
+}
+
+#endif // BVH_SIMD_X86
+
+#if BVH_SIMD_AVX
+
+__attribute__((target("avx"))) unsigned
+testAVX(const double *bounds, int width, const WideRay &ray, double tLimit,
+        double *tEntry) {
+  const __m256d eps = _mm256_set1_pd(RAY_EPSILON);
+  const __m256d limit = _mm256_set1_pd(tLimit);
+  unsigned mask = 0;
+  for (int c = 0; c < width; c += 4) {
+    __m256d tMin = _mm256_set1_pd(-DBL_MAX);
+    __m256d tMax = _mm256_set1_pd(DBL_MAX);
+    for (int axis = 0; axis < 3; axis++) {
+      int neg = ray.dirIsNeg[axis];
+      __m256d origin = _mm256_set1_pd(ray.origin[axis]);
+      __m256d invDir = _mm256_set1_pd(ray.invDir[axis]);
+      __m256d nearSlab = _mm256_loadu_pd(bounds + slab(neg, axis, width) + c);
+      __m256d farSlab =
+          _mm256_loadu_pd(bounds + slab(1 - neg, axis, width) + c);
+      __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(nearSlab, origin), invDir);
+      __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(farSlab, origin), invDir);
+      tMin = _mm256_max_pd(t0, tMin);
+      tMax = _mm256_min_pd(t1, tMax);
+    }
+    _mm256_storeu_pd(tEntry + c, tMin);
+    __m256d hit = _mm256_and_pd(
+        _mm256_cmp_pd(tMin, tMax, _CMP_LE_OQ),
+        _mm256_and_pd(_mm256_cmp_pd(tMax, eps, _CMP_GE_OQ),
+                      _mm256_cmp_pd(tMin, limit, _CMP_LT_OQ)));
+    mask |= (unsigned)_mm256_movemask_pd(hit) << c;
+  }
+  return mask;
+}
+
+bool cpuHasAVX() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx");
+}
+
+#endif // BVH_SIMD_AVX
+
+} // anonymous namespace
+
+WideBoxTest wideBoxTest(const std::string &name) {
+  if (name == "scalar")
+    return testScalar;
+#if BVH_SIMD_AVX
+  if (name != "sse2" && cpuHasAVX())
+    return testAVX;
+#endif
+#if BVH_SIMD_X86
+  return testSSE2;
+#else
+  return testScalar;
+#endif
+}
+
+const char *wideBoxTestName(WideBoxTest test) {
+#if BVH_SIMD_AVX
+  if (test == testAVX)
+    return "avx";
+#endif
+#if BVH_SIMD_X86
+  if (test == testSSE2)
+    return "sse2";
+#endif
+  return "scalar";
+}
@@ -0,0 +1,34 @@
+#ifndef BVHSIMD_H__
+#define BVHSIMD_H__
+
+// Box tests for the wide BVH: one ray against all 4 or 8 child boxes of a
+// node at once. A node keeps its child boxes structure-of-arrays, as
+// bounds[side][axis][child], side 0 being the minimum corner, so each step
+// of the slab test loads one register's worth of children.
+//
+// The kernel is picked at run time from what the CPU supports: AVX (four
+// doubles at a time), SSE2 (two), or plain C++. Every kernel does exactly
+// the arithmetic of the scalar BVH::intersectNode, in double precision,
+// so the choice never changes an image.
+
+#include <string>
+
+struct WideRay {
+  double origin[3];
+  double invDir[3];
+  int dirIsNeg[3];
+};
+
+// Tests ray against the width (4 or 8) boxes in bounds. Returns a bit mask
+// of the boxes it enters in front of its origin and before tLimit, and
+// writes every box's entry distance to tEntry.
+typedef unsigned (*WideBoxTest)(const double *bounds, int width,
+                                const WideRay &ray, double tLimit,
+                                double *tEntry);
+
+// The kernel called name ("avx", "sse2" or "scalar") if this CPU can run
+// it, otherwise the fastest one it can; "auto" asks for the fastest.
+WideBoxTest wideBoxTest(const std::string &name = "auto");
+const char *wideBoxTestName(WideBoxTest test);
+
+#endif // BVHSIMD_H__
@@ -7,16 +7,38 @@
 
 using namespace std;
 
+namespace {
+
+double luminance(const glm::dvec3 &c) {
+  return 0.299 * c[0] + 0.587 * c[1] + 0.114 * c[2];
+}
+
+// Radius of a sphere around the scene, the length scale for light powers
+double sceneRadius(const Scene *scene) {
+  const BoundingBox &b = scene->bounds();
+  return std::max(0.5 * glm::length(b.getMax() - b.getMin()), 1e-3);
+}
+
+} // anonymous namespace
+
 double DirectionalLight::distanceAttenuation(const glm::dvec3 &) const {
   // distance to light is infinite, so f(di) goes to 0.  Return 1.
   return 1.0;
 }
 
-glm::dvec3 DirectionalLight::shadowAttenuation(const ray &r,
-                                               const glm::dvec3 &p) const {
+glm::dvec3 DirectionalLight::shadowAttenuation(const ray &r, const glm::dvec3 &p,
+                                               [[maybe_unused]] Rng &rng) const {
     glm::dvec3 light = getColor();
-    isect point;
     ray shadowRay = r;
+    //Any opaque blocker means full shadow, and without translucent objects
+    //in the scene there is nothing left to attenuate the light.
+    if(scene->occluded(shadowRay, 1000.0)){
+        return glm::dvec3(0.0);
+    }
+    if(!scene->hasTranslucentObjects()){
+        return light;
+    }
+    isect point;
     scene->intersect(shadowRay, point);
     while(point.getT() < 1000){
         //We intersected a material before the light. Now we need to get the other side to find the distance.
@@ -34,6 +56,21 @@ glm::dvec3 DirectionalLight::shadowAttenuation(const ray &r,
     return light;
 }
 
+bool DirectionalLight::sampleLight(const glm::dvec3 &, [[maybe_unused]] SampleStream &samples,
+                                   LightSample &s) const {
+    s.direction = -orientation;
+    s.distance = 1000.0;
+    s.radiance = color;
+    s.pdf = 0.0;
+    return true;
+}
+
+// Its irradiance over the cross-section of the scene
+double DirectionalLight::power() const {
+    double r = sceneRadius(scene);
+    return luminance(color) * M_PI * r * r;
+}
+
 glm::dvec3 DirectionalLight::getColor() const { return color; }
 
 glm::dvec3 DirectionalLight::getDirection(const glm::dvec3 &) const {
@@ -50,6 +87,24 @@ double PointLight::distanceAttenuation(const glm::dvec3 &P) const {
   return glm::min(1.0, 1 / denom);
 }
 
+bool PointLight::sampleLight(const glm::dvec3 &P, [[maybe_unused]] SampleStream &samples,
+                             LightSample &s) const {
+    s.distance = glm::distance(position, P);
+    if (s.distance == 0.0)
+        return false;
+    s.direction = (position - P) / s.distance;
+    s.radiance = color * distanceAttenuation(P);
+    s.pdf = 0.0;
+    return true;
+}
+
+// Its attenuated intensity at the scene's scale, over a sphere that size
+double PointLight::power() const {
+    double r = sceneRadius(scene);
+    double denom = constantTerm + linearTerm * r + quadraticTerm * r * r;
+    return luminance(color) * glm::min(1.0, 1 / denom) * 4 * M_PI * r * r;
+}
+
 glm::dvec3 PointLight::getColor() const { return color; }
 
 glm::dvec3 PointLight::getDirection(const glm::dvec3 &P) const {
@@ -60,12 +115,18 @@ glm::dvec3 PointLight::getRelativeDirection(const glm::dvec3 &P) const {
     return position - P;
 }
 
-glm::dvec3 PointLight::shadowAttenuation(const ray &r,
-                                         const glm::dvec3 &p) const {
+glm::dvec3 PointLight::shadowAttenuation(const ray &r, const glm::dvec3 &p,
+                                         [[maybe_unused]] Rng &rng) const {
     glm::dvec3 light = getColor();
     double lightT = glm::sqrt(glm::dot(position - p, position - p));
-    isect point;
     ray shadowRay = r;
+    if(scene->occluded(shadowRay, lightT)){
+        return glm::dvec3(0.0);
+    }
+    if(!scene->hasTranslucentObjects()){
+        return light;
+    }
+    isect point;
     scene->intersect(shadowRay, point);
     while(point.getT() < lightT){
         //We intersected a material before the light. Now we need to get the other side to find the distance.
@@ -102,49 +163,142 @@ glm::dvec3 RectangleAreaLight::getRelativeDirection(const glm::dvec3 &P) const {
     return center - P;
 }
 
-glm::dvec3 RectangleAreaLight::samplePoint(){
+glm::dvec3 RectangleAreaLight::samplePoint(const glm::dvec2 &u) const {
     glm::dvec3 randomPoint;
-    double uInterpolate = uDist(generator);
-    double vInterpolate = vDist(generator);
-    randomPoint = corner + uVec * uInterpolate + vVec + vInterpolate;
+    double uInterpolate = u[0] * uLength;
+    double vInterpolate = u[1] * vLength;
+    randomPoint = corner + uVec * uInterpolate + vVec * vInterpolate;
     return randomPoint;
 }
 
 //Ignore the ray that's passed in, and instead make 10 rays here
-glm::dvec3 RectangleAreaLight::shadowAttenuation(const ray &r,
-                                         const glm::dvec3 &p) const {
+glm::dvec3 RectangleAreaLight::shadowAttenuation(const ray &r, const glm::dvec3 &p,
+                                                 Rng &rng) const {
     glm::dvec3 finalLight(0, 0, 0);
     //Sample 20 times
     for(int i = 0; i < 10; i++){
         glm::dvec3 light = getColor();
-        glm::dvec3 position = const_cast<RectangleAreaLight*>(this)->samplePoint();
+        glm::dvec3 position = samplePoint(glm::dvec2(rng.nextDouble(), rng.nextDouble()));
         double lightT = glm::sqrt(glm::dot(position - p, position - p));
-        isect point;
         ray shadowRay(r.getPosition(), glm::normalize(position - r.getPosition()), r.getAtten(), ray::SHADOW);
-        scene->intersect(shadowRay, point);
-        while(point.getT() < lightT){
-            //We intersected a material before the light. Now we need to get the other side to find the distance.
-            glm::dvec3 entry = shadowRay.at(point);
-            shadowRay.setPosition(shadowRay.at(point.getT() + RAY_EPSILON));
-            scene->intersect(shadowRay, point);
-            glm::dvec3 exit = shadowRay.at(point);
-            double distance = glm::distance(entry, exit);
-            //Found distance, now do the transulcent light formula
-            light *= glm::pow(point.getMaterial().kt(point), glm::dvec3(distance));
-            //Great, now get the next material's intersection and continue.
-            shadowRay.setPosition(shadowRay.at(point.getT() + RAY_EPSILON));
+        if(scene->occluded(shadowRay, lightT)){
+            continue;
+        }
+        if(scene->hasTranslucentObjects()){
+            isect point;
             scene->intersect(shadowRay, point);
-            lightT = glm::sqrt(glm::dot(position - shadowRay.getPosition(), position - shadowRay.getPosition()));
+            while(point.getT() < lightT){
+                //We intersected a material before the light. Now we need to get the other side to find the distance.
+                glm::dvec3 entry = shadowRay.at(point);
+                shadowRay.setPosition(shadowRay.at(point.getT() + RAY_EPSILON));
+                scene->intersect(shadowRay, point);
+                glm::dvec3 exit = shadowRay.at(point);
+                double distance = glm::distance(entry, exit);
+                //Found distance, now do the transulcent light formula
+                light *= glm::pow(point.getMaterial().kt(point), glm::dvec3(distance));
+                //Great, now get the next material's intersection and continue.
+                shadowRay.setPosition(shadowRay.at(point.getT() + RAY_EPSILON));
+                scene->intersect(shadowRay, point);
+                lightT = glm::sqrt(glm::dot(position - shadowRay.getPosition(), position - shadowRay.getPosition()));
+            }
         }
         //Distance Attenuation
-        double distance = glm::distance(position, r.getPosition());
-        double denom = constantTerm + linearTerm * distance + quadraticTerm * glm::pow(distance, 2);
-        light *= glm::min(1.0, 1 / denom);
+        light *= attenuation(glm::distance(position, r.getPosition()));
         finalLight += light;
     }
     finalLight /= 10;
     return finalLight;
 }
 
+double RectangleAreaLight::attenuation(double distance) const {
+    double denom = constantTerm + linearTerm * distance + quadraticTerm * glm::pow(distance, 2);
+    return glm::min(1.0, 1 / denom);
+}
+
+//Like shadowAttenuation, but one point per call
+bool RectangleAreaLight::sampleLight(const glm::dvec3 &P, SampleStream &samples,
+                                     LightSample &s) const {
+    glm::dvec3 position = samplePoint(samples.next2D());
+    s.distance = glm::distance(position, P);
+    if (s.distance == 0.0)
+        return false;
+    s.direction = (position - P) / s.distance;
+    s.radiance = color * attenuation(s.distance);
+    s.pdf = 0.0;
+    return true;
+}
+
+double RectangleAreaLight::power() const {
+    double r = sceneRadius(scene);
+    return luminance(color) * attenuation(r) * 4 * M_PI * r * r;
+}
+
+bool EmissiveLight::sampleLight(const glm::dvec3 &P, SampleStream &samples,
+                                LightSample &s) const {
+    isect i;
+    glm::dvec3 position;
+    double areaPdf = object->sampleSurface(samples, position, i);
+    double distance2 = glm::dot(position - P, position - P);
+    if (distance2 == 0.0)
+        return false;
+    double distance = glm::sqrt(distance2);
+    s.direction = (position - P) / distance;
+    double cosLight = glm::abs(glm::dot(i.getN(), s.direction));
+    if (cosLight <= 0.0)
+        return false;
+    i.setObject(object);
+    s.radiance = object->getMaterial().ke(i);
+    // Stop short of the surface, or the shadow ray hits the light itself
+    s.distance = distance * (1.0 - 1e-6);
+    s.pdf = areaPdf * distance2 / cosLight;
+    return true;
+}
+
+// Emitted radiance over its area, both sides. Averaged over a few fixed
+// surface points so textured emission and stretched shapes count too.
+double EmissiveLight::power() const {
+    const int count = 16;
+    HaltonSampler points(0);
+    double total = 0.0;
+    for (int k = 0; k < count; k++) {
+        SampleStream samples(points, 0, k);
+        isect i;
+        glm::dvec3 position;
+        double areaPdf = object->sampleSurface(samples, position, i);
+        i.setObject(object);
+        total += luminance(object->getMaterial().ke(i)) / areaPdf;
+    }
+    return 2 * M_PI * total / count;
+}
+
+glm::dvec3 EmissiveLight::shadowAttenuation(const ray &r, const glm::dvec3 &p,
+                                            Rng &rng) const {
+    // One independent point, like the other lights' shadow tests
+    IndependentSampler sampler(rng.nextUInt());
+    SampleStream samples(sampler, 0, 0);
+    LightSample s;
+    if (!sampleLight(p, samples, s))
+        return glm::dvec3(0.0);
+    ray shadowRay(r.getPosition(), s.direction, r.getAtten(), ray::SHADOW);
+    return s.radiance * scene->transmittance(shadowRay, s.distance);
+}
+
+double EmissiveLight::distanceAttenuation(const glm::dvec3 &) const {
+    return 1.0;
+}
+
+glm::dvec3 EmissiveLight::getColor() const {
+    return object->getMaterial().ke(isect());
+}
+
+glm::dvec3 EmissiveLight::getDirection(const glm::dvec3 &P) const {
+    return glm::normalize(getRelativeDirection(P));
+}
+
+glm::dvec3 EmissiveLight::getRelativeDirection(const glm::dvec3 &P) const {
+    const BoundingBox &b = object->getBoundingBox();
+    return 0.5 * (b.getMin() + b.getMax()) - P;
+}
+
 #define VERBOSE 0
 
@@ -3,20 +3,37 @@
 
 #ifndef _WIN32
 #include <algorithm>
-#include <random>
 using std::max;
 using std::min;
 #endif
 
 #include "../ui/TraceUI.h"
+#include "rng.h"
+#include "sampler.h"
 #include "scene.h"
 #include <FL/gl.h>
 
+// One sample of the light reaching a point, for next-event estimation
+struct LightSample
+{
+	glm::dvec3 direction; // unit vector from the point towards the light
+	double distance;	  // how far the shadow ray has to stay clear
+	glm::dvec3 radiance;  // light arriving from there, ignoring blockers
+	double pdf;			  // per solid angle; 0 for lights no ray can hit
+};
+
 class Light : public SceneElement
 {
 public:
-	virtual glm::dvec3 shadowAttenuation(const ray &r,
-										 const glm::dvec3 &pos) const = 0;
+	// rng drives any sampling the light does (e.g. area lights)
+	virtual glm::dvec3 shadowAttenuation(const ray &r, const glm::dvec3 &pos,
+										 Rng &rng) const = 0;
+	// Pick a point on the light as seen from P. Returns false if the light
+	// can't reach P at all.
+	virtual bool sampleLight(const glm::dvec3 &P, SampleStream &samples,
+							 LightSample &s) const = 0;
+	// Rough total emitted power; lights are picked in proportion to it
+	virtual double power() const = 0;
 	virtual double distanceAttenuation(const glm::dvec3 &P) const = 0;
 	virtual glm::dvec3 getColor() const = 0;
 	virtual glm::dvec3 getDirection(const glm::dvec3 &P) const = 0;
@@ -47,8 +64,11 @@ public:
 	{
 		pointLight = false;
 	}
-	virtual glm::dvec3 shadowAttenuation(const ray &r,
-										 const glm::dvec3 &pos) const;
+	virtual glm::dvec3 shadowAttenuation(const ray &r, const glm::dvec3 &pos,
+										 Rng &rng) const;
+	virtual bool sampleLight(const glm::dvec3 &P, SampleStream &samples,
+							 LightSample &s) const;
+	virtual double power() const;
 	virtual double distanceAttenuation(const glm::dvec3 &P) const;
 	virtual glm::dvec3 getColor() const;
 	virtual glm::dvec3 getDirection(const glm::dvec3 &P) const;
@@ -76,8 +96,11 @@ public:
 		pointLight = true;
 	}
 
-	virtual glm::dvec3 shadowAttenuation(const ray &r,
-										 const glm::dvec3 &pos) const;
+	virtual glm::dvec3 shadowAttenuation(const ray &r, const glm::dvec3 &pos,
+										 Rng &rng) const;
+	virtual bool sampleLight(const glm::dvec3 &P, SampleStream &samples,
+							 LightSample &s) const;
+	virtual double power() const;
 	virtual double distanceAttenuation(const glm::dvec3 &P) const;
 	virtual glm::dvec3 getColor() const;
 	virtual glm::dvec3 getDirection(const glm::dvec3 &P) const;
@@ -118,14 +141,14 @@ public:
               linearTerm(linearAttenuationTerm),
               quadraticTerm(quadraticAttenuationTerm)
     {
-        generator = default_random_engine(rd());
-        uDist = uniform_real_distribution<double>(0, uLength);
-        vDist = uniform_real_distribution<double>(0, vLength);
         center = uL / 2 * uVec + vL / 2 * vVec + corner;
     }
 
-    virtual glm::dvec3 shadowAttenuation(const ray &r,
-                                         const glm::dvec3 &pos) const;
+    virtual glm::dvec3 shadowAttenuation(const ray &r, const glm::dvec3 &pos,
+                                         Rng &rng) const;
+    virtual bool sampleLight(const glm::dvec3 &P, SampleStream &samples,
+                             LightSample &s) const;
+    virtual double power() const;
     virtual double distanceAttenuation(const glm::dvec3 &P) const;
     virtual glm::dvec3 getColor() const;
     virtual glm::dvec3 getDirection(const glm::dvec3 &P) const;
@@ -146,11 +169,6 @@ protected:
     double uLength;
     double vLength;
 
-    std::random_device rd;
-    std::default_random_engine generator; // rd() provides a random seed
-    std::uniform_real_distribution<double> uDist;
-    std::uniform_real_distribution<double> vDist;
-
 
     // These three values are the a, b, and c in the distance attenuation function
     // (from the slide labelled "Intensity drop-off with distance"):
@@ -166,7 +184,37 @@ public:
 //    void glDrawLight() const;
 
 private:
-    glm::dvec3 samplePoint();
+    // The point at (u, v) on the rectangle, both in [0, 1)
+    glm::dvec3 samplePoint(const glm::dvec2 &u) const;
+    double attenuation(double distance) const;
+};
+
+// The surface of an emissive object (a material with ke) used as a light.
+// Points are picked uniformly over its area and it shines from both sides,
+// like the object is hit from both sides. The scene makes these itself.
+class EmissiveLight : public Light
+{
+public:
+	EmissiveLight(Scene *scene, const SceneObject *obj)
+		: Light(scene, glm::dvec3(0.0)), object(obj)
+	{
+		pointLight = false;
+	}
+
+	virtual glm::dvec3 shadowAttenuation(const ray &r, const glm::dvec3 &pos,
+										 Rng &rng) const;
+	virtual bool sampleLight(const glm::dvec3 &P, SampleStream &samples,
+							 LightSample &s) const;
+	virtual double power() const;
+	virtual double distanceAttenuation(const glm::dvec3 &P) const;
+	virtual glm::dvec3 getColor() const;
+	virtual glm::dvec3 getDirection(const glm::dvec3 &P) const;
+	virtual glm::dvec3 getRelativeDirection(const glm::dvec3 &P) const;
+
+	const SceneObject *getObject() const { return object; }
+
+private:
+	const SceneObject *object;
 };
 
 #endif // __LIGHT_H__
@@ -2,6 +2,7 @@
 #include "../ui/TraceUI.h"
 #include "light.h"
 #include "ray.h"
+#include "sampler.h"
 extern TraceUI *traceUI;
 
 #include "../fileio/images.h"
@@ -18,7 +19,7 @@ Material::~Material() {}
 
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
-glm::dvec3 Material::shade(Scene *scene, const ray &r, const isect &i) const
+glm::dvec3 Material::shade(Scene *scene, const ray &r, const isect &i, Rng &rng) const
 {
     glm::dvec3 newN = i.getN();
   bool hasNormalMap = _kn.mapped();
@@ -43,13 +44,13 @@ glm::dvec3 Material::shade(Scene *scene, const ray &r, const isect &i) const
     ray shadowRay(firePos, fireDirection, fireWeight, ray::SHADOW);
 
     // Diffusion Term
-    glm::dvec3 contributionD = pLight->shadowAttenuation(shadowRay, firePos);
+    glm::dvec3 contributionD = pLight->shadowAttenuation(shadowRay, firePos, rng);
     contributionD *= pLight->distanceAttenuation(pointOfImpact);
     contributionD *= kd(i);
     contributionD *= glm::abs(glm::dot(newN, pLight->getDirection(pointOfImpact)));
     diffuseTerm += contributionD;
     // Specular Term
-    glm::dvec3 contributionS = pLight->shadowAttenuation(shadowRay, firePos);
+    glm::dvec3 contributionS = pLight->shadowAttenuation(shadowRay, firePos, rng);
     contributionS *= pLight->distanceAttenuation(pointOfImpact);
     contributionS *= ks(i);
     glm::dvec3 v = -1.0 * r.getDirection();
@@ -85,91 +86,134 @@ double ndf(double alpha, const glm::dvec3& N, const glm::dvec3& H) {
     return ret;
 }
 
-glm::dvec3 Material::shadeBRDF(Scene *scene, const ray &wIn, const ray &wOut, const glm::dvec3 indirectColor, const isect &i) const {
-    glm::dvec3 n = i.getN();
-    glm::dvec3 retColor = glm::dvec3(0);
-    // wOut is View vector
-
-    glm::dvec3 diffuseBRDF = glm::dvec3 (0);
-
-    glm::dvec3 pointOfImpact = wOut.getPosition();
-    glm::dvec3 ambientTerm = ka(i) * scene->ambient();
-    glm::dvec3 specularTerm(0, 0, 0);
-
+// GGX width, with perfectly smooth surfaces nudged to barely rough
+double Material::ggxAlpha(const isect &i) const {
     double roughness = this->roughness(i);
     if (roughness == 0) {
         roughness = 0.001;
     }
-    double alpha = roughness * roughness;
-    double alphaSquared = alpha * alpha;
+    return roughness * roughness;
+}
 
+// Reflectance at normal incidence: from the index for dielectrics, tinted
+// towards the diffuse colour for metals
+glm::dvec3 Material::baseReflectance(const isect &i) const {
     glm::dvec3 F0 = glm::dvec3(glm::pow((1.0 - this->index(i)) / (1.0 + this->index(i)), 2));
     if (this->kMetallic(i) > 0) {
         F0 = glm::mix(F0, this->kd(i), this->kMetallic(i));
     }
+    return F0;
+}
 
-    for (const auto &pLight : scene->getAllLights()) {
-        glm::dvec3 lightDir = pLight->getDirection(pointOfImpact);
-        glm::dvec3 H = lightDir + wOut.getDirection();
-        H = glm::normalize(H);
-
-        glm::dvec3 diffuseTerm(0, 0, 0);
-        glm::dvec3 firePos = pointOfImpact + i.getN() * RAY_EPSILON * 3.0;
-        glm::dvec3 fireDirection = pLight->getDirection(firePos);
-        glm::dvec3 fireWeight = glm::dvec3(1.0, 1.0, 1.0);
-        ray shadowRay(firePos, fireDirection, fireWeight, ray::SHADOW);
-
-        // Diffusion Term
-        glm::dvec3 contributionD = pLight->shadowAttenuation(shadowRay, firePos);
-        contributionD *= pLight->distanceAttenuation(pointOfImpact);
-        contributionD *= kd(i);
-        contributionD *= glm::abs(glm::dot(n, pLight->getDirection(pointOfImpact)));
-        diffuseTerm += contributionD / M_PI;
-        diffuseTerm *= (1 - this->kMetallic(i));
-
-        diffuseBRDF += diffuseTerm;
-
-        // Fresnel term
-        glm::dvec3 schlickFresnel = fresnel(F0, wOut.getDirection(), H);
-
-        // NDF term
-        double normalTerm = ndf(alpha, n, H);
+// How often sample() picks the specular lobe: its Fresnel weight seen from
+// wo against the diffuse albedo
+double Material::specularChance(const isect &i, const glm::dvec3 &n, const glm::dvec3 &wo) const {
+    glm::dvec3 F = fresnel(baseReflectance(i), wo, n);
+    double spec = (F[0] + F[1] + F[2]) / 3;
+    glm::dvec3 albedo = kd(i) * (1 - this->kMetallic(i));
+    double diff = (albedo[0] + albedo[1] + albedo[2]) / 3;
+    if (spec + diff <= 0) {
+        return 0.5;
+    }
+    return spec / (spec + diff);
+}
 
-        // Geometric term
-        double geomTerm = ggxGeometryFunction(n, pLight->getDirection(pointOfImpact), alpha) * ggxGeometryFunction(n, wOut.getDirection(), alpha);
+// Any two unit vectors t, b completing n to an orthonormal frame
+static void tangentFrame(const glm::dvec3 &n, glm::dvec3 &t, glm::dvec3 &b) {
+    if (glm::abs(n.x) > glm::abs(n.y))
+        t = glm::dvec3(n.z, 0, -n.x) / glm::sqrt(n.x * n.x + n.z * n.z);
+    else
+        t = glm::dvec3(0, -n.z, n.y) / glm::sqrt(n.y * n.y + n.z * n.z);
+    b = glm::cross(n, t);
+}
 
-        double nDotl = glm::abs(glm::dot(n, pLight->getDirection(pointOfImpact)));
-        glm::dvec3 specularContribution = ((schlickFresnel * normalTerm * geomTerm) / (4 * nDotl * glm::dot(n, wOut.getDirection())));
-        specularTerm +=  specularContribution * nDotl * pLight->distanceAttenuation(pointOfImpact);
+glm::dvec3 Material::eval(const isect &i, const glm::dvec3 &n, const glm::dvec3 &wo, const glm::dvec3 &wi) const {
+    double cosIn = glm::dot(n, wi);
+    double cosOut = glm::dot(n, wo);
+    if (cosIn <= 0 || cosOut <= 0) {
+        return glm::dvec3(0);
     }
 
-    // Indirect Light
-    glm::dvec3 H = -wIn.getDirection() + wOut.getDirection();
-    H = glm::normalize(H);
+    double alpha = ggxAlpha(i);
+    glm::dvec3 F0 = baseReflectance(i);
 
-    diffuseBRDF += (kd(i) * indirectColor) * glm::abs(glm::dot(n, -wIn.getDirection())) / M_PI * (1 - this->kMetallic(i));
+    // Lambertian diffuse, scaled down for metals
+    glm::dvec3 diffuse = kd(i) * cosIn / M_PI * (1 - this->kMetallic(i));
 
-    // Schlick Fresnel approx
-    glm::dvec3 schlickFresnel = fresnel(F0, wOut.getDirection(), H);
-
-    // NDF function
+    // Cook-Torrance specular with Schlick Fresnel and the GGX NDF
+    glm::dvec3 H = glm::normalize(wi + wo);
+    glm::dvec3 schlickFresnel = fresnel(F0, wo, H);
     double normalTerm = ndf(alpha, n, H);
+    double geomTerm = ggxGeometryFunction(n, wi, alpha) * ggxGeometryFunction(n, wo, alpha);
+    glm::dvec3 specular = (schlickFresnel * normalTerm * geomTerm) / (4 * cosIn * cosOut) * cosIn;
 
-    // Geometric term
-    double geomTerm = ggxGeometryFunction(n, -wIn.getDirection(), alpha) * ggxGeometryFunction(n, wOut.getDirection(), alpha);
+    return diffuse + specular;
+}
 
-    double nDotl = glm::abs(glm::dot(n, -wIn.getDirection()));
-    glm::dvec3 indirectSpecular = ((schlickFresnel * geomTerm * normalTerm) / (4 * nDotl * glm::dot(n, wOut.getDirection()))) * nDotl * indirectColor;
-    specularTerm += indirectSpecular;
+// Diffuse: cosine-weighted, pdf cos/pi. Specular: the GGX distribution of
+// normals visible from wo (Heitz 2018), reflected about the picked normal,
+// pdf G1(wo) D(h) / (4 cos(wo)).
+double Material::pdf(const isect &i, const glm::dvec3 &n, const glm::dvec3 &wo, const glm::dvec3 &wi) const {
+    double cosIn = glm::dot(n, wi);
+    double cosOut = glm::dot(n, wo);
+    if (cosIn <= 0 || cosOut <= 0) {
+        return 0.0;
+    }
+    double alpha = ggxAlpha(i);
+    double specular = specularChance(i, n, wo);
+    glm::dvec3 H = glm::normalize(wi + wo);
+    double specPdf = ggxGeometryFunction(n, wo, alpha) * ndf(alpha, n, H) / (4 * cosOut);
+    double diffPdf = cosIn / M_PI;
+    return specular * specPdf + (1 - specular) * diffPdf;
+}
 
-    retColor = diffuseBRDF;
-    retColor += ambientTerm;
-    retColor += specularTerm;
+bool Material::sample(const isect &i, const glm::dvec3 &n, const glm::dvec3 &wo, SampleStream &samples,
+                      glm::dvec3 &wi, double &pdf) const {
+    double cosOut = glm::dot(n, wo);
+    if (cosOut <= 0) {
+        return false;
+    }
+    glm::dvec3 t, b;
+    tangentFrame(n, t, b);
+
+    glm::dvec2 u = samples.next2D();
+    double u1 = u[0];
+    double u2 = u[1];
+    if (samples.next1D() < specularChance(i, n, wo)) {
+        // Stretch wo to the hemisphere configuration, pick a point on the
+        // projected disk there, and unstretch the normal it gives
+        double alpha = ggxAlpha(i);
+        glm::dvec3 V = glm::normalize(glm::dvec3(alpha * glm::dot(wo, t), alpha * glm::dot(wo, b), cosOut));
+        double lensq = V.x * V.x + V.y * V.y;
+        glm::dvec3 T1 = lensq > 0 ? glm::dvec3(-V.y, V.x, 0) / glm::sqrt(lensq) : glm::dvec3(1, 0, 0);
+        glm::dvec3 T2 = glm::cross(V, T1);
+        double r = glm::sqrt(u1);
+        double phi = 2 * M_PI * u2;
+        double t1 = r * glm::cos(phi);
+        double t2 = r * glm::sin(phi);
+        double s = 0.5 * (1 + V.z);
+        t2 = (1 - s) * glm::sqrt(1 - t1 * t1) + s * t2;
+        glm::dvec3 Nh = t1 * T1 + t2 * T2 + glm::sqrt(glm::max(0.0, 1 - t1 * t1 - t2 * t2)) * V;
+        glm::dvec3 h = glm::normalize(alpha * Nh.x * t + alpha * Nh.y * b + glm::max(0.0, Nh.z) * n);
+        wi = 2 * glm::dot(wo, h) * h - wo;
+    } else {
+        double r = glm::sqrt(u1);
+        double phi = 2 * M_PI * u2;
+        wi = r * glm::cos(phi) * t + r * glm::sin(phi) * b + glm::sqrt(glm::max(0.0, 1 - u1)) * n;
+    }
+    wi = glm::normalize(wi);
+    pdf = this->pdf(i, n, wo, wi);
+    return pdf > 0;
+}
 
-    return retColor;
+TextureMap::TextureMap(string filename, bool loadNow)
+    : filename(filename), width(0), height(0)
+{
+  if (loadNow)
+    load();
 }
 
-TextureMap::TextureMap(string filename)
+void TextureMap::load()
 {
   data = readImage(filename.c_str(), width, height);
   if (data.empty())
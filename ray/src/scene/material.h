@@ -18,6 +18,8 @@ class Scene;
 class ray;
 class isect;
 class TrimeshFace;
+class Rng;
+class SampleStream;
 
 using std::string;
 
@@ -28,7 +30,12 @@ implement basic texture mapping. */
 class TextureMap
 {
 public:
-	TextureMap(string filename);
+	// With loadNow false the image is only read by load(), which lets the
+	// scene decode all of its textures in parallel after parsing.
+	TextureMap(string filename, bool loadNow = true);
+
+	// Read and decode the image. Throws TextureMapException on failure.
+	void load();
 
 	// Return the mapped value; here the coordinate is assumed to be within
 	// the parametrization space:
@@ -47,6 +54,7 @@ public:
 	~TextureMap() {}
 
 protected:
+	string filename;
 	int width;
 	int height;
 	std::vector<uint8_t> data;
@@ -124,7 +132,7 @@ public:
 		_textureMap = 0;
 	}
 
-	bool isZero() { return glm::length(_value) == 0.0; }
+	bool isZero() const { return glm::length(_value) == 0.0; }
 
 	glm::dvec3 &operator+=(const glm::dvec3 &rhs)
 	{
@@ -170,8 +178,18 @@ public:
 		setBools();
 	}
 
-	virtual glm::dvec3 shade(Scene *scene, const ray &r, const isect &i) const;
-    virtual glm::dvec3 shadeBRDF(Scene *scene, const ray &wIn, const ray &wOut,  const glm::dvec3 color, const isect &i) const;
+	virtual glm::dvec3 shade(Scene *scene, const ray &r, const isect &i, Rng &rng) const;
+    // The microfacet BRDF times the cosine term, for light arriving from
+    // direction wi and leaving towards wo (both unit, pointing away from
+    // the surface) around normal n.
+    glm::dvec3 eval(const isect &i, const glm::dvec3 &n, const glm::dvec3 &wo, const glm::dvec3 &wi) const;
+    // Importance-sample wi for the given wo, picking the diffuse or the
+    // specular lobe by their weights. Returns false if there is nothing
+    // to follow. pdf is per solid angle and matches pdf() below.
+    bool sample(const isect &i, const glm::dvec3 &n, const glm::dvec3 &wo, SampleStream &samples,
+                glm::dvec3 &wi, double &pdf) const;
+    // The density sample() draws wi with
+    double pdf(const isect &i, const glm::dvec3 &n, const glm::dvec3 &wo, const glm::dvec3 &wi) const;
 
 	Material &operator+=(const Material &m)
 	{
@@ -267,8 +285,13 @@ public:
 	bool Spec() const { return _spec; }
 	bool Both() const { return _both; }
 	bool Normal() const { return _normal; } // ADDED FOR NORMAL MAP
+	bool Emissive() const { return _ke.mapped() || !_ke.isZero(); }
 
 private:
+    double ggxAlpha(const isect &i) const;
+    glm::dvec3 baseReflectance(const isect &i) const;
+    double specularChance(const isect &i, const glm::dvec3 &n, const glm::dvec3 &wo) const;
+
 	MaterialParameter _ke; // emissive
 	MaterialParameter _ka; // ambient
 	MaterialParameter _ks; // specular
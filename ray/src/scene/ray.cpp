@@ -1,5 +1,4 @@
 #include "ray.h"
-#include "../ui/TraceUI.h"
 #include "material.h"
 #include "scene.h"
 
@@ -12,12 +11,10 @@ ray::ray(const glm::dvec3 &pp, const glm::dvec3 &dd, const glm::dvec3 &w,
          RayType tt)
     : p(pp), d(dd), atten(w), t(tt)
 {
-  TraceUI::addRay(ray_thread_id);
 }
 
 ray::ray(const ray &other) : p(other.p), d(other.d), atten(other.atten), t(other.t)
 {
-  TraceUI::addRay(ray_thread_id);
 }
 
 ray::~ray() {}
@@ -33,4 +30,5 @@ ray &ray::operator=(const ray &other)
 
 glm::dvec3 ray::at(const isect &i) const { return at(i.getT()); }
 
+// Selects this thread's RenderStats slot; render workers set it
 thread_local unsigned int ray_thread_id = 0;
@@ -19,7 +19,8 @@ class SceneObject;
 class isect;
 
 /*
- * ray_thread_id: a thread local variable for statistical purpose.
+ * ray_thread_id: a thread local variable for statistical purpose. It picks
+ * the thread's RenderStats slot.
  */
 extern thread_local unsigned int ray_thread_id;
 
@@ -70,6 +71,7 @@ public:
   isect()
       : obj(NULL), t(0.0), N(), uvCoordinates(), bary(), material(nullptr) {}
   isect(const isect &other) { copyFromOther(other); }
+  isect(isect &&other) = default;
 
   ~isect() {}
 
@@ -78,11 +80,13 @@ public:
     copyFromOther(other);
     return *this;
   }
+  isect &operator=(isect &&other) = default;
 
   //This is hacky but why not
 
 
   void setObject(const SceneObject *o) { obj = o; }
+  const SceneObject *getObject() const { return obj; }
 
   // Get/Set Time of flight
   void setT(double tt) { t = tt; }
@@ -95,13 +99,22 @@ public:
   void setBiTangent(const glm::dvec3 &b) { bitangent = b; }
   glm::dvec3 getBiTangent() const { return bitangent; }
 
-  void setMaterial(const Material &m)
+  // Only for materials that differ from the object's own (e.g. interpolated
+  // vertex colors). Primitives should just setObject() and let getMaterial()
+  // fall back to the object's material, which costs nothing per hit.
+  // Returns the intersection's copy, to be adjusted in place.
+  Material &setMaterial(const Material &m)
   {
     if (material)
       *material = m;
     else
       material.reset(new Material(m));
+    return *material;
   }
+  // Color interpolated from a mesh's vertex colors, for the Trimesh to put
+  // into its material
+  void setVertexColor(const glm::dvec3 &c) { vertexColor = c; }
+  glm::dvec3 getVertexColor() const { return vertexColor; }
   void setUVCoordinates(const glm::dvec2 &coords) { uvCoordinates = coords; }
   glm::dvec2 getUVCoordinates() const { return uvCoordinates; }
   void setBary(const glm::dvec3 &weights) { bary = weights; }
@@ -121,6 +134,9 @@ private:
     N = other.N;
     bary = other.bary;
     uvCoordinates = other.uvCoordinates;
+    tangent = other.tangent;
+    bitangent = other.bitangent;
+    vertexColor = other.vertexColor;
     if (other.material)
     {
       setMaterial(*other.material);
@@ -138,9 +154,11 @@ private:
   glm::dvec3 bary;
   glm::dvec3 tangent;
   glm::dvec3 bitangent;
+  glm::dvec3 vertexColor;
 
   // if this intersection has its own material (as opposed to one in its
-  // associated object) as in the case where the material was interpolated
+  // associated object) as in the case where the material was interpolated.
+  // Null for every other hit.
   std::unique_ptr<Material> material;
 };
 
@@ -0,0 +1,41 @@
+#ifndef RNG_H__
+#define RNG_H__
+
+#include <stdint.h>
+
+// Small, fast random number generator (PCG32, see pcg-random.org) for all
+// the random decisions made while tracing. Unlike rand() it has no shared
+// state and no lock: every pixel gets its own generator, seeded from the
+// render seed and the pixel's index, so an image is reproducible from its
+// seed whatever the thread count or schedule.
+class Rng {
+public:
+  Rng() { seed(0, 0); }
+  Rng(uint64_t initState, uint64_t stream) { seed(initState, stream); }
+
+  // Different streams give independent sequences for the same state.
+  void seed(uint64_t initState, uint64_t stream) {
+    state = 0;
+    inc = (stream << 1u) | 1u;
+    nextUInt();
+    state += initState;
+    nextUInt();
+  }
+
+  uint32_t nextUInt() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = (uint32_t)(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+  }
+
+  // Uniform in [0, 1)
+  double nextDouble() { return nextUInt() * (1.0 / 4294967296.0); }
+
+private:
+  uint64_t state;
+  uint64_t inc;
+};
+
+#endif // RNG_H__
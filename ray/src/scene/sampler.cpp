@@ -0,0 +1,224 @@
+#include "sampler.h"
+
+#include <algorithm>
+
+namespace {
+
+uint64_t mix64(uint64_t z) {
+  z += 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Largest double below 1, so rounding never hands out 1.0
+const double OneMinusEpsilon = 1.0 - 1.0 / 9007199254740992.0;
+
+// A pseudo-random permutation of [0, n) picked by p (Kensler, "Correlated
+// Multi-Jittered Sampling", 2013)
+uint32_t permute(uint32_t i, uint32_t n, uint32_t p) {
+  uint32_t w = n - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do {
+    i ^= p;
+    i *= 0xe170893d;
+    i ^= p >> 16;
+    i ^= (i & w) >> 4;
+    i ^= p >> 8;
+    i *= 0x0929eb3f;
+    i ^= p >> 23;
+    i ^= (i & w) >> 1;
+    i *= 1 | p >> 27;
+    i *= 0x6935fa69;
+    i ^= (i & w) >> 11;
+    i *= 0x74dcb303;
+    i ^= (i & w) >> 2;
+    i *= 0x9e501cc3;
+    i ^= (i & w) >> 2;
+    i *= 0xc860a3df;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= n);
+  return (i + p) % n;
+}
+
+const int NumHaltonBases = 32;
+const uint32_t HaltonBases[NumHaltonBases] = {
+    2,  3,  5,  7,  11, 13, 17, 19, 23, 29, 31, 37,  41,  43,  47,  53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131};
+
+// The digits of index in base, mirrored about the point and each put
+// through a random permutation of its own, picked by seed and the digit's
+// position. The permutations also act on the zero digits past the end of
+// index, down to 32 bits of resolution, so the low digits are randomised
+// too.
+double scrambledRadicalInverse(uint32_t index, uint32_t base, uint32_t seed) {
+  double inverseBase = 1.0 / base;
+  double scale = inverseBase;
+  double result = 0.0;
+  for (uint32_t digit = 0; scale * 4294967296.0 > 1.0; digit++) {
+    result += permute(index % base, base, seed + digit * 0x9e3779b9u) * scale;
+    index /= base;
+    scale *= inverseBase;
+  }
+  return result;
+}
+
+// The first four Sobol dimensions, from Joe and Kuo's new-joe-kuo-6.21201
+// direction numbers. A point is the XOR of the direction numbers of the
+// index's set bits; the tables hold that XOR for every value of each byte
+// of the index, so a point takes four lookups.
+struct SobolTables {
+  uint32_t bytes[4][4][256];
+
+  SobolTables() {
+    uint32_t v[4][32];
+    for (int k = 0; k < 32; k++)
+      v[0][k] = 1u << (31 - k);
+    const int degree[3] = {1, 2, 3};
+    const uint32_t poly[3] = {0, 1, 1};
+    const uint32_t initial[3][3] = {{1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+    for (int d = 1; d < 4; d++) {
+      int s = degree[d - 1];
+      uint32_t a = poly[d - 1];
+      for (int k = 0; k < 32; k++) {
+        if (k < s) {
+          v[d][k] = initial[d - 1][k] << (31 - k);
+          continue;
+        }
+        v[d][k] = v[d][k - s] ^ (v[d][k - s] >> s);
+        for (int j = 1; j < s; j++)
+          if ((a >> (s - 1 - j)) & 1)
+            v[d][k] ^= v[d][k - j];
+      }
+    }
+    for (int d = 0; d < 4; d++)
+      for (int byte = 0; byte < 4; byte++)
+        for (int value = 0; value < 256; value++) {
+          uint32_t x = 0;
+          for (int bit = 0; bit < 8; bit++)
+            if (value & (1 << bit))
+              x ^= v[d][byte * 8 + bit];
+          bytes[d][byte][value] = x;
+        }
+  }
+};
+
+uint32_t sobol(uint32_t index, int dimension) {
+  static const SobolTables tables;
+  const uint32_t(*t)[256] = tables.bytes[dimension];
+  return t[0][index & 0xff] ^ t[1][(index >> 8) & 0xff] ^
+         t[2][(index >> 16) & 0xff] ^ t[3][index >> 24];
+}
+
+uint32_t reverseBits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+  x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+  x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+  x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+  return x;
+}
+
+// Owen scrambling of the bits of x, done as a hash in which every bit only
+// depends on the bits below it (Burley, "Practical Hash-based Owen
+// Scrambling", 2020). Applied to reversed bits, so higher bits drive lower.
+uint32_t owenScramble(uint32_t x, uint32_t seed) {
+  x = reverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverseBits(x);
+}
+
+} // anonymous namespace
+
+std::unique_ptr<Sampler> Sampler::create(const std::string &name,
+                                         uint64_t seed, int strata) {
+  if (name == "independent")
+    return std::unique_ptr<Sampler>(new IndependentSampler(seed));
+  if (name == "stratified")
+    return std::unique_ptr<Sampler>(new StratifiedSampler(seed, strata));
+  if (name == "halton")
+    return std::unique_ptr<Sampler>(new HaltonSampler(seed));
+  return std::unique_ptr<Sampler>(new SobolSampler(seed));
+}
+
+uint32_t Sampler::hash(uint32_t a, uint32_t b, uint32_t c) const {
+  uint64_t h = mix64(seed ^ a);
+  h = mix64(h ^ (((uint64_t)b << 32) | c));
+  return (uint32_t)(h >> 32);
+}
+
+double IndependentSampler::get1D(uint32_t pixel, uint32_t index,
+                                 uint32_t dimension) const {
+  return toUnit(hash(pixel, index, dimension));
+}
+
+StratifiedSampler::StratifiedSampler(uint64_t seed, int strata)
+    : Sampler(seed) {
+  side = (uint32_t)std::max(strata, 1);
+  cells = side * side;
+}
+
+// Which cell sample index falls in. Each round of cells samples gets its
+// own shuffle.
+uint32_t StratifiedSampler::stratum(uint32_t pixel, uint32_t index,
+                                    uint32_t dimension) const {
+  uint32_t round = index / cells;
+  return permute(index % cells, cells, hash(pixel, dimension, round));
+}
+
+double StratifiedSampler::get1D(uint32_t pixel, uint32_t index,
+                                uint32_t dimension) const {
+  double jitter = toUnit(hash(pixel, index, ~dimension));
+  double u = (stratum(pixel, index, dimension) + jitter) / cells;
+  return std::min(u, OneMinusEpsilon);
+}
+
+glm::dvec2 StratifiedSampler::get2D(uint32_t pixel, uint32_t index,
+                                    uint32_t dimension) const {
+  uint32_t cell = stratum(pixel, index, dimension);
+  double jx = toUnit(hash(pixel, index, ~dimension));
+  double jy = toUnit(hash(pixel, index, ~(dimension + 1)));
+  double u = (cell % side + jx) / side;
+  double v = (cell / side + jy) / side;
+  return glm::dvec2(std::min(u, OneMinusEpsilon), std::min(v, OneMinusEpsilon));
+}
+
+double HaltonSampler::get1D(uint32_t pixel, uint32_t index,
+                            uint32_t dimension) const {
+  uint32_t base = HaltonBases[dimension % NumHaltonBases];
+  double u = scrambledRadicalInverse(index, base, hash(pixel, dimension));
+  return std::min(u, OneMinusEpsilon);
+}
+
+uint32_t SobolSampler::shuffle(uint32_t pixel, uint32_t index,
+                               uint32_t dimension) const {
+  return owenScramble(index, hash(pixel, dimension / 4, 0xffffffffu));
+}
+
+double SobolSampler::get1D(uint32_t pixel, uint32_t index,
+                           uint32_t dimension) const {
+  uint32_t x = sobol(shuffle(pixel, index, dimension), dimension % 4);
+  return toUnit(owenScramble(x, hash(pixel, dimension)));
+}
+
+// Same as two get1D() calls, sharing the shuffle when both dimensions are
+// in one group
+glm::dvec2 SobolSampler::get2D(uint32_t pixel, uint32_t index,
+                               uint32_t dimension) const {
+  if (dimension % 4 == 3)
+    return Sampler::get2D(pixel, index, dimension);
+  uint32_t shuffled = shuffle(pixel, index, dimension);
+  uint32_t x = sobol(shuffled, dimension % 4);
+  uint32_t y = sobol(shuffled, dimension % 4 + 1);
+  return glm::dvec2(toUnit(owenScramble(x, hash(pixel, dimension))),
+                    toUnit(owenScramble(y, hash(pixel, dimension + 1))));
+}
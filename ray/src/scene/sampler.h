@@ -0,0 +1,124 @@
+#ifndef SAMPLER_H__
+#define SAMPLER_H__
+
+// Sample patterns for the random decisions made along a path.
+//
+// A Sampler maps (pixel, sample number, dimension) to a number in [0, 1).
+// Dimensions are the successive decisions of one path: sub-pixel position,
+// light choice, point on the light, BRDF lobe and direction, and so on.
+// Samplers keep no state, so one is shared by every render thread, and a
+// pixel's samples don't depend on which thread traces them or when.
+//
+// The sample number runs on without bound (adaptive sampling decides when
+// a pixel stops), so every pattern here is progressive: any prefix of a
+// pixel's samples is well spread, not only the full set.
+
+#include <glm/vec2.hpp>
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+class Sampler {
+public:
+  virtual ~Sampler() {}
+
+  virtual double get1D(uint32_t pixel, uint32_t index,
+                       uint32_t dimension) const = 0;
+  // Dimensions dimension and dimension + 1 together. Samplers that can
+  // stratify pairs jointly override this.
+  virtual glm::dvec2 get2D(uint32_t pixel, uint32_t index,
+                           uint32_t dimension) const {
+    return glm::dvec2(get1D(pixel, index, dimension),
+                      get1D(pixel, index, dimension + 1));
+  }
+
+  // "independent", "stratified", "halton" or "sobol"; unknown names fall
+  // back to sobol. strata is the side of the stratified sampler's grid.
+  static std::unique_ptr<Sampler> create(const std::string &name,
+                                         uint64_t seed, int strata);
+
+protected:
+  explicit Sampler(uint64_t seed) : seed(seed) {}
+
+  // Well-mixed 32-bit hash of the seed and up to three more values
+  uint32_t hash(uint32_t a, uint32_t b = 0, uint32_t c = 0) const;
+  static double toUnit(uint32_t bits) { return bits * (1.0 / 4294967296.0); }
+
+  uint64_t seed;
+};
+
+// Every dimension of every sample drawn independently
+class IndependentSampler : public Sampler {
+public:
+  explicit IndependentSampler(uint64_t seed) : Sampler(seed) {}
+  double get1D(uint32_t pixel, uint32_t index, uint32_t dimension) const;
+};
+
+// Jittered strata, strata x strata of them for a pair of dimensions and
+// strata^2 for a single one, visited in a shuffled order that differs per
+// pixel and dimension. Every run of strata^2 samples covers each stratum
+// once.
+class StratifiedSampler : public Sampler {
+public:
+  StratifiedSampler(uint64_t seed, int strata);
+  double get1D(uint32_t pixel, uint32_t index, uint32_t dimension) const;
+  glm::dvec2 get2D(uint32_t pixel, uint32_t index, uint32_t dimension) const;
+
+private:
+  uint32_t stratum(uint32_t pixel, uint32_t index, uint32_t dimension) const;
+
+  uint32_t side;
+  uint32_t cells;
+};
+
+// The Halton sequence, one prime base per dimension, with its digits
+// scrambled by random permutations that differ per pixel, dimension and
+// digit. Past the table of bases the dimensions reuse it with new
+// permutations.
+class HaltonSampler : public Sampler {
+public:
+  explicit HaltonSampler(uint64_t seed) : Sampler(seed) {}
+  double get1D(uint32_t pixel, uint32_t index, uint32_t dimension) const;
+};
+
+// Sobol points with hash-based Owen scrambling (Burley 2020). Dimensions
+// are taken four at a time from the first four Sobol dimensions, each
+// group with its own shuffle of the sample order, so the pattern needs no
+// large table and stays decorrelated between pixels.
+class SobolSampler : public Sampler {
+public:
+  explicit SobolSampler(uint64_t seed) : Sampler(seed) {}
+  double get1D(uint32_t pixel, uint32_t index, uint32_t dimension) const;
+  glm::dvec2 get2D(uint32_t pixel, uint32_t index, uint32_t dimension) const;
+
+private:
+  // The sample order of dimension's group in this pixel
+  uint32_t shuffle(uint32_t pixel, uint32_t index, uint32_t dimension) const;
+};
+
+// The dimensions of one pixel sample, drawn in order. This is what the
+// tracing code passes around and pulls its random numbers from.
+class SampleStream {
+public:
+  SampleStream(const Sampler &sampler, uint32_t pixel, uint32_t index)
+      : sampler(&sampler), pixel(pixel), index(index) {}
+
+  double next1D() { return sampler->get1D(pixel, index, dimension++); }
+  glm::dvec2 next2D() {
+    glm::dvec2 u = sampler->get2D(pixel, index, dimension);
+    dimension += 2;
+    return u;
+  }
+
+  // Jump to a fixed dimension, so each stage of a path draws from the
+  // same dimensions whatever the stages before it used
+  void skipTo(uint32_t d) { dimension = d; }
+
+private:
+  const Sampler *sampler;
+  uint32_t pixel;
+  uint32_t index;
+  uint32_t dimension = 0;
+};
+
+#endif // SAMPLER_H__
@@ -1,14 +1,34 @@
 #include <cmath>
+#include <chrono>
 
+#include "../ThreadPool.h"
 #include "../ui/TraceUI.h"
 #include "bvh.h"
 #include "light.h"
+#include "sampler.h"
 #include "scene.h"
 #include <glm/gtx/extended_min_max.hpp>
 #include <glm/gtx/io.hpp>
 #include <iostream>
 
 using namespace std;
+extern TraceUI *traceUI;
+
+BVHBuildSettings currentBVHSettings() {
+  BVHBuildSettings settings;
+  if (traceUI) {
+    settings.bins = traceUI->getBvhBins();
+    settings.traversalCost = traceUI->getBvhTraversalCost();
+    settings.leafCost = traceUI->getBvhLeafCost();
+    settings.width = traceUI->getBvhWidth();
+    settings.simd = traceUI->getBvhSimd();
+    settings.builder = traceUI->getBvhBuilder();
+    settings.splitOverlap = traceUI->getBvhSplitOverlap();
+    settings.rebuildRatio = traceUI->getBvhRebuildRatio();
+    settings.maxLeafSize = traceUI->getLeafSize();
+  }
+  return settings;
+}
 
 bool Geometry::intersect(ray &r, isect &i) const {
   double tmin, tmax;
@@ -39,6 +59,49 @@ bool Geometry::intersect(ray &r, isect &i) const {
   return rtrn;
 }
 
+bool Geometry::occludes(ray &r, double tMax) const {
+  if (!isOpaque())
+    return false;
+  double tmin, tmax;
+  if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax)))
+    return false;
+  // Same transform dance as intersect(), with tMax scaled into local space
+  glm::dvec3 pos = transform.globalToLocalCoords(r.getPosition());
+  glm::dvec3 dir =
+      transform.globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
+  double length = glm::length(dir);
+  dir = glm::normalize(dir);
+  glm::dvec3 Wpos = r.getPosition();
+  glm::dvec3 Wdir = r.getDirection();
+  r.setPosition(pos);
+  r.setDirection(dir);
+  bool rtrn = occludedLocal(r, tMax * length);
+  r.setPosition(Wpos);
+  r.setDirection(Wdir);
+  return rtrn;
+}
+
+bool Geometry::occludedLocal(ray &r, double tMax) const {
+  isect i;
+  return intersectLocal(r, i) && i.getT() < tMax;
+}
+
+double Geometry::sampleSurface(SampleStream &samples, glm::dvec3 &P, isect &i) const {
+  glm::dvec3 localP, localN;
+  glm::dvec2 uv;
+  sampleLocalSurface(samples, localP, localN, uv);
+  P = transform.localToGlobalCoords(localP);
+  i.setN(transform.localToGlobalCoordsNormal(localN));
+  i.setUVCoordinates(uv);
+  // Uniform in local space; the transform may stretch some parts more
+  return 1.0 / (localSurfaceArea() * transform.areaScale(localN));
+}
+
+double Geometry::surfacePdf(const glm::dvec3 &N) const {
+  glm::dvec3 localN = transform.globalToLocalCoordsNormal(N);
+  return 1.0 / (localSurfaceArea() * transform.areaScale(localN));
+}
+
 bool Geometry::hasBoundingBoxCapability() const {
   // by default, primitives do not have to specify a bounding box. If this
   // method returns true for a primitive, then either the ComputeBoundingBox()
@@ -94,10 +157,12 @@ void Geometry::ComputeBoundingBox() {
 Scene::Scene() { ambientIntensity = glm::dvec3(0, 0, 0); }
 
 Scene::~Scene() {
+  emissiveLights.clear();
   for (auto &obj : objects)
     delete obj;
   for (auto &light : lights)
     delete light;
+  delete tree;
 }
 
 void Scene::add(Geometry *obj) {
@@ -137,18 +202,208 @@ bool Scene::intersect(ray &r, isect &i) const {
     return have_one;
 }
 
+bool Scene::occluded(ray &r, double tMax) const {
+  RenderStats::add(RenderStats::ShadowRays);
+  return this->tree->occluded(r, tMax);
+}
+
+void Scene::intersect(ray *const rays[], isect *const hits[], bool found[],
+                      int n) const {
+  for (int k = 0; k < n; k++)
+    hits[k]->setT(1000.0);
+  this->tree->intersect(rays, hits, found, n);
+  if (TraceUI::m_debug) {
+    for (int k = 0; k < n; k++)
+      addToIntersectCache(
+          std::make_pair(new ray(*rays[k]), new isect(*hits[k])));
+  }
+}
+
+void Scene::occluded(ray *const rays[], const double tMax[], bool blocked[],
+                     int n) const {
+  RenderStats::add(RenderStats::ShadowRays, n);
+  this->tree->occluded(rays, tMax, blocked, n);
+}
+
+glm::dvec3 Scene::transmittance(ray &r, double dist) const {
+  if (occluded(r, dist))
+    return glm::dvec3(0.0);
+  return translucentTransmittance(r, dist);
+}
+
+glm::dvec3 Scene::translucentTransmittance(ray &r, double dist) const {
+  glm::dvec3 light(1.0);
+  if (!translucentObjects)
+    return light;
+  // Same walk as the lights' shadowAttenuation: attenuate by kt over the
+  // distance travelled inside each translucent object.
+  glm::dvec3 target = r.at(dist);
+  ray shadowRay = r;
+  isect point;
+  while (intersect(shadowRay, point) && point.getT() < dist) {
+    glm::dvec3 entry = shadowRay.at(point);
+    shadowRay.setPosition(shadowRay.at(point.getT() + RAY_EPSILON));
+    if (!intersect(shadowRay, point))
+      break;
+    glm::dvec3 exit = shadowRay.at(point);
+    light *= glm::pow(point.getMaterial().kt(point),
+                      glm::dvec3(glm::distance(entry, exit)));
+    shadowRay.setPosition(shadowRay.at(point.getT() + RAY_EPSILON));
+    dist = glm::distance(shadowRay.getPosition(), target);
+  }
+  return light;
+}
+
+void Scene::buildLightSampler() {
+  emissiveLights.clear();
+  for (Geometry *obj : objects) {
+    auto *sceneObj = dynamic_cast<const SceneObject *>(obj);
+    if (sceneObj && sceneObj->getMaterial().Emissive() &&
+        obj->canSampleSurface())
+      emissiveLights.emplace_back(new EmissiveLight(this, sceneObj));
+  }
+
+  sampledLights.clear();
+  for (Light *light : lights)
+    sampledLights.push_back(light);
+  for (auto &light : emissiveLights)
+    sampledLights.push_back(light.get());
+
+  // Pick by power, but never rule a light out completely
+  lightCdf.clear();
+  double total = 0.0;
+  for (const Light *light : sampledLights) {
+    total += std::max(light->power(), 1e-6);
+    lightCdf.push_back(total);
+  }
+  for (double &c : lightCdf)
+    c /= total;
+
+  emitterPick.clear();
+  for (size_t k = 0; k < emissiveLights.size(); k++) {
+    size_t idx = lights.size() + k;
+    double pick = lightCdf[idx] - (idx > 0 ? lightCdf[idx - 1] : 0.0);
+    auto *emitter = static_cast<const EmissiveLight *>(emissiveLights[k].get());
+    emitterPick[emitter->getObject()] = pick;
+  }
+}
+
+const Light *Scene::pickLight(SampleStream &samples, double &pickPdf) const {
+  if (sampledLights.empty()) {
+    pickPdf = 0.0;
+    return nullptr;
+  }
+  double u = samples.next1D();
+  size_t idx = std::upper_bound(lightCdf.begin(), lightCdf.end(), u) -
+               lightCdf.begin();
+  idx = std::min(idx, lightCdf.size() - 1);
+  pickPdf = lightCdf[idx] - (idx > 0 ? lightCdf[idx - 1] : 0.0);
+  return sampledLights[idx];
+}
+
+double Scene::emitterPickPdf(const Geometry *obj) const {
+  auto it = emitterPick.find(obj);
+  return it == emitterPick.end() ? 0.0 : it->second;
+}
+
 TextureMap *Scene::getTexture(string name) {
   auto itr = textureCache.find(name);
   if (itr == textureCache.end()) {
-    textureCache[name].reset(new TextureMap(name));
+    textureCache[name].reset(new TextureMap(name, false));
     return textureCache[name].get();
   }
   return itr->second.get();
 }
 
-void Scene::buildTree() {
+void Scene::loadTextures(ThreadPool &pool) {
+  std::vector<TextureMap *> maps;
+  for (auto &entry : textureCache)
+    maps.push_back(entry.second.get());
+  std::vector<string> errors(maps.size());
+  pool.parallelFor(0, (int)maps.size(), [&](int k) {
+    try {
+      maps[k]->load();
+    } catch (TextureMapException &e) {
+      errors[k] = e.message();
+    }
+  });
+  for (auto &error : errors)
+    if (!error.empty())
+      throw TextureMapException(error);
+}
+
+void Scene::buildTree(ThreadPool &pool) {
+    auto start = std::chrono::steady_clock::now();
+
+    // Small objects are built side by side, one per worker; big meshes then
+    // get the whole pool each, one after another
+    int threshold = currentBVHSettings().parallelThreshold;
+    std::vector<Geometry *> small, big;
+    for (Geometry *obj : objects)
+        (obj->treeSize() >= threshold ? big : small).push_back(obj);
+    pool.parallelFor(0, (int)small.size(), [&small](int k) { small[k]->buildTree(nullptr); });
+    for (Geometry *obj : big)
+        obj->buildTree(&pool);
+
+    report = TreeReport();
+    buildSceneTree(pool);
+    std::unordered_map<const BVHBuildInfo *, bool> counted;
+    double weightedCost = 0.0;
+    for (const Geometry *obj : objects) {
+        const BVHBuildInfo *info = obj->treeInfo();
+        if (!info || counted[info])
+            continue;
+        counted[info] = true;
+        report.objectTrees++;
+        report.objectPrims += info->prims;
+        report.objectReferences += info->references;
+        report.objectBuildSeconds += info->seconds;
+        weightedCost += info->sahCost * info->prims;
+    }
+    if (report.objectPrims > 0)
+        report.objectSahCost = weightedCost / report.objectPrims;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    report.seconds = elapsed.count();
+    translucentObjects = std::any_of(objects.begin(), objects.end(),
+                                     [](const Geometry *obj) { return !obj->isOpaque(); });
+    // After the object trees: meshes work out their areas in buildTree()
+    buildLightSampler();
+}
+
+void Scene::buildSceneTree(ThreadPool &pool) {
+    delete tree;
+    tree = new BVH<Geometry>(objects, currentBVHSettings(), &pool);
+    report.scenePrims = tree->buildInfo().prims;
+    report.sceneSahCost = tree->buildInfo().sahCost;
+}
+
+void Scene::setObjectTransform(Geometry *obj, const glm::dmat4 &xform) {
+    obj->setTransform(xform);
+    obj->ComputeBoundingBox();
+}
+
+bool Scene::updateTree(ThreadPool &pool) {
+    if (tree == nullptr) {
+        buildTree(pool);
+        return true;
+    }
+    auto start = std::chrono::steady_clock::now();
+    sceneBounds = BoundingBox();
+    for (const Geometry *obj : objects)
+        sceneBounds.merge(obj->getBoundingBox());
 
-    if(tree == nullptr){
-        this->tree = new BVH<Geometry>(objects);
+    double cost = tree->refit();
+    bool rebuild = cost > currentBVHSettings().rebuildRatio * tree->buildInfo().sahCost;
+    if (rebuild) {
+        buildSceneTree(pool);
+        report.rebuilds++;
+    } else {
+        report.sceneSahCost = cost;
+        report.refits++;
     }
+    // Emitters' powers depend on their size and the scene's
+    buildLightSampler();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    report.updateSeconds = elapsed.count();
+    return rebuild;
 }
@@ -10,10 +10,12 @@
 #define __SCENE_H__
 
 #include <algorithm>
+#include <cmath>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "bbox.h"
@@ -32,9 +34,12 @@
 using std::unique_ptr;
 
 class Light;
+class SampleStream;
 class Scene;
+class ThreadPool;
 
 template <typename Obj> class BVH;
+struct BVHBuildInfo;
 
 // A SceneElement is anything that lives within a scene. The behavior is
 // intentionally very barebones, since all actual entities are descended
@@ -93,6 +98,17 @@ public:
     return glm::normalize(normi * v);
   }
 
+  glm::dvec3 globalToLocalCoordsNormal(const glm::dvec3 &v) const {
+    return glm::normalize(glm::transpose(glm::dmat3x3(xform)) * v);
+  }
+
+  // How much the transform stretches a small patch of surface whose local
+  // (unit) normal is n
+  double areaScale(const glm::dvec3 &n) const {
+    return std::abs(glm::determinant(glm::dmat3x3(xform))) *
+           glm::length(normi * n);
+  }
+
   const glm::dmat4x4 &transform() const { return xform; }
 };
 
@@ -105,10 +121,37 @@ protected:
   // do not call directly - this should only be called by intersect()
   virtual bool intersectLocal(ray &r, isect &i) const = 0;
 
+  // occlusion test in the object's local coordinate space; only called by
+  // occludes(). The default runs a full intersection, override it when a
+  // cheaper hit-only test exists.
+  virtual bool occludedLocal(ray &r, double tMax) const;
+
+  // Surface sampling for emissive objects, in local space. Shapes that
+  // support it return their surface area and pick points uniformly on it,
+  // giving the point's normal and uv.
+  virtual double localSurfaceArea() const { return 0.0; }
+  virtual void sampleLocalSurface([[maybe_unused]] SampleStream &samples,
+                                  [[maybe_unused]] glm::dvec3 &P,
+                                  [[maybe_unused]] glm::dvec3 &N,
+                                  [[maybe_unused]] glm::dvec2 &uv) const {}
+
 public:
   // intersections performed in the global coordinate space.
   bool intersect(ray &r, isect &i) const;
 
+  // Does this object block r somewhere before tMax (global space)? Only
+  // opaque objects block; no shading information is computed.
+  bool occludes(ray &r, double tMax) const;
+  virtual bool isOpaque() const { return true; }
+
+  // Can lights sample points on this object's surface?
+  bool canSampleSurface() const { return localSurfaceArea() > 0.0; }
+  // A point on the surface in global space, with its normal and uv in i.
+  // Returns the pdf of having picked it, per unit of global area.
+  double sampleSurface(SampleStream &samples, glm::dvec3 &P, isect &i) const;
+  // The same pdf for a point whose global normal is N
+  double surfacePdf(const glm::dvec3 &N) const;
+
   virtual bool hasBoundingBoxCapability() const;
   const BoundingBox &getBoundingBox() const { return bounds; }
   glm::dvec3 getNormal() { return glm::dvec3(1.0, 0.0, 0.0); }
@@ -119,9 +162,19 @@ public:
   // this should be overridden if hasBoundingBoxCapability() is true.
   virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
+  // Build any per-object acceleration structure (e.g. a mesh's BVH). Called
+  // once by Scene::buildTree, either on a worker thread with no pool, or,
+  // for objects whose treeSize() is big, with the pool to build on.
+  virtual void buildTree([[maybe_unused]] ThreadPool *pool) {}
+  // Number of primitives buildTree() puts in the object's tree
+  virtual int treeSize() const { return 0; }
+  // The object's own tree once built, if it has one
+  virtual const BVHBuildInfo *treeInfo() const { return nullptr; }
+
   void setTransform(const MatrixTransform &transform) {
     this->transform = transform;
   };
+  const MatrixTransform &getTransform() const { return transform; }
 
   Geometry(Scene *scene) : SceneElement(scene) {}
 
@@ -147,6 +200,7 @@ class SceneObject : public Geometry {
 public:
   const Material &getMaterial() const { return this->material; };
   void setMaterial(Material *m) { this->material = *m; };
+  bool isOpaque() const { return !material.Trans(); }
 
   void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
 
@@ -174,6 +228,38 @@ public:
 
   bool intersect(ray &r, isect &i) const;
 
+  // Is there an opaque object along r before tMax? This is an any-hit
+  // query for shadow rays: it stops at the first blocker and fills in no
+  // intersection data. Translucent objects never occlude; check
+  // hasTranslucentObjects() to see if their attenuation still needs
+  // computing with intersect().
+  bool occluded(ray &r, double tMax) const;
+  bool hasTranslucentObjects() const { return translucentObjects; }
+  // Fraction of light getting through along r up to dist: zero behind an
+  // opaque object, reduced by kt through translucent ones.
+  glm::dvec3 transmittance(ray &r, double dist) const;
+  // The same for a ray already known to miss every opaque object
+  glm::dvec3 translucentTransmittance(ray &r, double dist) const;
+
+  // Packet versions of intersect() and occluded() for n rays at once. The
+  // rays walk the BVH together, which saves work when they are coherent
+  // (neighbouring camera rays, shadow rays toward one point or
+  // directional light); incoherent packets fall back to single rays.
+  static const int MaxPacketSize = 16;
+  void intersect(ray *const rays[], isect *const hits[], bool found[],
+                 int n) const;
+  void occluded(ray *const rays[], const double tMax[], bool blocked[],
+                int n) const;
+
+  // Lights for next-event estimation: the scene's lights plus one for
+  // every emissive object whose surface can be sampled. pickLight()
+  // chooses one in proportion to its power and returns the probability of
+  // that choice. emitterPickPdf() is that probability for the light made
+  // from obj, or 0 if obj is not one.
+  bool hasSampledLights() const { return !sampledLights.empty(); }
+  const Light *pickLight(SampleStream &samples, double &pickPdf) const;
+  double emitterPickPdf(const Geometry *obj) const;
+
   auto beginLights() const { return lights.begin(); }
   auto endLights() const { return lights.end(); }
   const auto &getAllLights() const { return lights; }
@@ -200,7 +286,39 @@ public:
 
   const BoundingBox &bounds() const { return sceneBounds; }
 
-  void buildTree();
+  // Decode every texture the parser asked for, spread over the pool.
+  // Throws TextureMapException naming the first texture that failed.
+  void loadTextures(ThreadPool &pool);
+  // Build each object's own tree in parallel, then the scene BVH.
+  void buildTree(ThreadPool &pool);
+
+  // For animation, between frames: move obj, one of this scene's objects,
+  // to xform. The scene BVH is out of date until updateTree() runs.
+  void setObjectTransform(Geometry *obj, const glm::dmat4 &xform);
+  // Bring the scene BVH up to date with the objects' transforms. It is
+  // refitted in place, a linear pass over its nodes, unless that leaves
+  // its SAH cost more than BVHBuildSettings::rebuildRatio times the cost it
+  // was built with; then it is rebuilt. Object trees are kept either way,
+  // since they live in local space. Returns true if it rebuilt.
+  bool updateTree(ThreadPool &pool);
+
+  // What the last buildTree() made. Object trees shared by several
+  // instances count once; their SAH cost is averaged over primitives.
+  struct TreeReport {
+    double seconds = 0.0; // wall time of the whole buildTree()
+    int scenePrims = 0;
+    double sceneSahCost = 0.0;
+    int objectTrees = 0;
+    int objectPrims = 0;
+    int objectReferences = 0; // more than objectPrims with spatial splits
+    double objectBuildSeconds = 0.0; // summed over the object trees
+    double objectSahCost = 0.0;
+    // updateTree() calls since then; sceneSahCost follows the refits
+    int refits = 0;
+    int rebuilds = 0;
+    double updateSeconds = 0.0; // wall time of the last updateTree()
+  };
+  const TreeReport &treeReport() const { return report; }
 private:
   /* Do not try to access these members directly. If you need to iterate
      over e.g. lights, use the following loop:
@@ -228,7 +346,16 @@ private:
   // hasBoundingBoxCapability() are exempt from this requirement.
   BoundingBox sceneBounds;
 
-  BVH<Geometry>* tree;
+  BVH<Geometry>* tree = nullptr;
+  TreeReport report;
+  bool translucentObjects = false;
+
+  void buildSceneTree(ThreadPool &pool);
+  void buildLightSampler();
+  std::vector<std::unique_ptr<Light>> emissiveLights;
+  std::vector<const Light *> sampledLights;
+  std::vector<double> lightCdf;
+  std::unordered_map<const Geometry *, double> emitterPick;
 
   mutable std::mutex intersectionCacheMutex;
 
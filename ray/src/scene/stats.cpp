@@ -0,0 +1,55 @@
+#include "stats.h"
+
+#include <ostream>
+
+RenderStats::Slot RenderStats::slots[RenderStats::NumSlots];
+
+uint64_t RenderStats::total(Counter counter) {
+  uint64_t sum = 0;
+  for (int i = 0; i < NumSlots; i++)
+    sum += slots[i].counts[counter];
+  return sum;
+}
+
+uint64_t RenderStats::totalRays() {
+  return total(PrimaryRays) + total(BounceRays) + total(ShadowRays) +
+         total(RefractionRays);
+}
+
+void RenderStats::reset() {
+  for (int i = 0; i < NumSlots; i++)
+    for (int c = 0; c < NumCounters; c++)
+      slots[i].counts[c] = 0;
+}
+
+const char *RenderStats::name(Counter counter) {
+  switch (counter) {
+  case PrimaryRays:
+    return "primary rays";
+  case BounceRays:
+    return "bounce rays";
+  case ShadowRays:
+    return "shadow rays";
+  case RefractionRays:
+    return "refraction rays";
+  case NodeVisits:
+    return "BVH node visits";
+  case PrimitiveTests:
+    return "primitive tests";
+  case PrimitiveHits:
+    return "primitive hits";
+  case PacketRays:
+    return "packet rays";
+  case PacketFallbacks:
+    return "packet fallbacks";
+  default:
+    return "?";
+  }
+}
+
+void RenderStats::report(std::ostream &out) {
+  if (!enabled())
+    return;
+  for (int c = 0; c < NumCounters; c++)
+    out << "  " << name((Counter)c) << ": " << total((Counter)c) << std::endl;
+}
@@ -0,0 +1,62 @@
+#ifndef STATS_H__
+#define STATS_H__
+
+#include <iosfwd>
+#include <stdint.h>
+
+// Render statistics. Every thread counts into its own cache-line-sized slot,
+// picked by ray_thread_id, so counting never contends; totals are summed
+// only when asked for. Configure with -DRAY_STATS=OFF (or define
+// RAY_STATS=0) to compile every counter away.
+#ifndef RAY_STATS
+#define RAY_STATS 1
+#endif
+
+extern thread_local unsigned int ray_thread_id;
+
+class RenderStats {
+public:
+  enum Counter {
+    PrimaryRays,
+    BounceRays,
+    ShadowRays,
+    RefractionRays,
+    NodeVisits,
+    PrimitiveTests,
+    PrimitiveHits,
+    PacketRays,      // rays traversed as part of a packet
+    PacketFallbacks, // packets too incoherent, traced ray by ray
+    NumCounters
+  };
+
+  // Slot 0 collects threads outside the render pool; render workers use
+  // their index plus one.
+  static const int NumSlots = 256;
+
+  static void add(Counter counter, uint64_t n = 1) {
+#if RAY_STATS
+    slots[ray_thread_id % NumSlots].counts[counter] += n;
+#else
+    (void)counter;
+    (void)n;
+#endif
+  }
+
+  static bool enabled() { return RAY_STATS != 0; }
+
+  // Sum over all threads. Only exact once the workers are idle.
+  static uint64_t total(Counter counter);
+  static uint64_t totalRays();
+  static void reset();
+
+  static const char *name(Counter counter);
+  static void report(std::ostream &out);
+
+private:
+  struct alignas(64) Slot {
+    uint64_t counts[NumCounters];
+  };
+  static Slot slots[NumSlots];
+};
+
+#endif // STATS_H__
@@ -0,0 +1,32 @@
+//
+// CheckUI.h
+//
+// A TraceUI for the checks in this directory: settings are set from code
+// rather than parsed from a command line or a JSON file.
+//
+
+#ifndef __CheckUI_h__
+#define __CheckUI_h__
+
+#include <iostream>
+
+#include "../ui/TraceUI.h"
+
+class CheckUI : public TraceUI {
+public:
+  int run() { return 0; }
+  void alert(const string &msg) { std::cerr << msg << std::endl; }
+
+  void setSize(int size) { m_nSize = size; }
+  void setSeed(unsigned int seed) { m_nSeed = seed; }
+  void setSampler(const string &sampler) { m_sampler = sampler; }
+
+  // Exactly spp paths through every pixel, as with --spp on the command line
+  void setSamples(int spp) {
+    m_nMinSamples = m_nMaxSamples = spp;
+    m_nAaThreshold = 0;
+    m_timeBudget = 0.0;
+  }
+};
+
+#endif
@@ -0,0 +1,138 @@
+//
+// intersect_allocs.cpp
+//
+// Loads each scene given on the command line, then traces a fixed grid of
+// camera rays, shadow rays from their hits back to the eye and the same
+// camera rays as packets, counting calls to operator new while it does.
+// Intersection is meant to run without touching the heap, so the check
+// fails if the count isn't zero.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <glm/geometric.hpp>
+
+#include "../RayTracer.h"
+#include "../scene/scene.h"
+#include "CheckUI.h"
+
+RayTracer *theRayTracer;
+TraceUI *traceUI;
+int TraceUI::m_threads = 1;
+
+namespace {
+
+std::atomic<bool> counting{false};
+std::atomic<long long> allocations{0};
+
+void *allocate(size_t size, size_t align) {
+  if (counting)
+    allocations++;
+  void *p = align ? aligned_alloc(align, (size + align - 1) / align * align)
+                  : malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+const int GridSize = 64;
+const int Rounds = 4;
+
+// Allocations while intersecting the scene GridSize^2 camera rays at a time
+long long countAllocations(RayTracer &tracer) {
+  Scene &scene = tracer.getSceneToEdit();
+  Camera &camera = scene.getCamera();
+  std::vector<ray> rays;
+  std::vector<isect> hits(GridSize * GridSize);
+  for (int y = 0; y < GridSize; y++)
+    for (int x = 0; x < GridSize; x++) {
+      ray r(glm::dvec3(0.0), glm::dvec3(0.0), glm::dvec3(1.0));
+      camera.rayThrough((x + 0.5) / GridSize, (y + 0.5) / GridSize, r);
+      rays.push_back(r);
+    }
+  std::vector<ray *> rayPtrs;
+  std::vector<isect *> hitPtrs;
+  for (int k = 0; k < GridSize * GridSize; k++) {
+    rayPtrs.push_back(&rays[k]);
+    hitPtrs.push_back(&hits[k]);
+  }
+  bool found[Scene::MaxPacketSize];
+
+  counting = true;
+  long long hitCount = 0;
+  for (int round = 0; round < Rounds; round++) {
+    for (int k = 0; k < GridSize * GridSize; k++) {
+      isect i;
+      if (!scene.intersect(rays[k], i))
+        continue;
+      hitCount++;
+      glm::dvec3 p = rays[k].at(i.getT());
+      glm::dvec3 toEye = camera.getEye() - p;
+      double dist = glm::length(toEye);
+      ray shadow(p + i.getN() * RAY_EPSILON, toEye / dist, glm::dvec3(1.0),
+                 ray::SHADOW);
+      scene.occluded(shadow, dist);
+    }
+    for (int k = 0; k < GridSize * GridSize; k += Scene::MaxPacketSize)
+      scene.intersect(&rayPtrs[k], &hitPtrs[k], found, Scene::MaxPacketSize);
+  }
+  counting = false;
+  if (hitCount == 0)
+    fprintf(stderr, "  (no camera ray hit anything)\n");
+  return allocations.exchange(0);
+}
+
+} // anonymous namespace
+
+void *operator new(size_t size) { return allocate(size, 0); }
+void *operator new[](size_t size) { return allocate(size, 0); }
+void *operator new(size_t size, std::align_val_t align) {
+  return allocate(size, (size_t)align);
+}
+void *operator new[](size_t size, std::align_val_t align) {
+  return allocate(size, (size_t)align);
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+  free(p);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s scene...\n", argv[0]);
+    return 1;
+  }
+  TraceUI::m_threads =
+      std::max(std::thread::hardware_concurrency(), (unsigned)1);
+  CheckUI ui;
+  traceUI = &ui;
+
+  bool ok = true;
+  for (int a = 1; a < argc; a++) {
+    RayTracer tracer;
+    theRayTracer = &tracer;
+    ui.setRayTracer(&tracer);
+    if (!tracer.loadScene(argv[a])) {
+      fprintf(stderr, "%s: couldn't load the scene\n", argv[a]);
+      ok = false;
+      continue;
+    }
+    long long count = countAllocations(tracer);
+    fprintf(stderr, "%s: %lld allocations in %d intersection rounds\n",
+            argv[a], count, Rounds);
+    ok = ok && count == 0;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+//
+// sampler_convergence.cpp
+//
+// Renders a path-traced scene at a few sample counts with each sampler and
+// measures the RMSE, in 8-bit units, against a reference rendered from the
+// same scene at many more samples (with a different seed, so its noise is
+// independent of the renders it is compared to). The error of a sampler
+// falls as spp^-slope; for white noise the slope is 1/2, and the
+// low-discrepancy samplers should beat that on a scene this smooth. The
+// check fails unless Halton and Sobol both converge faster than the
+// independent sampler.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../RayTracer.h"
+#include "CheckUI.h"
+
+RayTracer *theRayTracer;
+TraceUI *traceUI;
+int TraceUI::m_threads = 1;
+
+namespace {
+
+const int ImageSize = 32;
+const int ReferenceSamples = 4096;
+const unsigned int ReferenceSeed = 99;
+const int SampleCounts[] = {4, 16, 64, 256};
+const char *const Samplers[] = {"independent", "stratified", "halton",
+                                "sobol"};
+
+std::vector<unsigned char> render(RayTracer &tracer, CheckUI &ui,
+                                  const char *sampler, int spp,
+                                  unsigned int seed) {
+  ui.setSampler(sampler);
+  ui.setSamples(spp);
+  ui.setSeed(seed);
+  int w = ImageSize;
+  int h = (int)(w / tracer.aspectRatio() + 0.5);
+  tracer.traceImage(w, h);
+  tracer.waitRender();
+  unsigned char *buf;
+  tracer.getBuffer(buf, w, h);
+  return std::vector<unsigned char>(buf, buf + w * h * 3);
+}
+
+double rmse(const std::vector<unsigned char> &image,
+            const std::vector<unsigned char> &reference) {
+  double sum = 0.0;
+  for (size_t k = 0; k < image.size(); k++) {
+    double d = (double)image[k] - (double)reference[k];
+    sum += d * d;
+  }
+  return std::sqrt(sum / image.size());
+}
+
+// Least-squares slope of -log(error) against log(spp)
+double convergenceRate(const std::vector<double> &errors) {
+  int n = (int)errors.size();
+  double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+  for (int k = 0; k < n; k++) {
+    double x = std::log((double)SampleCounts[k]);
+    double y = -std::log(std::max(errors[k], 1e-6));
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+  return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s scene\n", argv[0]);
+    return 1;
+  }
+  TraceUI::m_threads =
+      std::max(std::thread::hardware_concurrency(), (unsigned)1);
+  CheckUI ui;
+  traceUI = &ui;
+  RayTracer tracer;
+  theRayTracer = &tracer;
+  ui.setRayTracer(&tracer);
+  if (!tracer.loadScene(argv[1])) {
+    fprintf(stderr, "%s: couldn't load the scene\n", argv[1]);
+    return 1;
+  }
+
+  std::vector<unsigned char> reference =
+      render(tracer, ui, "sobol", ReferenceSamples, ReferenceSeed);
+
+  fprintf(stderr, "%-12s", "spp");
+  for (int spp : SampleCounts)
+    fprintf(stderr, "%8d", spp);
+  fprintf(stderr, "    rate\n");
+
+  double independentRate = 0.0;
+  bool ok = true;
+  for (const char *sampler : Samplers) {
+    std::vector<double> errors;
+    for (int spp : SampleCounts)
+      errors.push_back(rmse(render(tracer, ui, sampler, spp, 0), reference));
+    double rate = convergenceRate(errors);
+
+    fprintf(stderr, "%-12s", sampler);
+    for (double error : errors)
+      fprintf(stderr, "%8.2f", error);
+    fprintf(stderr, "%8.2f\n", rate);
+
+    std::string name = sampler;
+    if (name == "independent")
+      independentRate = rate;
+    else if ((name == "halton" || name == "sobol") && rate <= independentRate) {
+      fprintf(stderr, "%s converges no faster than independent sampling\n",
+              sampler);
+      ok = false;
+    }
+  }
+  return ok ? 0 : 1;
+}
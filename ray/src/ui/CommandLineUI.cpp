@@ -1,5 +1,12 @@
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <filesystem>
 #include <iostream>
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #ifndef _MSC_VER
 #include <unistd.h>
@@ -15,9 +22,34 @@ extern int getopt(int argc, char **argv, const char *optstring);
 #include "CommandLineUI.h"
 
 #include "../RayTracer.h"
+#include "../scene/bvhsimd.h"
+#include "../scene/scene.h"
 
 using namespace std;
 
+namespace {
+
+// Seconds, optionally suffixed with ms, s, m or h
+bool parseDuration(const char *text, double &seconds) {
+  char *end;
+  double value = strtod(text, &end);
+  if (end == text || !(value > 0.0))
+    return false;
+  if (!strcmp(end, "") || !strcmp(end, "s"))
+    seconds = value;
+  else if (!strcmp(end, "ms"))
+    seconds = value / 1000.0;
+  else if (!strcmp(end, "m"))
+    seconds = value * 60.0;
+  else if (!strcmp(end, "h"))
+    seconds = value * 3600.0;
+  else
+    return false;
+  return true;
+}
+
+} // anonymous namespace
+
 // The command line UI simply parses out all the arguments off
 // the command line and stores them locally.
 CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
@@ -25,7 +57,41 @@ CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
   progName = argv[0];
   const char *jsonfile = nullptr;
   string cubemap_file;
-  while ((i = getopt(argc, argv, "tr:w:hj:c:")) != EOF) {
+
+  // The render budgets are long options, which the win32 getopt doesn't
+  // know, so pull them out of argv before getopt sees it.
+  double timeBudget = 0.0;
+  int sppBudget = 0;
+  double noiseBudget = 0.0;
+  int kept = 1;
+  for (int a = 1; a < argc; a++) {
+    string arg = argv[a];
+    string name = arg.substr(0, arg.find('='));
+    if (name != "--time" && name != "--spp" && name != "--noise") {
+      argv[kept++] = argv[a];
+      continue;
+    }
+    const char *value = nullptr;
+    if (name.size() < arg.size())
+      value = argv[a] + name.size() + 1;
+    else if (a + 1 < argc)
+      value = argv[++a];
+    bool ok = value != nullptr;
+    if (ok && name == "--time")
+      ok = parseDuration(value, timeBudget);
+    else if (ok && name == "--spp")
+      ok = (sppBudget = atoi(value)) > 0;
+    else if (ok)
+      ok = (noiseBudget = atof(value)) > 0.0;
+    if (!ok) {
+      std::cerr << "Invalid value for " << name << "." << std::endl;
+      usage();
+      exit(1);
+    }
+  }
+  argc = kept;
+
+  while ((i = getopt(argc, argv, "tr:w:hj:c:s:")) != EOF) {
     switch (i) {
     case 'r':
       m_nDepth = atoi(optarg);
@@ -39,6 +105,9 @@ CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
     case 'c':
       cubemap_file = optarg;
       break;
+    case 's':
+      m_nSeed = strtoul(optarg, nullptr, 10);
+      break;
     case 'h':
       usage();
       exit(1);
@@ -52,6 +121,16 @@ CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
   if (jsonfile) {
     loadFromJson(jsonfile);
   }
+  // A budget on the command line replaces the sampling settings, and any
+  // budget not given is unlimited: the frame keeps taking passes until it
+  // hits the first limit set.
+  if (timeBudget > 0.0 || sppBudget > 0 || noiseBudget > 0.0) {
+    m_timeBudget = timeBudget;
+    m_nMaxSamples = sppBudget > 0 ? sppBudget : INT_MAX;
+    m_nAaThreshold = (int)std::lround(noiseBudget * 1000.0);
+    if (noiseBudget > 0.0)
+      m_nAaThreshold = std::max(m_nAaThreshold, 1);
+  }
   if (!cubemap_file.empty()) {
     smartLoadCubemap(cubemap_file);
   }
@@ -70,22 +149,55 @@ int CommandLineUI::run() {
   raytracer->loadScene(rayName);
 
   if (raytracer->sceneLoaded()) {
+    const Scene::TreeReport &trees = raytracer->getScene().treeReport();
+    fprintf(stderr, "bvh: %s build, %.2fs wall",
+            bvhBuilderName(getBvhBuilder()), trees.seconds);
+    if (trees.objectTrees > 0) {
+      fprintf(stderr, "; %d object tree%s, %d prims", trees.objectTrees,
+              trees.objectTrees == 1 ? "" : "s", trees.objectPrims);
+      if (trees.objectReferences > trees.objectPrims)
+        fprintf(stderr, " (%d references)", trees.objectReferences);
+      fprintf(stderr, ", %.2fs, SAH cost %.2f", trees.objectBuildSeconds,
+              trees.objectSahCost);
+    }
+    fprintf(stderr, "; scene tree, %d objects, SAH cost %.2f\n",
+            trees.scenePrims, trees.sceneSahCost);
+    if (getBvhWidth() > 2)
+      std::cerr << "bvh: " << getBvhWidth() << "-wide, "
+                << wideBoxTestName(wideBoxTest(getBvhSimd())) << " box tests"
+                << std::endl;
     int width = m_nSize;
     int height = (int)(width / raytracer->aspectRatio() + 0.5);
 
     raytracer->traceSetup(width, height);
 
-    clock_t start, end;
-    start = clock();
-
+    auto start = std::chrono::steady_clock::now();
+
+    raytracer->setProgressCallback([this](const RenderProgress &progress) {
+      fprintf(stderr, "\rrender: %3d%%, %.1fs elapsed, %.1fs left ",
+              (int)(100.0 * progress.fraction()), progress.elapsed,
+              progress.eta);
+      // The accumulator holds a usable image after the first pass
+      if (preview()) {
+        unsigned char *buf;
+        int w, h;
+        raytracer->getBuffer(buf, w, h);
+        writeImage(imgName, w, h, buf);
+      }
+    });
     raytracer->traceImage(width, height);
     raytracer->waitRender();
     if (aaSwitch()) {
       raytracer->aaImage();
       raytracer->waitRender();
     }
+    std::cerr << std::endl;
 
-    end = clock();
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+
+    std::cerr << "render: ";
+    raytracer->getTileScheduler().report(std::cerr);
+    RenderStats::report(std::cerr);
 
     // save image
     unsigned char *buf;
@@ -95,10 +207,21 @@ int CommandLineUI::run() {
     if (buf)
       writeImage(imgName, width, height, buf);
 
-    [[maybe_unused]] double t = (double)(end - start) / CLOCKS_PER_SEC;
-    //		int totalRays = TraceUI::resetCount();
-    //		std::cout << "total time = " << t << " seconds,
-    // rays traced = " << totalRays << std::endl;
+    fprintf(stderr, "  %.2fs wall, %.1f samples per pixel",
+            wall.count(), raytracer->getAverageSampleCount());
+    if (RenderStats::enabled())
+      fprintf(stderr, ", %.2f Mrays/s",
+              RenderStats::totalRays() / wall.count() * 1e-6);
+    fprintf(stderr, "\n");
+    if (!getSampleMapFile().empty()) {
+      // A relative path is taken from the output image's directory, not the
+      // working directory, so the map lands next to the image it belongs to
+      std::filesystem::path mapName = getSampleMapFile();
+      if (mapName.is_relative())
+        mapName = std::filesystem::path(imgName).parent_path() / mapName;
+      std::vector<unsigned char> sampleMap = raytracer->getSampleCountImage();
+      writeImage(mapName.string().c_str(), width, height, sampleMap.data());
+    }
     return 0;
   } else {
     std::cerr << "Unable to load ray file '" << rayName << "'" << std::endl;
@@ -116,6 +239,13 @@ void CommandLineUI::usage() {
        << "  -w <#>      set output image width (default " << m_nSize << ")"
        << endl
        << "  -j <FILE>   set parameters from JSON file" << endl
+       << "  -s <#>      set random seed (default " << m_nSeed << ")" << endl
+       << "  --time <T>  render for at most T seconds (or 500ms, 2m, 1h)"
+       << endl
+       << "  --spp <#>   stop at # samples per pixel" << endl
+       << "  --noise <#> stop pixels once their 95% error is under #" << endl
+       << "              with any of these, the limits not given are off"
+       << endl
        << "  -c <FILE>   one Cubemap file, the remainings will be "
           "detected automatically"
        << endl;
@@ -51,10 +51,10 @@ void GraphicalUI::cb_load_scene(Fl_Menu_ *o, void *) {
   if (newfile != NULL) {
     char buf[256];
 
-    if (pUI->raytracer->loadScene(newfile)) {
+    stopTracing(); // terminate the previous rendering
+    if (pUI->raytracer->loadScene(newfile))
       print(buf, "Ray <%s>", newfile);
-      stopTracing(); // terminate the previous rendering
-    } else
+    else
       print(buf, "Ray <Not Loaded>");
 
     pUI->m_mainWindow->label(buf);
@@ -273,8 +273,10 @@ void GraphicalUI::cb_render(Fl_Widget *o, void *) {
       t_elapsed =
           std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
       if ((now - prev) / CLOCKS_PER_SEC * 1000 >= intervalMS) {
-        print(buffer, "Time: %.2f sec, Rays: %u", t_elapsed,
-              TraceUI::getCount());
+        RenderProgress progress = pUI->raytracer->getProgress();
+        print(buffer, "Time: %.2f sec, Rays: %llu, %d%% done, ETA %.1f sec",
+              t_elapsed, TraceUI::getCount(),
+              (int)(100.0 * progress.fraction()), progress.eta);
         pUI->m_traceGlWindow->label(buffer);
         pUI->m_traceGlWindow->refresh();
         prev = now;
@@ -290,8 +292,8 @@ void GraphicalUI::cb_render(Fl_Widget *o, void *) {
     t_now = std::chrono::high_resolution_clock::now();
     auto t_trace =
         std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
-    int imageRays = TraceUI::resetCount();
-    print(buffer, "Time: %.2f sec, Rays: %u, Aa: none", t_trace, imageRays);
+    unsigned long long imageRays = TraceUI::resetCount();
+    print(buffer, "Time: %.2f sec, Rays: %llu, Aa: none", t_trace, imageRays);
     pUI->m_traceGlWindow->label(buffer);
     pUI->m_traceGlWindow->refresh();
     if (pUI->aaSwitch() && !stopTrace) {
@@ -316,7 +318,7 @@ void GraphicalUI::cb_render(Fl_Widget *o, void *) {
         if ((now - prev) / CLOCKS_PER_SEC * 1000 >= intervalMS) {
           print(buffer,
                 "Trace: %.2f, Aa: %.2f, Total: "
-                "%.2f, aaRays: %d",
+                "%.2f, aaRays: %llu",
                 t_trace, t_elapsed, t_total, TraceUI::getCount());
           pUI->m_traceGlWindow->label(buffer);
           pUI->m_traceGlWindow->refresh();
@@ -336,10 +338,10 @@ void GraphicalUI::cb_render(Fl_Widget *o, void *) {
               .count();
       t_total =
           std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
-      int aaRays = TraceUI::resetCount();
+      unsigned long long aaRays = TraceUI::resetCount();
       print(buffer,
-            "Trace: %.2f, Aa: %.2f, Total: %.2f, Rays: %u, "
-            "%u, %u",
+            "Trace: %.2f, Aa: %.2f, Total: %.2f, Rays: %llu, "
+            "%llu, %llu",
             t_trace, t_elapsed, t_total, imageRays, aaRays, imageRays + aaRays);
       pUI->m_traceGlWindow->label(buffer);
       pUI->m_traceGlWindow->refresh();
@@ -435,9 +437,8 @@ void GraphicalUI::stopTracing() {
   stopTrace = true;
   pUI->raytracer->stopTrace = true;
 
-  // Wait for the trace to finish (simple synchronization)
-  while (!pUI->raytracer->checkRender())
-    Fl::wait();
+  // Workers notice the flag after their current tile
+  pUI->raytracer->waitRender();
   //	while(!doneTrace)	Fl::wait();
 }
 
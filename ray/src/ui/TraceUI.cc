@@ -26,10 +26,7 @@ template <typename T> void load(Json &j, const string &field, T &target) {
 
 } // anonymous namespace
 
-TraceUI::TraceUI() {
-  for (unsigned int i = 0; i < MAX_THREADS; i++)
-    rayCount[i] = 0;
-}
+TraceUI::TraceUI() {}
 
 TraceUI::~TraceUI() {}
 
@@ -43,14 +40,35 @@ void TraceUI::loadFromJson(const char *file) {
   load(json, "threads", m_threads);
   load(json, "size", m_nSize);
   load(json, "recursion_depth", m_nDepth);
+  load(json, "rr_depth", m_nRRDepth);
   load(json, "threshold", m_nThreshold);
   load(json, "blocksize", m_nBlockSize);
   load(json, "supersamples", m_nSuperSamples);
   load(json, "aa_threshold", m_nAaThreshold);
+  load(json, "min_samples", m_nMinSamples);
+  load(json, "max_samples", m_nMaxSamples);
+  load(json, "pass_samples", m_nPassSamples);
+  load(json, "time_budget", m_timeBudget);
+  load(json, "sample_map", m_sampleMapFile);
   load(json, "tree_depth", m_nTreeDepth);
   load(json, "leaf_size", m_nLeafSize);
   load(json, "filter_width", m_nFilterWidth);
+  load(json, "bvh_bins", m_nBvhBins);
+  load(json, "bvh_traversal_cost", m_bvhTraversalCost);
+  load(json, "bvh_leaf_cost", m_bvhLeafCost);
+  load(json, "bvh_width", m_nBvhWidth);
+  load(json, "bvh_simd", m_bvhSimd);
+  load(json, "bvh_builder", m_bvhBuilder);
+  load(json, "bvh_split_overlap", m_bvhSplitOverlap);
+  load(json, "bvh_rebuild_ratio", m_bvhRebuildRatio);
+  load(json, "mesh_cache", m_meshCacheDir);
+  load(json, "seed", m_nSeed);
+  load(json, "tile_order", m_tileOrder);
+  load(json, "sampler", m_sampler);
+  load(json, "engine", m_engine);
+  load(json, "packet_size", m_nPacketSize);
   load(json, "anti_alias", m_antiAlias);
+  load(json, "preview", m_preview);
   load(json, "kdtree", m_kdTree);
   load(json, "shadows", m_shadows);
   load(json, "smoothshade", m_smoothshade);
@@ -7,6 +7,7 @@
 #ifndef __TraceUI_h__
 #define __TraceUI_h__
 
+#include "../scene/stats.h"
 #include <memory>
 #include <string>
 #define MAX_THREADS 32
@@ -33,14 +34,35 @@ public:
   // accessors:
   int getSize() const { return m_nSize; }
   int getDepth() const { return m_nDepth; }
+  int getRussianRouletteDepth() const { return m_nRRDepth; }
   int getBlockSize() const { return m_nBlockSize; }
   double getThreshold() const { return (double)m_nThreshold * 0.001; }
   double getAaThreshold() const { return (double)m_nAaThreshold * 0.001; }
   int getSuperSamples() const { return m_nSuperSamples; }
+  int getMinSamples() const { return m_nMinSamples; }
+  int getMaxSamples() const { return m_nMaxSamples; }
+  int getPassSamples() const { return m_nPassSamples; }
+  double getTimeBudget() const { return m_timeBudget; }
+  bool preview() const { return m_preview; }
+  const string &getSampleMapFile() const { return m_sampleMapFile; }
   int getMaxDepth() const { return m_nTreeDepth; }
   int getLeafSize() const { return m_nLeafSize; }
   int getFilterWidth() const { return m_nFilterWidth; }
+  int getBvhBins() const { return m_nBvhBins; }
+  double getBvhTraversalCost() const { return m_bvhTraversalCost; }
+  double getBvhLeafCost() const { return m_bvhLeafCost; }
+  int getBvhWidth() const { return m_nBvhWidth; }
+  const string &getBvhSimd() const { return m_bvhSimd; }
+  const string &getBvhBuilder() const { return m_bvhBuilder; }
+  double getBvhSplitOverlap() const { return m_bvhSplitOverlap; }
+  double getBvhRebuildRatio() const { return m_bvhRebuildRatio; }
+  const string &getMeshCacheDir() const { return m_meshCacheDir; }
   int getThreads() const { return m_threads; }
+  unsigned int getSeed() const { return m_nSeed; }
+  const string &getTileOrder() const { return m_tileOrder; }
+  const string &getSampler() const { return m_sampler; }
+  const string &getEngine() const { return m_engine; }
+  int getPacketSize() const { return m_nPacketSize; }
   bool aaSwitch() const { return m_antiAlias; }
   bool kdSwitch() const { return m_kdTree; }
   bool shadowSw() const { return m_shadows; }
@@ -52,35 +74,11 @@ public:
   bool internalReflection() const { return m_internalReflection; }
   bool backfaceSpecular() const { return m_backfaceSpecular; }
 
-  // ray counter
-  static void addRays(int number, int ctr) {
-    if (ctr >= 0)
-      rayCount[ctr] += number;
-  }
-  static void addRay(int ctr) {
-    if (ctr >= 0)
-      rayCount[ctr]++;
-  }
-  static int getCount(int ctr) { return ctr < 0 ? -1 : rayCount[ctr]; }
-  static int getCount() {
-    int total = 0;
-    for (int i = 0; i < m_threads; i++)
-      total += rayCount[i];
-    return total;
-  }
-  static int resetCount(int ctr) {
-    if (ctr < 0)
-      return -1;
-    int temp = rayCount[ctr];
-    rayCount[ctr] = 0;
-    return temp;
-  }
-  static int resetCount() {
-    int total = 0;
-    for (int i = 0; i < m_threads; i++) {
-      total += rayCount[i];
-      rayCount[i] = 0;
-    }
+  // ray counter, backed by the per-thread RenderStats
+  static unsigned long long getCount() { return RenderStats::totalRays(); }
+  static unsigned long long resetCount() {
+    unsigned long long total = RenderStats::totalRays();
+    RenderStats::reset();
     return total;
   }
 
@@ -94,22 +92,42 @@ protected:
   RayTracer *raytracer = nullptr;
 
   int m_nSize = 512;        // Size of the traced image
-  int m_nDepth = 0;         // Max depth of recursion
+  int m_nDepth = 10;        // Max depth of recursion, or path bounces
+  int m_nRRDepth = 3;       // Path bounces before Russian roulette starts
   int m_nThreshold = 0;     // Threshold for interpolation within block
   int m_nBlockSize = 4;     // Blocksize (square, even, power of 2 preferred)
   int m_nSuperSamples = 3;  // Supersampling rate (1-d) for antialiasing
   int m_nAaThreshold = 100; // Pixel neighborhood difference for supersampling
+                            // and the adaptive sampling noise target
+  int m_nMinSamples = 16;   // Paths per pixel before adaptive stopping
+  int m_nMaxSamples = 100;  // Most paths traced through one pixel
+  int m_nPassSamples = 4;   // Paths per pixel in each progressive pass
+  double m_timeBudget = 0.0; // Wall-clock seconds per frame, 0 for no limit
   int m_nTreeDepth = 15;    // maximum kdTree depth
   int m_nLeafSize = 10;     // target number of objects per leaf
   int m_nFilterWidth = 1;   // width of cubemap filter
-
-  static int rayCount[MAX_THREADS]; // Ray counter
+  int m_nBvhBins = 16;      // SAH buckets per axis when building the BVH
+  double m_bvhTraversalCost = 1.0; // SAH cost of visiting a BVH node
+  double m_bvhLeafCost = 1.0;      // SAH cost of one primitive test
+  int m_nBvhWidth = 4;             // BVH children per node: 2, 4 or 8
+  string m_bvhSimd = "auto";       // BVH box test: auto, avx, sse2 or scalar
+  string m_bvhBuilder = "sah";     // BVH builder: sah, or lbvh for speed
+  double m_bvhSplitOverlap = 1e-5; // SBVH overlap budget, for meshes with spatial_splits
+  double m_bvhRebuildRatio = 1.5;  // SAH growth past which a refit scene BVH is rebuilt
+  unsigned int m_nSeed = 0;        // Seed for all random sampling
+  string m_tileOrder = "hilbert";  // scanline, hilbert or spiral
+  string m_sampler = "sobol";      // independent, stratified, halton or sobol
+  string m_engine = "megakernel";  // megakernel or wavefront
+  int m_nPacketSize = 8;           // Rays per packet in the wavefront engine
+  string m_sampleMapFile;          // Samples-per-pixel AOV, relative to the output image; empty for none
+  string m_meshCacheDir;           // Where to cache OBJ meshes and their BVHs; empty for no cache
 
   // Determines whether or not to show debugging information
   // for individual rays.  Disabled by default for efficiency
   // reasons.
   bool m_displayDebuggingInfo = false;
   bool m_antiAlias = false;    // Is antialiasing on?
+  bool m_preview = false;      // CLI rewrites the image as it refines
   bool m_kdTree = true;        // use kd-tree?
   bool m_shadows = true;       // compute shadows?
   bool m_smoothshade = true;   // turn on/off smoothshading?
@@ -49,18 +49,6 @@ void setMaterialProperty(GLenum property, glm::dvec3 value) {
   glMaterialfv(GL_FRONT_AND_BACK, property, val);
 }
 
-// We need a special overload of this for TrimeshFace since it's not a
-// SceneObject anymore
-void setGLMaterial(const Material &mat, const TrimeshFace *object) {
-  isect i;
-  i.setObject(object->getParent());
-  setMaterialProperty(GL_AMBIENT, mat.ka(i));
-  setMaterialProperty(GL_DIFFUSE, mat.kd(i));
-  setMaterialProperty(GL_SPECULAR, mat.ks(i));
-  setMaterialProperty(GL_EMISSION, mat.ke(i));
-  glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, (GLfloat)mat.shininess(i));
-}
-
 void setGLMaterial(const Material &mat, const SceneObject *object) {
   // Setup material parameters
   isect i;
@@ -342,6 +330,9 @@ void Trimesh::glDrawLocal([[maybe_unused]] int quality, bool actualMaterials,
 
   // We'll try to buy some time back by using display lists.
   if (displayList == 0) {
+    const auto &faces = data->faces;
+    const auto &vertices = data->vertices;
+    const auto &normals = data->normals;
     displayList = glGenLists(1);
     glNewList(displayList, GL_COMPILE);
 
@@ -350,7 +341,7 @@ void Trimesh::glDrawLocal([[maybe_unused]] int quality, bool actualMaterials,
       const int vert1 = (*(*itr))[0];
       const int vert2 = (*(*itr))[1];
       const int vert3 = (*(*itr))[2];
-      setGLMaterial(material, *itr);
+      setGLMaterial(material, this);
 
       if (normals.empty()) {
         const glm::dvec3 &a = vertices[vert1];